@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __ADAPTIVE_HXX__
+#define __ADAPTIVE_HXX__
+
+#include <vector>
+#include <cmath>
+#include <iostream>
+#include "math.hxx"
+#include "utils.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Adaptive sampling (--adaptive). Keeps the sum and the second moment of
+// luminance of camera path contributions of every pixel, from which the
+// relative standard error of the pixel mean is estimated. Pixels below
+// the target error have converged, and only get a camera path with
+// probability 1 / kConvergedRate in each iteration. Light paths still
+// splat into all pixels.
+//
+// Just stopping converged pixels would bias them: paths are heavy tailed,
+// and pixels that have not seen the rare bright paths yet look converged
+// too early. Instead, each iteration a converged pixel gets its camera
+// mean m so far, plus (c - m) * kConvergedRate when it did get a path of
+// contribution c. This is c on average, so the image stays an unbiased
+// average over all iterations, and the framebuffer needs no per-pixel
+// sample counts.
+//
+// All cooperating renderers use the statistics of the main renderer.
+// Camera tiles are exclusive within an iteration, so AddSample needs no
+// synchronization, and Update runs in between iterations.
+class AdaptiveSampling
+{
+public:
+
+    enum
+    {
+        // Camera paths before the error estimate is trusted
+        kMinSamples    = 32,
+        // Converged pixels get a camera path every that many iterations
+        kConvergedRate = 4
+    };
+
+    AdaptiveSampling() : mTargetError(0), mActiveCount(0), mUpdateCount(0) {}
+
+    void Setup(
+        const Vec2f &aResolution,
+        const float aTargetError)
+    {
+        const int pixelCount = int(aResolution.x * aResolution.y);
+
+        mTargetError = aTargetError;
+        mActiveCount = pixelCount;
+        mUpdateCount = 0;
+
+        mSums.assign(pixelCount, Vec3f(0));
+        mLumSqrSums.assign(pixelCount, 0.f);
+        mCounts.assign(pixelCount, 0);
+        mActive.assign(pixelCount, 1);
+    }
+
+    // Whether the pixel gets a camera path this iteration. Converged
+    // pixels are picked by hash of pixel and iteration, independent of
+    // the path's own numbers.
+    bool NeedsSample(const int aPixelIndex) const
+    {
+        if(mActive[aPixelIndex])
+            return true;
+
+        uint hash = uint(aPixelIndex) * 0x9E3779B1u ^ mUpdateCount * 0x85EBCA77u;
+        hash ^= hash >> 15;
+        hash *= 0x2C1B3C6Du;
+        hash ^= hash >> 12;
+
+        return (hash >> 8) % kConvergedRate == 0;
+    }
+
+    // Adds one camera path of the pixel to the statistics, returns what
+    // goes to the framebuffer for it
+    Vec3f AddSample(
+        const int   aPixelIndex,
+        const Vec3f &aColor)
+    {
+        const Vec3f mean = GetMean(aPixelIndex);
+        const float lum  = Luminance(aColor);
+
+        mSums[aPixelIndex]       += aColor;
+        mLumSqrSums[aPixelIndex] += lum * lum;
+        mCounts[aPixelIndex]++;
+
+        if(mActive[aPixelIndex])
+            return aColor;
+
+        return mean + (aColor - mean) * float(kConvergedRate);
+    }
+
+    // Mean of the camera paths of the pixel, what it gets without a path
+    Vec3f GetMean(const int aPixelIndex) const
+    {
+        return mSums[aPixelIndex] / float(std::max(mCounts[aPixelIndex], 1u));
+    }
+
+    // Estimated standard error of the pixel's mean luminance, relative to
+    // the mean. Pixels darker than 0.01 count as that bright, so noise
+    // nobody can see does not keep them active.
+    float GetRelativeError(const int aPixelIndex) const
+    {
+        const float kDarkLuminance = 0.01f;
+        const uint  n = mCounts[aPixelIndex];
+
+        if(n < 2)
+            return 1e36f;
+
+        const float mean     = Luminance(mSums[aPixelIndex]) / float(n);
+        const float variance = std::max(0.f,
+            (mLumSqrSums[aPixelIndex] - float(n) * mean * mean) / float(n - 1));
+
+        return std::sqrt(variance / float(n)) / std::max(mean, kDarkLuminance);
+    }
+
+    // Decides which pixels have converged after an iteration, returns how
+    // many have not. Converged pixels become active again when their new
+    // paths raise the error estimate.
+    int Update()
+    {
+        const int pixelCount = (int)mActive.size();
+        int activeCount = 0;
+
+#pragma omp parallel for reduction(+:activeCount)
+        for(int i=0; i<pixelCount; i++)
+        {
+            const bool converged = mCounts[i] >= kMinSamples &&
+                GetRelativeError(i) <= mTargetError;
+
+            mActive[i] = converged ? 0 : 1;
+            activeCount += mActive[i];
+        }
+
+        mActiveCount = activeCount;
+        mUpdateCount++;
+        return activeCount;
+    }
+
+    int GetActiveCount() const { return mActiveCount; }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Checkpointing, statistics have to continue with the framebuffer.
+    // Unused (and shared) statistics store just their zero pixel count.
+    void SaveState(std::ostream &aoStream) const
+    {
+        const int pixelCount = (int)mActive.size();
+        aoStream.write((const char*)&pixelCount, sizeof(pixelCount));
+
+        if(pixelCount == 0)
+            return;
+
+        aoStream.write((const char*)&mUpdateCount,   sizeof(mUpdateCount));
+        aoStream.write((const char*)&mSums[0],       pixelCount * sizeof(Vec3f));
+        aoStream.write((const char*)&mLumSqrSums[0], pixelCount * sizeof(float));
+        aoStream.write((const char*)&mCounts[0],     pixelCount * sizeof(uint));
+        aoStream.write((const char*)&mActive[0],     pixelCount * sizeof(char));
+    }
+
+    bool LoadState(std::istream &aoStream)
+    {
+        int pixelCount = 0;
+        aoStream.read((char*)&pixelCount, sizeof(pixelCount));
+
+        if(aoStream.fail() || pixelCount != (int)mActive.size())
+            return false;
+
+        if(pixelCount == 0)
+            return true;
+
+        aoStream.read((char*)&mUpdateCount,   sizeof(mUpdateCount));
+        aoStream.read((char*)&mSums[0],       pixelCount * sizeof(Vec3f));
+        aoStream.read((char*)&mLumSqrSums[0], pixelCount * sizeof(float));
+        aoStream.read((char*)&mCounts[0],     pixelCount * sizeof(uint));
+        aoStream.read((char*)&mActive[0],     pixelCount * sizeof(char));
+
+        mActiveCount = 0;
+        for(int i=0; i<pixelCount; i++)
+            mActiveCount += mActive[i];
+
+        return !aoStream.fail();
+    }
+
+private:
+
+    float               mTargetError; // Relative standard error to reach
+    int                 mActiveCount;
+    uint                mUpdateCount; // Iterations so far, picks converged pixels
+
+    std::vector<Vec3f>  mSums;        // Sum of camera path contributions
+    std::vector<float>  mLumSqrSums;  // Sum of their squared luminances
+    std::vector<uint>   mCounts;      // Number of camera paths
+    std::vector<char>   mActive;      // Whether the pixel has not converged
+};
+
+#endif //__ADAPTIVE_HXX__
@@ -110,12 +110,27 @@ public:
         const Material &mat = aScene.GetMaterial(aIsect.matID);
         GetComponentProbabilities(mat, mProbabilities);
 
-        mIsDelta = (mProbabilities.diffProb == 0) && (mProbabilities.phongProb == 0);
-
         // now it becomes valid
         mMaterialID = aIsect.matID;
     }
 
+    // Rebuilds a valid BSDF from its world space normal, fixed direction,
+    // and material, e.g., for a stored light vertex
+    void Setup(
+        const Vec3f &aWorldNormal,
+        const Vec3f &aWorldDirFix,
+        const int   aMaterialID,
+        const Scene &aScene)
+    {
+        mFrame.SetFromZ(aWorldNormal);
+        mLocalDirFix = mFrame.ToLocal(aWorldDirFix);
+
+        const Material &mat = aScene.GetMaterial(aMaterialID);
+        GetComponentProbabilities(mat, mProbabilities);
+
+        mMaterialID = aMaterialID;
+    }
+
     /* \brief Given a direction, evaluates BSDF
      *
      * Returns value of BSDF, as well as cosine for the
@@ -262,6 +277,8 @@ public:
     float ContinuationProb() const  { return mContinuationProb;            }
     float CosThetaFix() const       { return mLocalDirFix.z;               }
     Vec3f WorldDirFix() const       { return mFrame.ToWorld(mLocalDirFix); }
+    Vec3f WorldNormal() const       { return mFrame.mZ;                    }
+    int   MaterialID() const        { return mMaterialID;                  }
 
 private:
 
@@ -501,40 +518,31 @@ private:
         }
     }
 
-    ////////////////////////////////////////////////////////////////////////////
-    // Albedo methods
-    ////////////////////////////////////////////////////////////////////////////
-
-    float AlbedoDiffuse(const Material& aMaterial) const
-    {
-        return Luminance(aMaterial.mDiffuseReflectance);
-    }
-
-    float AlbedoPhong(const Material& aMaterial) const
-    {
-        return Luminance(aMaterial.mPhongReflectance);
-    }
-
-    float AlbedoReflect(const Material& aMaterial) const
-    {
-        return Luminance(aMaterial.mMirrorReflectance);
-    }
-
-    float AlbedoRefract(const Material& aMaterial) const
-    {
-        return aMaterial.mIOR > 0.f ? 1.f : 0.f;
-    }
-
+    // Non-Fresnel materials have their probabilities ready from
+    // Material::Precompute, glass has to weight reflection and refraction
+    // by the Fresnel term of the fixed direction
     void GetComponentProbabilities(
         const Material         &aMaterial,
         ComponentProbabilities &oProbabilities)
     {
+        if(!aMaterial.mHasFresnel)
+        {
+            mReflectCoeff = 1.f;
+            oProbabilities.diffProb  = aMaterial.mDiffProb;
+            oProbabilities.phongProb = aMaterial.mPhongProb;
+            oProbabilities.reflProb  = aMaterial.mReflProb;
+            oProbabilities.refrProb  = aMaterial.mRefrProb;
+            mContinuationProb = aMaterial.mContinuationProb;
+            mIsDelta          = aMaterial.mIsDelta;
+            return;
+        }
+
         mReflectCoeff = FresnelDielectric(mLocalDirFix.z, aMaterial.mIOR);
 
-        const float albedoDiffuse = AlbedoDiffuse(aMaterial);
-        const float albedoPhong   = AlbedoPhong(aMaterial);
-        const float albedoReflect = mReflectCoeff         * AlbedoReflect(aMaterial);
-        const float albedoRefract = (1.f - mReflectCoeff) * AlbedoRefract(aMaterial);
+        const float albedoDiffuse = aMaterial.mAlbedoDiffuse;
+        const float albedoPhong   = aMaterial.mAlbedoPhong;
+        const float albedoReflect = mReflectCoeff         * aMaterial.mAlbedoReflect;
+        const float albedoRefract = (1.f - mReflectCoeff) * aMaterial.mAlbedoRefract;
 
         const float totalAlbedo = albedoDiffuse + albedoPhong + albedoReflect + albedoRefract;
 
@@ -563,6 +571,8 @@ private:
 
             mContinuationProb = std::min(1.f, std::max(0.f, mContinuationProb));
         }
+
+        mIsDelta = (oProbabilities.diffProb == 0) && (oProbabilities.phongProb == 0);
     }
 
 private:
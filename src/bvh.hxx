@@ -0,0 +1,865 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __BVH_HXX__
+#define __BVH_HXX__
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Bounding volume hierarchy
+//
+// Built top-down with binned surface area heuristic (SAH). Nodes are
+// stored in a single array in depth-first order, so the first child of
+// an inner node immediately follows it and only the second child index
+// has to be stored. Primitives are reordered so each leaf references
+// a contiguous range of them.
+//
+// BvhBase implements building and traversal, the derived class tDerived
+// owns the primitives and intersects leaf ranges of them, see Bvh below
+// and TriangleMesh in mesh.hxx. Nodes are plain data, so the array can
+// also be used in place from a mapped cache file.
+
+struct BvhNode
+{
+    Vec3f mBBoxMin;
+    int   mOffset; // Leaf: first primitive, inner: second child
+    Vec3f mBBoxMax;
+    short mCount;  // Number of primitives in leaf, 0 for inner nodes
+    short mAxis;   // Split axis of inner node
+};
+
+// Primitive reference used during build
+struct BvhBuildItem
+{
+    Vec3f mBBoxMin;
+    Vec3f mBBoxMax;
+    Vec3f mCentroid;
+    int   mIndex;
+};
+
+// Per-ray data of tDerived leaves that need none
+struct BvhNoLeafRay
+{
+    void Setup(const Ray &) {}
+};
+
+// tDerived provides type LeafRay, data its leaves need per ray, set up once
+// per traversal by LeafRay::Setup(aRay), and intersection of leaf aLeaf:
+//   bool IntersectLeaf (aLeaf, aRay, aLeafRay, oResult)  closest hit
+//   bool IntersectLeafP(aLeaf, aRay, aLeafRay, oResult)  any hit
+//   void IntersectLeafN(aLeaf, aRays, aLeafRays, aoResults, aoHits, aCount, aMask)
+//   void OccludedLeafN (aLeaf, aRays, aLeafRays, aoResults, aoOccluded, aCount, aMask)
+// with the same semantics as the AbstractGeometry methods, where bit j of
+// aMask is set when ray j hits the leaf bounding box. A leaf covers
+// primitives [mOffset, mOffset + mCount) after building, tDerived may
+// change mOffset to index its own storage.
+template<class tDerived>
+class BvhBase : public AbstractGeometry
+{
+protected:
+
+    typedef BvhNode      Node;
+    typedef BvhBuildItem BuildItem;
+
+    enum
+    {
+        kBinCount     = 16,
+        kMaxLeafSize  = 4,
+        kMaxDepth     = 64,
+        kPacketSize   = 4   // Rays traversed together by IntersectN/OccludedN
+    };
+
+    // Ray packet with per-ray data needed by the slab test, in SoA layout
+    struct Packet
+    {
+        float mOrg[3][kPacketSize];
+        float mInvDir[3][kPacketSize];
+        float mTMin[kPacketSize];
+        int   mCount;
+    };
+
+    BvhBase() :
+        mNodes(NULL),
+        mNodeCount(0)
+    {}
+
+public:
+
+    // Closest hit, traverses nearer child first
+    virtual bool Intersect(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        if(mNodeCount == 0)
+            return false;
+
+        const Vec3f invDir = GetInvDir(aRay.dir);
+        const int   dirIsNeg[3] = {
+            invDir.x < 0.f, invDir.y < 0.f, invDir.z < 0.f };
+
+        typename tDerived::LeafRay leafRay;
+        leafRay.Setup(aRay);
+
+        int  stack[kMaxDepth];
+        int  stackSize = 0;
+        int  nodeIdx   = 0;
+        bool anyIntersection = false;
+
+        for(;;)
+        {
+            const Node &node = mNodes[nodeIdx];
+
+            if(IntersectBox(node, aRay, invDir, oResult.dist))
+            {
+                if(node.mCount > 0)
+                {
+                    if(Derived().IntersectLeaf(node, aRay, leafRay, oResult))
+                        anyIntersection = true;
+                }
+                else
+                {
+                    // Visit the closer child first, postpone the other
+                    if(dirIsNeg[node.mAxis])
+                    {
+                        stack[stackSize++] = nodeIdx + 1;
+                        nodeIdx = node.mOffset;
+                    }
+                    else
+                    {
+                        stack[stackSize++] = node.mOffset;
+                        nodeIdx = nodeIdx + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if(stackSize == 0)
+                break;
+            nodeIdx = stack[--stackSize];
+        }
+
+        return anyIntersection;
+    }
+
+    // Any hit, terminates on the first found intersection
+    virtual bool IntersectP(
+        const Ray &aRay,
+        Isect     &oResult) const
+    {
+        if(mNodeCount == 0)
+            return false;
+
+        const Vec3f invDir = GetInvDir(aRay.dir);
+
+        typename tDerived::LeafRay leafRay;
+        leafRay.Setup(aRay);
+
+        int stack[kMaxDepth];
+        int stackSize = 0;
+        int nodeIdx   = 0;
+
+        for(;;)
+        {
+            const Node &node = mNodes[nodeIdx];
+
+            if(IntersectBox(node, aRay, invDir, oResult.dist))
+            {
+                if(node.mCount > 0)
+                {
+                    if(Derived().IntersectLeafP(node, aRay, leafRay, oResult))
+                        return true;
+                }
+                else
+                {
+                    stack[stackSize++] = node.mOffset;
+                    nodeIdx = nodeIdx + 1;
+                    continue;
+                }
+            }
+
+            if(stackSize == 0)
+                break;
+            nodeIdx = stack[--stackSize];
+        }
+
+        return false;
+    }
+
+    // Closest hits, traverses packets of kPacketSize consecutive rays
+    virtual void IntersectN(
+        const Ray *aRays,
+        Isect     *aoResults,
+        char      *aoHits,
+        int       aCount) const
+    {
+        for(int i=0; i<aCount; i+=kPacketSize)
+        {
+            TraversePacket<false>(aRays + i, aoResults + i, aoHits + i,
+                std::min(int(kPacketSize), aCount - i));
+        }
+    }
+
+    // Any hits, traverses packets of kPacketSize consecutive rays
+    virtual void OccludedN(
+        const Ray *aRays,
+        Isect     *aoResults,
+        char      *aoOccluded,
+        int       aCount) const
+    {
+        for(int i=0; i<aCount; i+=kPacketSize)
+        {
+            TraversePacket<true>(aRays + i, aoResults + i, aoOccluded + i,
+                std::min(int(kPacketSize), aCount - i));
+        }
+    }
+
+    virtual void GrowBBox(
+        Vec3f &aoBBoxMin,
+        Vec3f &aoBBoxMax)
+    {
+        if(mNodeCount == 0)
+            return;
+
+        ExtendBBox(aoBBoxMin, aoBBoxMax, mBBoxMin, mBBoxMax);
+    }
+
+protected:
+
+    //////////////////////////////////////////////////////////////////////////
+    // Building, for use by tDerived
+
+    // Builds nodes over items with bounding boxes of the primitives set,
+    // reorders the items so item i is the i-th primitive in leaf order.
+    // Leaves testing aLanes primitives at once cost as much as one, which
+    // SAH takes into account.
+    void BuildNodes(
+        std::vector<BuildItem> &aoItems,
+        int                    aLanes = 1)
+    {
+        mNodeStorage.clear();
+        mNodes     = NULL;
+        mNodeCount = 0;
+
+        if(aoItems.empty())
+            return;
+
+        mBBoxMin = Vec3f( 1e36f);
+        mBBoxMax = Vec3f(-1e36f);
+
+        for(int i=0; i<(int)aoItems.size(); i++)
+        {
+            BuildItem &item = aoItems[i];
+            ExtendBBox(mBBoxMin, mBBoxMax, item.mBBoxMin, item.mBBoxMax);
+
+            // Slightly enlarge the box, as axis aligned triangles have flat
+            // boxes and rounding in the slab test could miss their edges
+            const float margin = 1e-4f * (item.mBBoxMax - item.mBBoxMin).Max() + 1e-6f;
+            item.mBBoxMin -= Vec3f(margin);
+            item.mBBoxMax += Vec3f(margin);
+
+            item.mCentroid = (item.mBBoxMin + item.mBBoxMax) * 0.5f;
+        }
+
+        mNodeStorage.reserve(2 * aoItems.size());
+        BuildNode(aoItems, 0, (int)aoItems.size(), 0, aLanes);
+
+        mNodes     = &mNodeStorage[0];
+        mNodeCount = (int)mNodeStorage.size();
+    }
+
+    // Uses nodes stored elsewhere, which have to outlive this
+    void SetNodes(
+        const Node  *aNodes,
+        int         aNodeCount,
+        const Vec3f &aBBoxMin,
+        const Vec3f &aBBoxMax)
+    {
+        mNodeStorage.clear();
+        mNodes     = aNodes;
+        mNodeCount = aNodeCount;
+        mBBoxMin   = aBBoxMin;
+        mBBoxMax   = aBBoxMax;
+    }
+
+private:
+
+    const tDerived& Derived() const
+    {
+        return *static_cast<const tDerived*>(this);
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Traversal helpers
+
+    static Vec3f GetInvDir(const Vec3f &aDir)
+    {
+        // Division by zero gives infinity, which the slab test handles
+#if defined(GEOMETRY_SSE)
+        float inv[4];
+        _mm_storeu_ps(inv, _mm_div_ps(_mm_set1_ps(1.f),
+            _mm_setr_ps(aDir.x, aDir.y, aDir.z, 1.f)));
+        return Vec3f(inv[0], inv[1], inv[2]);
+#else
+        return Vec3f(1.f / aDir.x, 1.f / aDir.y, 1.f / aDir.z);
+#endif
+    }
+
+    // Slab test against node bounding box within [aRay.tmin, aMaxDist]
+    static bool IntersectBox(
+        const Node  &aNode,
+        const Ray   &aRay,
+        const Vec3f &aInvDir,
+        float       aMaxDist)
+    {
+        float tNear = aRay.tmin;
+        float tFar  = aMaxDist;
+
+        for(int i=0; i<3; i++)
+        {
+            float t0 = (aNode.mBBoxMin.Get(i) - aRay.org.Get(i)) * aInvDir.Get(i);
+            float t1 = (aNode.mBBoxMax.Get(i) - aRay.org.Get(i)) * aInvDir.Get(i);
+
+            if(t0 > t1) std::swap(t0, t1);
+
+            // Written so that NaNs (0 * inf) do not shrink the interval
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar  = t1 < tFar  ? t1 : tFar;
+
+            if(tNear > tFar)
+                return false;
+        }
+
+        return true;
+    }
+
+    // Traverses packet of up to kPacketSize rays. A node is visited when any
+    // of the rays hits its box, leaves get the mask of rays that do. With
+    // tAnyHit, the traversal ends once all rays are occluded.
+    template<bool tAnyHit>
+    void TraversePacket(
+        const Ray *aRays,
+        Isect     *aoResults,
+        char      *aoFlags,
+        int       aCount) const
+    {
+        if(mNodeCount == 0)
+            return;
+
+        Packet packet;
+        packet.mCount = aCount;
+
+        typename tDerived::LeafRay leafRays[kPacketSize];
+        for(int j=0; j<aCount; j++)
+            leafRays[j].Setup(aRays[j]);
+
+        for(int j=0; j<kPacketSize; j++)
+        {
+            // Unused lanes repeat the last ray
+            const Ray  &ray    = aRays[std::min(j, aCount - 1)];
+            const Vec3f invDir = GetInvDir(ray.dir);
+
+            for(int i=0; i<3; i++)
+            {
+                packet.mOrg[i][j]    = ray.org.Get(i);
+                packet.mInvDir[i][j] = invDir.Get(i);
+            }
+            packet.mTMin[j] = ray.tmin;
+        }
+
+        // Order of children is decided by the first ray
+        const int dirIsNeg[3] = {
+            packet.mInvDir[0][0] < 0.f,
+            packet.mInvDir[1][0] < 0.f,
+            packet.mInvDir[2][0] < 0.f };
+
+        int stack[kMaxDepth];
+        int stackSize = 0;
+        int nodeIdx   = 0;
+
+        for(;;)
+        {
+            const Node &node = mNodes[nodeIdx];
+
+            const int mask = IntersectBox(node, packet, aoResults, tAnyHit ? aoFlags : NULL);
+            if(mask)
+            {
+                if(node.mCount > 0)
+                {
+                    if(tAnyHit)
+                        Derived().OccludedLeafN(node, aRays, leafRays,
+                            aoResults, aoFlags, aCount, mask);
+                    else
+                        Derived().IntersectLeafN(node, aRays, leafRays,
+                            aoResults, aoFlags, aCount, mask);
+
+                    if(tAnyHit && AllSet(aoFlags, aCount))
+                        return;
+                }
+                else
+                {
+                    // Visit the closer child first, postpone the other
+                    if(dirIsNeg[node.mAxis])
+                    {
+                        stack[stackSize++] = nodeIdx + 1;
+                        nodeIdx = node.mOffset;
+                    }
+                    else
+                    {
+                        stack[stackSize++] = node.mOffset;
+                        nodeIdx = nodeIdx + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if(stackSize == 0)
+                break;
+            nodeIdx = stack[--stackSize];
+        }
+    }
+
+    static bool AllSet(
+        const char *aFlags,
+        int        aCount)
+    {
+        for(int j=0; j<aCount; j++)
+            if(!aFlags[j]) return false;
+        return true;
+    }
+
+    // Slab test of packet against node bounding box, with the same arithmetic
+    // as the single ray one. Returns a mask with bit j set when ray j, not
+    // marked in aSkip (optional), hits the box within [tmin, aResults[j].dist].
+    static int IntersectBox(
+        const Node   &aNode,
+        const Packet &aPacket,
+        const Isect  *aResults,
+        const char   *aSkip)
+    {
+#if defined(GEOMETRY_SSE)
+        __m128 tNear = _mm_loadu_ps(aPacket.mTMin);
+        __m128 tFar  = _mm_setr_ps(
+            aResults[0].dist,
+            aResults[std::min(1, aPacket.mCount - 1)].dist,
+            aResults[std::min(2, aPacket.mCount - 1)].dist,
+            aResults[std::min(3, aPacket.mCount - 1)].dist);
+
+        for(int i=0; i<3; i++)
+        {
+            const __m128 org    = _mm_loadu_ps(aPacket.mOrg[i]);
+            const __m128 invDir = _mm_loadu_ps(aPacket.mInvDir[i]);
+
+            const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aNode.mBBoxMin.Get(i)), org), invDir);
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aNode.mBBoxMax.Get(i)), org), invDir);
+
+            // Same as if(t0 > t1) swap, blends keep the NaN behavior
+            const __m128 swap = _mm_cmpgt_ps(t0, t1);
+            const __m128 lo   = _mm_or_ps(_mm_and_ps(swap, t1), _mm_andnot_ps(swap, t0));
+            const __m128 hi   = _mm_or_ps(_mm_and_ps(swap, t0), _mm_andnot_ps(swap, t1));
+
+            const __m128 nearer = _mm_cmpgt_ps(lo, tNear);
+            const __m128 farther = _mm_cmplt_ps(hi, tFar);
+            tNear = _mm_or_ps(_mm_and_ps(nearer, lo), _mm_andnot_ps(nearer, tNear));
+            tFar  = _mm_or_ps(_mm_and_ps(farther, hi), _mm_andnot_ps(farther, tFar));
+        }
+
+        int hits = ~_mm_movemask_ps(_mm_cmpgt_ps(tNear, tFar)) & ((1 << aPacket.mCount) - 1);
+
+        if(aSkip)
+        {
+            for(int j=0; j<aPacket.mCount; j++)
+                if(aSkip[j]) hits &= ~(1 << j);
+        }
+
+        return hits;
+#else
+        int hits = 0;
+
+        for(int j=0; j<aPacket.mCount; j++)
+        {
+            if(aSkip && aSkip[j])
+                continue;
+
+            float tNear = aPacket.mTMin[j];
+            float tFar  = aResults[j].dist;
+            bool  hit   = true;
+
+            for(int i=0; i<3 && hit; i++)
+            {
+                float t0 = (aNode.mBBoxMin.Get(i) - aPacket.mOrg[i][j]) * aPacket.mInvDir[i][j];
+                float t1 = (aNode.mBBoxMax.Get(i) - aPacket.mOrg[i][j]) * aPacket.mInvDir[i][j];
+
+                if(t0 > t1) std::swap(t0, t1);
+
+                tNear = t0 > tNear ? t0 : tNear;
+                tFar  = t1 < tFar  ? t1 : tFar;
+
+                hit = !(tNear > tFar);
+            }
+
+            if(hit)
+                hits |= 1 << j;
+        }
+
+        return hits;
+#endif
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Building
+
+protected:
+
+    static float HalfArea(
+        const Vec3f &aBBoxMin,
+        const Vec3f &aBBoxMax)
+    {
+        const Vec3f d = aBBoxMax - aBBoxMin;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    static void ExtendBBox(
+        Vec3f       &aoBBoxMin,
+        Vec3f       &aoBBoxMax,
+        const Vec3f &aPointMin,
+        const Vec3f &aPointMax)
+    {
+        for(int j=0; j<3; j++)
+        {
+            aoBBoxMin.Get(j) = std::min(aoBBoxMin.Get(j), aPointMin.Get(j));
+            aoBBoxMax.Get(j) = std::max(aoBBoxMax.Get(j), aPointMax.Get(j));
+        }
+    }
+
+private:
+
+    // Recursively builds node over items [aBegin, aEnd), returns its index
+    int BuildNode(
+        std::vector<BuildItem> &aItems,
+        int aBegin,
+        int aEnd,
+        int aDepth,
+        int aLanes)
+    {
+        const int nodeIdx = (int)mNodeStorage.size();
+        mNodeStorage.push_back(Node());
+
+        Vec3f bboxMin( 1e36f), bboxMax(-1e36f);
+        Vec3f centMin( 1e36f), centMax(-1e36f);
+
+        for(int i=aBegin; i<aEnd; i++)
+        {
+            ExtendBBox(bboxMin, bboxMax, aItems[i].mBBoxMin, aItems[i].mBBoxMax);
+            ExtendBBox(centMin, centMax, aItems[i].mCentroid, aItems[i].mCentroid);
+        }
+
+        mNodeStorage[nodeIdx].mBBoxMin = bboxMin;
+        mNodeStorage[nodeIdx].mBBoxMax = bboxMax;
+
+        const int count = aEnd - aBegin;
+
+        int   splitAxis = -1;
+        int   splitBin  = 0;
+        float splitCost = LeafCost(count, aLanes); // cost of making a leaf
+
+        // Two nodes never fit into the stack at maximal depth
+        if(count > 1 && aDepth < kMaxDepth - 2)
+        {
+            const float leafArea = HalfArea(bboxMin, bboxMax);
+
+            for(int axis=0; axis<3; axis++)
+            {
+                const float extent = centMax.Get(axis) - centMin.Get(axis);
+                if(extent <= 0.f)
+                    continue;
+
+                Vec3f binMin[kBinCount], binMax[kBinCount];
+                int   binCount[kBinCount];
+
+                for(int b=0; b<kBinCount; b++)
+                {
+                    binMin[b]   = Vec3f( 1e36f);
+                    binMax[b]   = Vec3f(-1e36f);
+                    binCount[b] = 0;
+                }
+
+                const float binScale = kBinCount / extent;
+                for(int i=aBegin; i<aEnd; i++)
+                {
+                    const int b = GetBin(aItems[i].mCentroid.Get(axis),
+                        centMin.Get(axis), binScale);
+                    binCount[b]++;
+                    ExtendBBox(binMin[b], binMax[b], aItems[i].mBBoxMin, aItems[i].mBBoxMax);
+                }
+
+                // Sweep from the right to get areas of all right sides
+                float rightArea[kBinCount];
+                int   rightCount[kBinCount];
+                {
+                    Vec3f accMin( 1e36f), accMax(-1e36f);
+                    int   accCount = 0;
+                    for(int b=kBinCount-1; b>0; b--)
+                    {
+                        ExtendBBox(accMin, accMax, binMin[b], binMax[b]);
+                        accCount     += binCount[b];
+                        rightCount[b] = accCount;
+                        rightArea[b]  = accCount > 0 ? HalfArea(accMin, accMax) : 0.f;
+                    }
+                }
+
+                // Sweep from the left, evaluating SAH for split after bin b-1
+                Vec3f accMin( 1e36f), accMax(-1e36f);
+                int   accCount = 0;
+                for(int b=1; b<kBinCount; b++)
+                {
+                    ExtendBBox(accMin, accMax, binMin[b-1], binMax[b-1]);
+                    accCount += binCount[b-1];
+
+                    if(accCount == 0 || rightCount[b] == 0)
+                        continue;
+
+                    // Traversal cost of 1 relative to primitive intersection
+                    const float cost = 1.f + (
+                        HalfArea(accMin, accMax) * LeafCost(accCount, aLanes) +
+                        rightArea[b] * LeafCost(rightCount[b], aLanes)) / leafArea;
+
+                    if(cost < splitCost)
+                    {
+                        splitCost = cost;
+                        splitAxis = axis;
+                        splitBin  = b;
+                    }
+                }
+            }
+        }
+
+        // Make leaf when SAH finds no split cheaper than intersecting all
+        if(splitAxis < 0)
+        {
+            // Large leaves are not allowed, those are split in the middle
+            if(count <= kMaxLeafSize || aDepth >= kMaxDepth - 2)
+            {
+                mNodeStorage[nodeIdx].mOffset = aBegin;
+                mNodeStorage[nodeIdx].mCount  = short(count);
+                mNodeStorage[nodeIdx].mAxis   = 0;
+                return nodeIdx;
+            }
+
+            splitAxis = 0;
+            for(int axis=1; axis<3; axis++)
+            {
+                if(centMax.Get(axis) - centMin.Get(axis) >
+                   centMax.Get(splitAxis) - centMin.Get(splitAxis))
+                    splitAxis = axis;
+            }
+            splitBin = -1;
+        }
+
+        int mid;
+
+        if(splitBin < 0)
+        {
+            // Median split, used when all centroids coincide or SAH prefers leaf
+            mid = (aBegin + aEnd) / 2;
+            std::nth_element(aItems.begin() + aBegin, aItems.begin() + mid,
+                aItems.begin() + aEnd, CentroidLess(splitAxis));
+        }
+        else
+        {
+            const float binScale = kBinCount /
+                (centMax.Get(splitAxis) - centMin.Get(splitAxis));
+            mid = aBegin;
+            for(int i=aBegin; i<aEnd; i++)
+            {
+                if(GetBin(aItems[i].mCentroid.Get(splitAxis),
+                    centMin.Get(splitAxis), binScale) < splitBin)
+                {
+                    std::swap(aItems[i], aItems[mid]);
+                    mid++;
+                }
+            }
+        }
+
+        BuildNode(aItems, aBegin, mid, aDepth + 1, aLanes);
+        const int secondChild = BuildNode(aItems, mid, aEnd, aDepth + 1, aLanes);
+
+        mNodeStorage[nodeIdx].mOffset = secondChild;
+        mNodeStorage[nodeIdx].mCount  = 0;
+        mNodeStorage[nodeIdx].mAxis   = short(splitAxis);
+
+        return nodeIdx;
+    }
+
+    // Number of tests of aLanes primitives needed for aCount of them
+    static float LeafCost(
+        int aCount,
+        int aLanes)
+    {
+        return float((aCount + aLanes - 1) / aLanes);
+    }
+
+    static int GetBin(
+        float aCentroid,
+        float aMin,
+        float aBinScale)
+    {
+        const int b = int((aCentroid - aMin) * aBinScale);
+        return std::min(kBinCount - 1, std::max(0, b));
+    }
+
+    struct CentroidLess
+    {
+        CentroidLess(int aAxis) : mAxis(aAxis) {}
+
+        bool operator()(const BuildItem &a, const BuildItem &b) const
+        {
+            return a.mCentroid.Get(mAxis) < b.mCentroid.Get(mAxis);
+        }
+
+        int mAxis;
+    };
+
+protected:
+
+    std::vector<Node> mNodeStorage; // Nodes built by BuildNodes
+    const Node        *mNodes;      // Nodes in use, built or set
+    int               mNodeCount;
+    Vec3f             mBBoxMin;     // Exact bounds, nodes are enlarged
+    Vec3f             mBBoxMax;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Bounding volume hierarchy over arbitrary geometry
+
+class Bvh : public BvhBase<Bvh>
+{
+    friend class BvhBase<Bvh>;
+
+public:
+
+    // Takes over all geometry from aList, which is left empty
+    Bvh(GeometryList &aList)
+    {
+        std::vector<AbstractGeometry*> geometry;
+        geometry.swap(aList.mGeometry);
+
+        std::vector<BuildItem> items(geometry.size());
+        for(int i=0; i<(int)geometry.size(); i++)
+        {
+            items[i].mBBoxMin = Vec3f( 1e36f);
+            items[i].mBBoxMax = Vec3f(-1e36f);
+            geometry[i]->GrowBBox(items[i].mBBoxMin, items[i].mBBoxMax);
+            items[i].mIndex = i;
+        }
+
+        BuildNodes(items);
+
+        // Reorder geometry so leaves reference contiguous ranges
+        mGeometry.resize(items.size());
+        for(int i=0; i<(int)items.size(); i++)
+            mGeometry[i] = geometry[items[i].mIndex];
+    }
+
+    virtual ~Bvh()
+    {
+        for(int i=0; i<(int)mGeometry.size(); i++)
+            delete mGeometry[i];
+    }
+
+private:
+
+    typedef BvhNoLeafRay LeafRay;
+
+    bool IntersectLeaf(
+        const Node    &aLeaf,
+        const Ray     &aRay,
+        const LeafRay &,
+        Isect         &oResult) const
+    {
+        bool anyIntersection = false;
+
+        for(int i=aLeaf.mOffset; i<aLeaf.mOffset + aLeaf.mCount; i++)
+        {
+            if(mGeometry[i]->Intersect(aRay, oResult))
+                anyIntersection = true;
+        }
+
+        return anyIntersection;
+    }
+
+    bool IntersectLeafP(
+        const Node    &aLeaf,
+        const Ray     &aRay,
+        const LeafRay &,
+        Isect         &oResult) const
+    {
+        for(int i=aLeaf.mOffset; i<aLeaf.mOffset + aLeaf.mCount; i++)
+        {
+            if(mGeometry[i]->IntersectP(aRay, oResult))
+                return true;
+        }
+
+        return false;
+    }
+
+    // Objects get the whole packet, so they can use their batched paths
+    // and cull the rays themselves
+    void IntersectLeafN(
+        const Node    &aLeaf,
+        const Ray     *aRays,
+        const LeafRay *,
+        Isect         *aoResults,
+        char          *aoHits,
+        int           aCount,
+        int) const
+    {
+        for(int i=aLeaf.mOffset; i<aLeaf.mOffset + aLeaf.mCount; i++)
+            mGeometry[i]->IntersectN(aRays, aoResults, aoHits, aCount);
+    }
+
+    void OccludedLeafN(
+        const Node    &aLeaf,
+        const Ray     *aRays,
+        const LeafRay *,
+        Isect         *aoResults,
+        char          *aoOccluded,
+        int           aCount,
+        int) const
+    {
+        for(int i=aLeaf.mOffset; i<aLeaf.mOffset + aLeaf.mCount; i++)
+            mGeometry[i]->OccludedN(aRays, aoResults, aoOccluded, aCount);
+    }
+
+private:
+
+    std::vector<AbstractGeometry*> mGeometry;
+};
+
+#endif //__BVH_HXX__
@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __CHECKPOINT_HXX__
+#define __CHECKPOINT_HXX__
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include "math.hxx"
+#if !defined(NO_CXX11_THREADS)
+#include <thread>
+#endif
+#include "config.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Checkpoints of a render in progress, to continue it later (--resume).
+// The file is binary, a CheckpointHeader followed by the state of all
+// renderers, see AbstractRenderer::SaveState. As the state is only
+// valid with the same renderers, the header has to match the current
+// configuration.
+struct CheckpointHeader
+{
+    enum { kVersion = 7 }; // 2: PCG32 Rng state, 3: adaptive sampling,
+                           // 4: framebuffer iterations, independent --shared-fb,
+                           // 5: scene, mesh, node and path settings,
+                           // 6: light vertex count of VertexCM, 7: MIS power
+
+    char      mMagic[8];          // "SVCMCKPT"
+    int       mVersion;
+    int       mAlgorithm;
+    int       mSceneID;           // index to g_SceneConfigs
+    long long mMeshSize;          // bytes of the --mesh file, 0 without mesh
+    long long mMeshHash;          // FNV-1a of the --mesh file, 0 without mesh
+    int       mResX;
+    int       mResY;
+    int       mRendererCount;
+    int       mNodeIndex;
+    int       mNodeCount;
+    int       mCooperative;       // renderers shared iterations
+    int       mSharedFramebuffer; // renderers shared the framebuffer
+    int       mAdaptive;          // renderers sampled adaptively
+    int       mCompactVertices;   // light vertices were compact
+    int       mConnectionCount;   // light vertices per camera vertex
+    int       mMisPower;          // 1 balance, 2 power heuristic
+    int       mMinPathLength;
+    int       mMaxPathLength;
+    int       mCounterRng;        // numbers depended on path, not on thread
+    int       mSobol;             // numbers came from the Sobol sampler
+    int       mIterations;        // iterations done in total
+
+    void Setup(
+        const Config &aConfig,
+        const bool   aCooperative,
+        const int    aIterations)
+    {
+        memset(this, 0, sizeof(*this));
+        memcpy(mMagic, "SVCMCKPT", 8);
+        mVersion           = kVersion;
+        mAlgorithm         = int(aConfig.mAlgorithm);
+        mSceneID           = aConfig.mSceneID;
+        mResX              = int(aConfig.mScene->mCamera.mResolution.x);
+        mResY              = int(aConfig.mScene->mCamera.mResolution.y);
+        mRendererCount     = aConfig.mNumThreads;
+        mNodeIndex         = aConfig.mNodeIndex;
+        mNodeCount         = aConfig.mNodeCount;
+        mCooperative       = aCooperative ? 1 : 0;
+        mSharedFramebuffer = aConfig.mSharedFramebuffer ? 1 : 0;
+        mAdaptive          = (aCooperative && aConfig.mAdaptiveError > 0) ? 1 : 0;
+        mCompactVertices   = aConfig.mCompactVertices ? 1 : 0;
+        mConnectionCount   = aConfig.mConnectionCount;
+        mMisPower          = aConfig.mMisPower;
+        mMinPathLength     = int(aConfig.mMinPathLength);
+        mMaxPathLength     = int(aConfig.mMaxPathLength);
+        mCounterRng        = aConfig.mCounterRng ? 1 : 0;
+        mSobol             = aConfig.mSobol ? 1 : 0;
+        mIterations        = aIterations;
+
+        if(!aConfig.mMeshFile.empty())
+            HashFile(aConfig.mMeshFile, mMeshSize, mMeshHash);
+    }
+
+    // Returns what does not match, NULL when the checkpoint can be used
+    const char* Mismatch(const CheckpointHeader &aOther) const
+    {
+        if(memcmp(mMagic, aOther.mMagic, 8) != 0 || mVersion != aOther.mVersion)
+            return "not a checkpoint of this version";
+        if(mAlgorithm != aOther.mAlgorithm)
+            return "different algorithm";
+        if(mSceneID != aOther.mSceneID)
+            return "different scene";
+        if(mMeshSize != aOther.mMeshSize || mMeshHash != aOther.mMeshHash)
+            return "different --mesh";
+        if(mResX != aOther.mResX || mResY != aOther.mResY)
+            return "different resolution";
+        if(mRendererCount != aOther.mRendererCount)
+            return "different number of threads";
+        if(mNodeIndex != aOther.mNodeIndex || mNodeCount != aOther.mNodeCount)
+            return "different --node";
+        if(mCooperative != aOther.mCooperative)
+            return "different --independent setting";
+        if(mSharedFramebuffer != aOther.mSharedFramebuffer)
+            return "different --shared-fb setting";
+        if(mAdaptive != aOther.mAdaptive)
+            return "different --adaptive setting";
+        if(mCompactVertices != aOther.mCompactVertices)
+            return "different --compact-vertices setting";
+        if(mConnectionCount != aOther.mConnectionCount)
+            return "different --connections";
+        if(mMisPower != aOther.mMisPower)
+            return "different --mis-power";
+        if(mMinPathLength != aOther.mMinPathLength ||
+            mMaxPathLength != aOther.mMaxPathLength)
+            return "different path length limits";
+        if(mCounterRng != aOther.mCounterRng || mSobol != aOther.mSobol)
+            return "different --counter-rng or --sobol setting";
+        return NULL;
+    }
+};
+
+// Takes a snapshot of all renderers in memory, which is fast, and writes
+// it to the file on a background thread, so rendering continues right
+// away. The file is written under a temporary name and then renamed, so
+// being killed mid-write keeps the previous checkpoint intact.
+class CheckpointWriter
+{
+public:
+
+    CheckpointWriter() : mHasHeader(false) {}
+
+    ~CheckpointWriter()
+    {
+        Wait();
+    }
+
+    void Write(
+        const Config       &aConfig,
+        AbstractRenderer   **aRenderers,
+        const bool         aCooperative,
+        const int          aIterations)
+    {
+        // Only one write at a time, the previous one is long done
+        // unless checkpoints are far too frequent
+        Wait();
+
+        // Set up once, so the mesh is hashed only once
+        if(!mHasHeader)
+        {
+            mHeader.Setup(aConfig, aCooperative, 0);
+            mHasHeader = true;
+        }
+
+        CheckpointHeader header = mHeader;
+        header.mIterations = aIterations;
+
+        std::ostringstream stream(std::ios::out | std::ios::binary);
+        stream.write((const char*)&header, sizeof(header));
+
+        for(int i=0; i<aConfig.mNumThreads; i++)
+            aRenderers[i]->SaveState(stream);
+
+        mData     = stream.str();
+        mFilename = aConfig.mCheckpointName;
+
+#if !defined(NO_CXX11_THREADS)
+        mThread = std::thread(&CheckpointWriter::WriteFile, this);
+#else
+        // No C++11 threads, write right away
+        WriteFile();
+#endif
+    }
+
+    void Wait()
+    {
+#if !defined(NO_CXX11_THREADS)
+        if(mThread.joinable())
+            mThread.join();
+#endif
+    }
+
+private:
+
+    void WriteFile()
+    {
+        const std::string tmpName = mFilename + ".tmp";
+
+        {
+            std::ofstream file(tmpName.c_str(), std::ios::binary);
+            file.write(mData.data(), mData.size());
+
+            if(file.fail())
+            {
+                printf("Could not write checkpoint %s\n", tmpName.c_str());
+                return;
+            }
+        }
+
+#if defined(_WIN32)
+        // rename does not replace existing files on Windows
+        remove(mFilename.c_str());
+#endif
+        if(rename(tmpName.c_str(), mFilename.c_str()) != 0)
+            printf("Could not rename checkpoint to %s\n", mFilename.c_str());
+    }
+
+    CheckpointHeader mHeader;    // of the render, but for the iterations
+    bool             mHasHeader;
+    std::string      mData;
+    std::string      mFilename;
+#if !defined(NO_CXX11_THREADS)
+    std::thread mThread;
+#endif
+};
+
+// Loads state of all renderers from aConfig.mResumeName, outputs the
+// number of iterations done. Returns false, with a message, on failure
+bool LoadCheckpoint(
+    const Config     &aConfig,
+    AbstractRenderer **aRenderers,
+    const bool       aCooperative,
+    int              &oIterations)
+{
+    std::ifstream file(aConfig.mResumeName.c_str(), std::ios::binary);
+
+    if(!file)
+    {
+        printf("Could not open checkpoint %s\n", aConfig.mResumeName.c_str());
+        return false;
+    }
+
+    CheckpointHeader header, expected;
+    file.read((char*)&header, sizeof(header));
+    expected.Setup(aConfig, aCooperative, 0);
+
+    const char *mismatch = file.fail() ?
+        "file too short" : expected.Mismatch(header);
+
+    if(mismatch)
+    {
+        printf("Cannot resume from %s: %s\n", aConfig.mResumeName.c_str(), mismatch);
+        return false;
+    }
+
+    for(int i=0; i<aConfig.mNumThreads; i++)
+    {
+        if(!aRenderers[i]->LoadState(file))
+        {
+            printf("Cannot resume from %s: file is corrupted\n",
+                aConfig.mResumeName.c_str());
+            return false;
+        }
+    }
+
+    oIterations = header.mIterations;
+    return true;
+}
+
+#endif //__CHECKPOINT_HXX__
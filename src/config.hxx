@@ -93,6 +93,7 @@ struct Config
     }
 
     const Scene *mScene;
+    int         mSceneID;    // index to g_SceneConfigs mScene was loaded from
     Algorithm   mAlgorithm;
     int         mIterations;
     float       mMaxTime;
@@ -106,8 +107,64 @@ struct Config
     std::string mOutputName;
     Vec2i       mResolution;
     bool        mFullReport; // ignore scene and algorithm and do html report instead
+    bool        mCooperative; // all threads work together on each iteration
+    bool        mSharedFramebuffer; // all threads accumulate into one framebuffer
+    bool        mCompactVertices;   // light vertices store floats in 16 bits
+    int         mGridCellCount; // hash grid cells, 0 means one per pixel
+    bool        mMortonOrder;   // sort light vertices by Morton code of their cell
+    int         mConnectionCount; // light vertices each camera vertex connects to, 0 ~ own path
+    int         mMisPower;      // 1 balance heuristic, 2 power heuristic
+    bool        mWavefront;     // trace paths in waves instead of one by one
+    bool        mCounterRng;    // random numbers depend on path, not on thread
+    bool        mSobol;         // paths sample scrambled Sobol instead of Rng
+    float       mAdaptiveError; // relative pixel error to reach, 0 means not adaptive
+    std::string mStatsName;     // when set, detailed statistics are saved to it
+    bool        mBenchmark;     // ignore scene and algorithm and run benchmark instead
+    std::string mBenchRefPrefix; // file name prefix of benchmark reference images
+    std::string mCheckpointName; // when set, checkpoints are saved to it
+    float       mCheckpointTime; // seconds between checkpoints
+    std::string mResumeName;     // when set, rendering continues from this checkpoint
+    std::string mPreviewName;    // when set, the running image is published to it
+    float       mPreviewTime;    // seconds between preview images
+    std::string mMeshFile;       // when set, mesh replaces the spheres of the scene
+    bool        mNuma;           // pin threads, place memory on their NUMA nodes
+    int         mNodeIndex;      // index of this node in distributed rendering
+    int         mNodeCount;      // number of nodes, 1 when not distributed
+    bool        mMerge;          // merge node files instead of rendering
+    std::vector<std::string> mMergeNames; // node files to merge
 };
 
+// VertexCM of algorithm tAlgorithm and MIS power tMisPower, with the
+// light vertex storage aConfig asks for
+template<int tAlgorithm, int tMisPower>
+AbstractRenderer* CreateVertexCMWithMis(
+    const Config& aConfig,
+    const int     aSeed)
+{
+    const Scene& scene = *aConfig.mScene;
+
+    if(aConfig.mCompactVertices)
+        return new VertexCM<tAlgorithm, tMisPower, true>(scene,
+            aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed,
+            aConfig.mGridCellCount, aConfig.mMortonOrder, aConfig.mConnectionCount);
+
+    return new VertexCM<tAlgorithm, tMisPower>(scene,
+        aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed,
+        aConfig.mGridCellCount, aConfig.mMortonOrder, aConfig.mConnectionCount);
+}
+
+// VertexCM of algorithm tAlgorithm, with the MIS power aConfig asks for
+template<int tAlgorithm>
+AbstractRenderer* CreateVertexCM(
+    const Config& aConfig,
+    const int     aSeed)
+{
+    if(aConfig.mMisPower == 2)
+        return CreateVertexCMWithMis<tAlgorithm, 2>(aConfig, aSeed);
+
+    return CreateVertexCMWithMis<tAlgorithm, 1>(aConfig, aSeed);
+}
+
 // Utility function, essentially a renderer factory
 AbstractRenderer* CreateRenderer(
     const Config& aConfig,
@@ -122,20 +179,17 @@ AbstractRenderer* CreateRenderer(
     case Config::kPathTracing:
         return new PathTracer(scene, aSeed);
     case Config::kLightTracing:
-        return new VertexCM(scene, VertexCM::kLightTrace,
-            aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
+        return CreateVertexCM<kLightTrace>(aConfig, aSeed);
     case Config::kProgressivePhotonMapping:
-        return new VertexCM(scene, VertexCM::kPpm,
-            aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
+        if(!SupportsPpm(scene))
+            return CreateVertexCM<kBpm>(aConfig, aSeed);
+        return CreateVertexCM<kPpm>(aConfig, aSeed);
     case Config::kBidirectionalPhotonMapping:
-        return new VertexCM(scene, VertexCM::kBpm,
-            aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
+        return CreateVertexCM<kBpm>(aConfig, aSeed);
     case Config::kBidirectionalPathTracing:
-        return new VertexCM(scene, VertexCM::kBpt,
-            aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
+        return CreateVertexCM<kBpt>(aConfig, aSeed);
     case Config::kVertexConnectionMerging:
-        return new VertexCM(scene, VertexCM::kVcm,
-            aConfig.mRadiusFactor, aConfig.mRadiusAlpha, aSeed);
+        return CreateVertexCM<kVcm>(aConfig, aSeed);
     default:
         printf("Unknown algorithm!!\n");
         exit(2);
@@ -150,6 +204,23 @@ uint g_SceneConfigs[] = {
     Scene::kGlossyFloor | Scene::kBothSmallSpheres  | Scene::kLightBackground
 };
 
+// Loads scene aConfig.mSceneID with aConfig.mMeshFile, NULL on failure.
+// Loading again gives an identical scene, e.g., a replica for a NUMA node
+Scene* LoadScene(const Config &aConfig)
+{
+    Scene *scene = new Scene;
+    if(!scene->LoadCornellBox(aConfig.mResolution, g_SceneConfigs[aConfig.mSceneID],
+        aConfig.mMeshFile))
+    {
+        delete scene;
+        return NULL;
+    }
+    scene->BuildSceneSphere();
+    scene->BuildLightTable();
+
+    return scene;
+}
+
 std::string DefaultFilename(
     const uint              aSceneConfig,
     const Scene             &aScene,
@@ -180,15 +251,13 @@ inline int SizeOfArray( const T(&)[ N ] )
     return int(N);
 }
 
-void PrintRngWarning()
+void PrintCxx11Warning()
 {
-#if defined(LEGACY_RNG)
+#if defined(NO_CXX11_THREADS)
     printf("The code was not compiled for C++11.\n");
-    printf("It will be using Tiny Encryption Algorithm-based"
-        "random number generator.\n");
-    printf("This is worse than the Mersenne Twister from C++11.\n");
+    printf("Checkpoints and previews will be written without a background thread.\n");
     printf("Consider setting up for C++11.\n");
-    printf("Visual Studio 2010, and g++ 4.6.3 and later work.\n\n");
+    printf("Visual Studio 2012, and g++ 4.6.3 and later work.\n\n");
 #endif
 }
 
@@ -196,7 +265,16 @@ void PrintHelp(const char *argv[])
 {
     printf("\n");
     printf("Usage: %s [ -s <scene_id> | -a <algorithm> |\n", argv[0]);
-    printf("           -t <time> | -i <iteration> | -o <output_name> | --report ]\n\n");
+    printf("           -t <time> | -i <iteration> | -o <output_name> | --report |\n");
+    printf("           --independent | --shared-fb | --compact-vertices | --morton |\n");
+    printf("           --cells <cell_count> | --wavefront | --counter-rng | --sobol |\n");
+    printf("           --stats <stats_name> | --adaptive <error> | --bench |\n");
+    printf("           --bench-ref <prefix> | --checkpoint <file> | --resume <file> |\n");
+    printf("           --checkpoint-time <time> | --preview <file> | --preview-time <time> |\n");
+    printf("           --connections <count> | --mis-power <power> | --numa |\n");
+    printf("           --mesh <file> |\n");
+    printf("           --node <index> <count> |\n");
+    printf("           --merge <node_file> ... ]\n\n");
     printf("    -s  Selects the scene (default 0):\n");
 
     for(int i = 0; i < SizeOfArray(g_SceneConfigs); i++)
@@ -211,21 +289,119 @@ void PrintHelp(const char *argv[])
 
     printf("    -t  Number of seconds to run the algorithm\n");
     printf("    -i  Number of iterations to run the algorithm (default 1)\n");
-    printf("    -o  User specified output name, with extension .bmp or .hdr (default .bmp)\n");
+    printf("    -o  User specified output name, with extension .bmp, .hdr or .exr (default .bmp)\n");
     printf("    --report\n");
     printf("        Renders all scenes using all algorithms and generates an index.html file\n");
     printf("        that displays all images. Obeys the -t and -i options, ignores the rest.\n");
+    printf("        With -i, scene-algorithm pairs render side by side on shares of the threads.\n");
     printf("        Recommended usage: --report -i 1   (fastest preview)\n");
     printf("        Recommended usage: --report -t 10  (takes 5.5 mins)\n");
     printf("        Recommended usage: --report -t 60  (takes 30 mins)\n");
+    printf("    --independent\n");
+    printf("        Every thread runs whole iterations on its own, with its own light\n");
+    printf("        vertices (LT, PPM, BPM, BPT, VCM). By default all threads work\n");
+    printf("        together on each iteration and share one set of light vertices.\n");
+    printf("    --shared-fb\n");
+    printf("        All threads accumulate into one framebuffer instead of one each. Light\n");
+    printf("        tracing contributions are added atomically, with --independent camera\n");
+    printf("        paths too.\n");
+    printf("    --compact-vertices\n");
+    printf("        Light vertices store throughput, MIS quantities and continuation\n");
+    printf("        probability in 16 bits each (bfloat16), 28 instead of 40 bytes per vertex\n");
+    printf("        besides the position. Costs about 0.4%% precision of these values.\n");
+    printf("    --morton\n");
+    printf("        Sorts light vertices by Morton code of their hash grid cell before\n");
+    printf("        merging (PPM, BPM, VCM), so each cell is one contiguous memory range\n");
+    printf("    --cells\n");
+    printf("        Number of hash grid cells (default 1 per pixel). With --morton, the\n");
+    printf("        minimal size of the cell table\n");
+    printf("    --wavefront\n");
+    printf("        Traces paths in waves (PT, LT, PPM, BPM, BPT, VCM): each wave extends\n");
+    printf("        all its paths by one segment at a time, shading hits grouped by material\n");
+    printf("    --counter-rng\n");
+    printf("        Random numbers of each path are generated from its pixel (or light path)\n");
+    printf("        index and iteration (Philox), instead of one sequence per thread (PCG32).\n");
+    printf("        The image then does not depend on how paths are split between threads.\n");
+    printf("    --sobol\n");
+    printf("        Paths take their numbers from a scrambled Sobol sequence, indexed by\n");
+    printf("        iteration, instead of random numbers. Pixels then converge faster, and\n");
+    printf("        like with --counter-rng the image does not depend on the threads.\n");
+    printf("    --adaptive\n");
+    printf("        Pixels stop getting camera paths once the estimated standard error of\n");
+    printf("        their mean is below <error>, relative to the mean (e.g., 0.01). Rendering\n");
+    printf("        stops early when all pixels are there. Ignored with --independent.\n");
+    printf("    --stats\n");
+    printf("        Prints time of all rendering phases, including vertex connections and\n");
+    printf("        merging, ray and merge counts, and saves them to a JSON file\n");
+    printf("    --bench\n");
+    printf("        Renders all scenes using all algorithms with fixed seeds, on 1, 2, 4, ...\n");
+    printf("        up to all threads. Writes Mrays/s, time per iteration, peak memory,\n");
+    printf("        and RMSE to reference to bench.json and bench.csv. Obeys the -i option\n");
+    printf("        (time limit is ignored), other options apply to all runs. Peak memory\n");
+    printf("        is that of each run on Linux, elsewhere of the whole process so far.\n");
+    printf("    --bench-ref\n");
+    printf("        File name prefix of the benchmark reference images (default bench_ref_).\n");
+    printf("        Missing references are saved from the current single thread run.\n");
+    printf("    --checkpoint\n");
+    printf("        Periodically saves the accumulated image, iteration count and state of\n");
+    printf("        the random number generators to a file, and once more when done\n");
+    printf("    --checkpoint-time\n");
+    printf("        Number of seconds between checkpoints (default 300)\n");
+    printf("    --resume\n");
+    printf("        Continues rendering from a checkpoint. Scene, algorithm, number of\n");
+    printf("        threads and --independent, --shared-fb, --adaptive must be the same as\n");
+    printf("        when it was saved. The -t and -i options then give the additional time\n");
+    printf("        or iterations.\n");
+    printf("    --preview\n");
+    printf("        Publishes the image being rendered to a shared memory file (e.g.,\n");
+    printf("        /dev/shm/smallvcm) for viewers to map, see preview.hxx for the layout.\n");
+    printf("        Threads keep rendering, the image is tonemapped on a thread of its own\n");
+    printf("    --preview-time\n");
+    printf("        Number of seconds between preview images (default 1)\n");
+    printf("    --connections\n");
+    printf("        Each camera vertex connects to <count> vertices picked at random from\n");
+    printf("        the stored vertices of all light sub-paths (BPT, VCM), instead of to all\n");
+    printf("        vertices of its own light sub-path. MIS weights count the picks as\n");
+    printf("        <count> / (stored vertices per light sub-path) connections.\n");
+    printf("    --mis-power\n");
+    printf("        Weights the techniques of BPM, BPT and VCM with the balance heuristic\n");
+    printf("        for <power> 1 (default), or with the power heuristic for <power> 2.\n");
+    printf("    --numa\n");
+    printf("        Pins threads to CPUs, filling one NUMA node after another. Each thread\n");
+    printf("        allocates its own buffers, and every further node gets its own copy of\n");
+    printf("        the scene. Only on Linux, ignored with --report.\n");
+    printf("    --mesh\n");
+    printf("        Puts triangle mesh from an .obj or .ply file into the scene instead of its\n");
+    printf("        spheres, scaled to the large sphere. The mesh with its BVH is cached in\n");
+    printf("        <file>.cache, which later runs map from disk instead of parsing the mesh.\n");
+    printf("    --node\n");
+    printf("        Renders as node <index> of <count> nodes of a distributed render, with its\n");
+    printf("        own random seeds and share of iterations. Besides the image, it saves\n");
+    printf("        the accumulated image with its iteration count to <output_name>.node\n");
+    printf("    --merge\n");
+    printf("        Merges the given .node files of all nodes into the -o image (default\n");
+    printf("        merged.bmp), ignores all other options\n");
     printf("\n    Note: Time (-t) takes precedence over iterations (-i) if both are defined\n");
 }
 
+// Check if output name has valid extension (.bmp, .hdr or .exr) and if not add .bmp
+void AddOutputExtension(std::string &aoOutputName)
+{
+    std::string extension = "";
+
+    if(aoOutputName.length() > 4) // must be at least 1 character before .bmp
+        extension = aoOutputName.substr(aoOutputName.length() - 4, 4);
+
+    if(extension != ".bmp" && extension != ".hdr" && extension != ".exr")
+        aoOutputName += ".bmp";
+}
+
 // Parses command line, setting up config
 void ParseCommandline(int argc, const char *argv[], Config &oConfig)
 {
     // Parameters marked with [cmd] can be change from command line
     oConfig.mScene         = NULL;                  // [cmd] When NULL, renderer will not run
+    oConfig.mSceneID       = 0;
     oConfig.mAlgorithm     = Config::kAlgorithmMax; // [cmd]
     oConfig.mIterations    = 1;                     // [cmd]
     oConfig.mMaxTime       = -1.f;                  // [cmd]
@@ -236,12 +412,39 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
     oConfig.mMinPathLength = 0;
     oConfig.mResolution    = Vec2i(512, 512);
     oConfig.mFullReport    = false;
+    oConfig.mCooperative   = true;                  // [cmd]
+    oConfig.mSharedFramebuffer = false;             // [cmd]
+    oConfig.mCompactVertices   = false;             // [cmd]
+    oConfig.mGridCellCount = 0;                     // [cmd]
+    oConfig.mMortonOrder   = false;                 // [cmd]
+    oConfig.mConnectionCount = 0;                   // [cmd]
+    oConfig.mMisPower      = 1;                     // [cmd]
+    oConfig.mWavefront     = false;                 // [cmd]
+    oConfig.mCounterRng    = false;                 // [cmd]
+    oConfig.mSobol         = false;                 // [cmd]
+    oConfig.mAdaptiveError = 0.f;                   // [cmd]
+    oConfig.mStatsName     = "";                    // [cmd]
+    oConfig.mBenchmark     = false;                 // [cmd]
+    oConfig.mBenchRefPrefix = "bench_ref_";         // [cmd]
+    oConfig.mCheckpointName = "";                   // [cmd]
+    oConfig.mCheckpointTime = 300.f;                // [cmd]
+    oConfig.mResumeName    = "";                    // [cmd]
+    oConfig.mPreviewName   = "";                    // [cmd]
+    oConfig.mPreviewTime   = 1.f;                   // [cmd]
+    oConfig.mMeshFile      = "";                    // [cmd]
+    oConfig.mNuma          = false;                 // [cmd]
+    oConfig.mNodeIndex     = 0;                     // [cmd]
+    oConfig.mNodeCount     = 1;                     // [cmd]
+    oConfig.mMerge         = false;                 // [cmd]
     oConfig.mRadiusFactor  = 0.003f;
     oConfig.mRadiusAlpha   = 0.75f;
     //oConfig.mFramebuffer   = NULL; // this is never set by any parameter
 
     int sceneID    = 0; // default 0
 
+    // Arguments that are not options, only used by --merge
+    std::vector<std::string> positional;
+
     // Load arguments
     for(int i=1; i<argc; i++)
     {
@@ -256,12 +459,235 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
 
         if(arg[0] != '-') // all our commands start with -
         {
+            positional.push_back(arg);
             continue;
         }
         else if(arg == "--report")
         {
             oConfig.mFullReport = true;
         }
+        else if(arg == "--independent")
+        {
+            oConfig.mCooperative = false;
+        }
+        else if(arg == "--shared-fb")
+        {
+            oConfig.mSharedFramebuffer = true;
+        }
+        else if(arg == "--compact-vertices")
+        {
+            oConfig.mCompactVertices = true;
+        }
+        else if(arg == "--morton")
+        {
+            oConfig.mMortonOrder = true;
+        }
+        else if(arg == "--wavefront")
+        {
+            oConfig.mWavefront = true;
+        }
+        else if(arg == "--counter-rng")
+        {
+            oConfig.mCounterRng = true;
+        }
+        else if(arg == "--sobol")
+        {
+            oConfig.mSobol = true;
+        }
+        else if(arg == "--adaptive") // relative error for adaptive sampling
+        {
+            if(++i == argc)
+            {
+                printf("Missing <error> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mAdaptiveError;
+
+            if(iss.fail() || oConfig.mAdaptiveError <= 0)
+            {
+                printf("Invalid <error> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--bench")
+        {
+            oConfig.mBenchmark = true;
+        }
+        else if(arg == "--bench-ref") // prefix of benchmark reference images
+        {
+            if(++i == argc)
+            {
+                printf("Missing <prefix> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mBenchRefPrefix = argv[i];
+        }
+        else if(arg == "--checkpoint") // file to save checkpoints to
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mCheckpointName = argv[i];
+        }
+        else if(arg == "--checkpoint-time") // seconds between checkpoints
+        {
+            if(++i == argc)
+            {
+                printf("Missing <time> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mCheckpointTime;
+
+            if(iss.fail() || oConfig.mCheckpointTime <= 0)
+            {
+                printf("Invalid <time> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--preview") // file to publish the running image to
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mPreviewName = argv[i];
+        }
+        else if(arg == "--preview-time") // seconds between preview images
+        {
+            if(++i == argc)
+            {
+                printf("Missing <time> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mPreviewTime;
+
+            if(iss.fail() || oConfig.mPreviewTime <= 0)
+            {
+                printf("Invalid <time> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--resume") // checkpoint to continue from
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mResumeName = argv[i];
+        }
+        else if(arg == "--numa") // pin threads, replicate scene per node
+        {
+            oConfig.mNuma = true;
+        }
+        else if(arg == "--mesh") // mesh to put into the scene
+        {
+            if(++i == argc)
+            {
+                printf("Missing <file> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mMeshFile = argv[i];
+        }
+        else if(arg == "--node") // index and count of distributed nodes
+        {
+            if(i + 2 >= argc)
+            {
+                printf("Missing <index> <count> arguments, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream issIndex(argv[++i]);
+            std::istringstream issCount(argv[++i]);
+            issIndex >> oConfig.mNodeIndex;
+            issCount >> oConfig.mNodeCount;
+
+            if(issIndex.fail() || issCount.fail() || oConfig.mNodeCount < 1 ||
+                oConfig.mNodeIndex < 0 || oConfig.mNodeIndex >= oConfig.mNodeCount)
+            {
+                printf("Invalid <index> <count> arguments, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--merge")
+        {
+            oConfig.mMerge = true;
+        }
+        else if(arg == "--stats") // file with detailed statistics
+        {
+            if(++i == argc)
+            {
+                printf("Missing <stats_name> argument, please see help (-h)\n");
+                return;
+            }
+
+            oConfig.mStatsName = argv[i];
+        }
+        else if(arg == "--cells") // number of hash grid cells
+        {
+            if(++i == argc)
+            {
+                printf("Missing <cell_count> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mGridCellCount;
+
+            if(iss.fail() || oConfig.mGridCellCount < 1)
+            {
+                printf("Invalid <cell_count> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--connections") // light vertices per camera vertex
+        {
+            if(++i == argc)
+            {
+                printf("Missing <count> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mConnectionCount;
+
+            if(iss.fail() || oConfig.mConnectionCount < 1)
+            {
+                printf("Invalid <count> argument, please see help (-h)\n");
+                return;
+            }
+        }
+        else if(arg == "--mis-power") // balance or power heuristic
+        {
+            if(++i == argc)
+            {
+                printf("Missing <power> argument, please see help (-h)\n");
+                return;
+            }
+
+            std::istringstream iss(argv[i]);
+            iss >> oConfig.mMisPower;
+
+            if(iss.fail() || (oConfig.mMisPower != 1 && oConfig.mMisPower != 2))
+            {
+                printf("Invalid <power> argument, please see help (-h)\n");
+                return;
+            }
+        }
         else if(arg == "-s") // scene to load
         {
             if(++i == argc)
@@ -352,9 +778,28 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
         }
     }
 
-    // When doing full report, we ignore algorithm and scene settings
-    if(oConfig.mFullReport)
+    // When doing full report or benchmark, we ignore algorithm and scene settings
+    if(oConfig.mFullReport || oConfig.mBenchmark)
+        return;
+
+    // Merging needs just the node files and output name
+    if(oConfig.mMerge)
+    {
+        oConfig.mMergeNames = positional;
+
+        if(oConfig.mMergeNames.empty())
+        {
+            printf("Missing <node_file> arguments, please see help (-h)\n");
+            oConfig.mMerge = false;
+            return;
+        }
+
+        if(oConfig.mOutputName.length() == 0)
+            oConfig.mOutputName = "merged.bmp";
+
+        AddOutputExtension(oConfig.mOutputName);
         return;
+    }
 
     // Check algorithm was selected
     if(oConfig.mAlgorithm == Config::kAlgorithmMax)
@@ -363,11 +808,11 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
     }
 
     // Load scene
-    Scene *scene = new Scene;
-    scene->LoadCornellBox(oConfig.mResolution, g_SceneConfigs[sceneID]);
-    scene->BuildSceneSphere();
+    oConfig.mSceneID = sceneID;
+    oConfig.mScene   = LoadScene(oConfig);
 
-    oConfig.mScene = scene;
+    if(!oConfig.mScene)
+        return;
 
     // If no output name is chosen, create a default one
     if(oConfig.mOutputName.length() == 0)
@@ -376,15 +821,7 @@ void ParseCommandline(int argc, const char *argv[], Config &oConfig)
             *oConfig.mScene, oConfig.mAlgorithm);
     }
 
-    // Check if output name has valid extension (.bmp or .hdr) and if not add .bmp
-    std::string extension = "";
-
-    if(oConfig.mOutputName.length() > 4) // must be at least 1 character before .bmp
-        extension = oConfig.mOutputName.substr(
-            oConfig.mOutputName.length() - 4, 4);
-
-    if(extension != ".bmp" && extension != ".hdr")
-        oConfig.mOutputName += ".bmp";
+    AddOutputExtension(oConfig.mOutputName);
 }
 
 #endif  //__CONFIG_HXX__
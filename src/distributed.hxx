@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __DISTRIBUTED_HXX__
+#define __DISTRIBUTED_HXX__
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include "config.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Distributed rendering over several processes (nodes), which only
+// share files. Node k of n renders with its own random seeds, and its
+// i-th iteration is global iteration i * n + k, so the VCM radius
+// schedule is that of one process running all iterations of all nodes,
+// see render(). Each node saves its image together with the number of
+// iterations it averages, and merging weights the images by these.
+// Scene and mesh are recorded too, so that only images of the same
+// render are merged. The mesh is identified by contents, as its path
+// and time may differ between nodes.
+struct NodeImageHeader
+{
+    enum { kVersion = 2 };
+
+    char      mMagic[8];   // "SVCMNODE"
+    int       mVersion;
+    int       mAlgorithm;
+    int       mSceneID;    // index to g_SceneConfigs
+    int       mNodeIndex;
+    int       mNodeCount;
+    int       mIterations; // iterations averaged in the image
+    long long mMeshSize;   // bytes of the --mesh file, 0 without mesh
+    long long mMeshHash;   // FNV-1a of the --mesh file, 0 without mesh
+};
+
+// Node image is the header followed by Framebuffer::SaveRaw data
+bool SaveNodeImage(
+    const std::string &aFilename,
+    const Config      &aConfig,
+    const Framebuffer &aImage,
+    const int         aIterations)
+{
+    NodeImageHeader header;
+    memcpy(header.mMagic, "SVCMNODE", 8);
+    header.mVersion    = NodeImageHeader::kVersion;
+    header.mAlgorithm  = int(aConfig.mAlgorithm);
+    header.mSceneID    = aConfig.mSceneID;
+    header.mNodeIndex  = aConfig.mNodeIndex;
+    header.mNodeCount  = aConfig.mNodeCount;
+    header.mIterations = aIterations;
+    header.mMeshSize   = 0;
+    header.mMeshHash   = 0;
+
+    if(!aConfig.mMeshFile.empty())
+        HashFile(aConfig.mMeshFile, header.mMeshSize, header.mMeshHash);
+
+    std::ofstream file(aFilename.c_str(), std::ios::binary);
+    file.write((const char*)&header, sizeof(header));
+    aImage.SaveRaw(file);
+
+    return !file.fail();
+}
+
+bool LoadNodeImage(
+    const std::string &aFilename,
+    NodeImageHeader   &oHeader,
+    Framebuffer       &oImage)
+{
+    std::ifstream file(aFilename.c_str(), std::ios::binary);
+    file.read((char*)&oHeader, sizeof(oHeader));
+
+    if(file.fail() || memcmp(oHeader.mMagic, "SVCMNODE", 8) != 0 ||
+        oHeader.mVersion != NodeImageHeader::kVersion ||
+        oHeader.mAlgorithm < 0 || oHeader.mAlgorithm >= Config::kAlgorithmMax ||
+        oHeader.mNodeIndex < 0 || oHeader.mNodeIndex >= oHeader.mNodeCount)
+    {
+        return false;
+    }
+
+    return oImage.LoadRaw(file);
+}
+
+// Merges node images of aConfig.mMergeNames into aoImage, returns false,
+// with a message, when they do not belong together
+bool MergeNodeImages(
+    const Config &aConfig,
+    Framebuffer  &aoImage)
+{
+    NodeImageHeader  first = NodeImageHeader();
+    std::vector<int> nodeFiles;
+    int totalIterations = 0;
+
+    for(size_t i=0; i<aConfig.mMergeNames.size(); i++)
+    {
+        const std::string &name = aConfig.mMergeNames[i];
+
+        NodeImageHeader header;
+        Framebuffer     image;
+
+        if(!LoadNodeImage(name, header, image))
+        {
+            printf("Could not load node image %s\n", name.c_str());
+            return false;
+        }
+
+        if(i == 0)
+        {
+            first = header;
+            nodeFiles.assign(header.mNodeCount, 0);
+            aoImage = image;
+            aoImage.Clear();
+        }
+        else if(header.mAlgorithm != first.mAlgorithm ||
+            header.mNodeCount != first.mNodeCount)
+        {
+            printf("Node image %s is from a different render\n", name.c_str());
+            return false;
+        }
+        else if(header.mSceneID != first.mSceneID)
+        {
+            printf("Node image %s is of a different scene\n", name.c_str());
+            return false;
+        }
+        else if(header.mMeshSize != first.mMeshSize ||
+            header.mMeshHash != first.mMeshHash)
+        {
+            printf("Node image %s has a different mesh\n", name.c_str());
+            return false;
+        }
+
+        if(image.GetResolution().x != aoImage.GetResolution().x ||
+            image.GetResolution().y != aoImage.GetResolution().y)
+        {
+            printf("Node image %s has different resolution\n", name.c_str());
+            return false;
+        }
+
+        if(nodeFiles[header.mNodeIndex]++ > 0)
+        {
+            printf("Node image %s is of node %d, which is merged already\n",
+                name.c_str(), header.mNodeIndex);
+            return false;
+        }
+
+        image.Scale(float(header.mIterations));
+        aoImage.Add(image);
+        totalIterations += header.mIterations;
+    }
+
+    for(int k=0; k<first.mNodeCount; k++)
+    {
+        if(nodeFiles[k] == 0)
+            printf("Node %d is missing, merging the rest\n", k);
+    }
+
+    printf("Merged:  %d node image(s), %d iteration(s) of %s\n",
+        int(aConfig.mMergeNames.size()), totalIterations,
+        Config::GetName(Config::Algorithm(first.mAlgorithm)));
+
+    if(totalIterations > 0)
+        aoImage.Scale(1.f / totalIterations);
+
+    return true;
+}
+
+#endif //__DISTRIBUTED_HXX__
@@ -41,7 +41,7 @@ public:
         const Scene& aScene,
         int aSeed = 1234
     ) :
-        AbstractRenderer(aScene), mRng(aSeed)
+        AbstractRenderer(aScene, aSeed), mCurrentIteration(0)
     {}
 
     virtual void RunIteration(int aIteration)
@@ -49,35 +49,82 @@ public:
         const int resX = int(mScene.mCamera.mResolution.x);
         const int resY = int(mScene.mCamera.mResolution.y);
 
-        for(int pixID = 0; pixID < resX * resY; pixID++)
+        mCurrentIteration = aIteration;
+        RenderPixels(0, resX * resY);
+
+        CountIteration();
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Cooperative rendering interface, see AbstractRenderer
+    //////////////////////////////////////////////////////////////////////////
+
+    virtual bool SupportsCooperative() const { return true; }
+
+    virtual void BeginIteration(int aIteration)
+    {
+        mCurrentIteration = aIteration;
+    }
+
+    virtual int GetCameraPathCount() const
+    {
+        return int(mScene.mCamera.mResolution.x * mScene.mCamera.mResolution.y);
+    }
+
+    virtual void RunCameraPaths(int aBegin, int aEnd)
+    {
+        RenderPixels(aBegin, aEnd);
+    }
+
+private:
+
+    // Traces one primary ray for each pixel in [aPixelBegin, aPixelEnd)
+    void RenderPixels(
+        const int aPixelBegin,
+        const int aPixelEnd)
+    {
+        PhaseTimer timer(mStats, RenderStats::kCameraTracing);
+
+        const int resX = int(mScene.mCamera.mResolution.x);
+
+        for(int pixID = aPixelBegin; pixID < aPixelEnd; pixID++)
         {
+            if(!NeedsCameraPath(pixID))
+                continue;
+
             //////////////////////////////////////////////////////////////////////////
             // Generate ray
             const int x = pixID % resX;
             const int y = pixID / resX;
 
+            mSampler->StartPath(Rng::kCameraStream, pixID, mCurrentIteration);
+
             const Vec2f sample = Vec2f(float(x), float(y)) +
-                (aIteration == 1 ? Vec2f(0.5f) : mRng.GetVec2f());
+                (mCurrentIteration == 1 ? Vec2f(0.5f) : mSampler->Get2D());
 
             Ray   ray = mScene.mCamera.GenerateRay(sample);
             Isect isect;
             isect.dist = 1e36f;
 
+            mStats.mRays++;
             if(mScene.Intersect(ray, isect))
             {
                 float dotLN = Dot(isect.normal, -ray.dir);
 
                 if(dotLN > 0)
-                    mFramebuffer.AddColor(sample, Vec3f(dotLN));
+                    AddColor(pixID, sample, Vec3f(dotLN));
                 else
-                    mFramebuffer.AddColor(sample, Vec3f(-dotLN, 0, 0));
+                    AddColor(pixID, sample, Vec3f(-dotLN, 0, 0));
+            }
+            else
+            {
+                // Misses count for adaptive sampling
+                AddColor(pixID, sample, Vec3f(0));
             }
         }
-
-        mIterations++;
     }
 
-    Rng              mRng;
+    int              mCurrentIteration;
 };
 
 #endif //__EYELIGHT_HXX__
@@ -28,7 +28,10 @@
 #include <vector>
 #include <cmath>
 #include <fstream>
+#include <sstream>
+#include <stdio.h>
 #include <string.h>
+#include <string>
 #include "utils.hxx"
 
 class Framebuffer
@@ -56,6 +59,31 @@ public:
         mColor[x + y * mResX] = mColor[x + y * mResX] + aColor;
     }
 
+    // Same as AddColor, but safe when several threads add to the same
+    // pixel at once. Each channel is added atomically on its own
+    void AddColorAtomic(
+        const Vec2f& aSample,
+        const Vec3f& aColor)
+    {
+        if(aSample.x < 0 || aSample.x >= mResolution.x)
+            return;
+
+        if(aSample.y < 0 || aSample.y >= mResolution.y)
+            return;
+
+        int x = int(aSample.x);
+        int y = int(aSample.y);
+
+        Vec3f &pixel = mColor[x + y * mResX];
+
+#pragma omp atomic
+        pixel.x += aColor.x;
+#pragma omp atomic
+        pixel.y += aColor.y;
+#pragma omp atomic
+        pixel.z += aColor.z;
+    }
+
     //////////////////////////////////////////////////////////////////////////
     // Methods for framebuffer operations
     void Setup(const Vec2f& aResolution)
@@ -67,71 +95,172 @@ public:
         Clear();
     }
 
+    const Vec2f& GetResolution() const { return mResolution; }
+
     void Clear()
     {
         memset(&mColor[0], 0, sizeof(Vec3f) * mColor.size());
     }
 
+    // Frees the pixels, framebuffer has to be Setup before next use
+    void Release()
+    {
+        std::vector<Vec3f>().swap(mColor);
+        mResolution = Vec2f(0);
+        mResX = mResY = 0;
+    }
+
+    // Framebuffers are treated as flat float arrays here, which helps
+    // the compiler to vectorize the loops
     void Add(const Framebuffer& aOther)
     {
-        for(size_t i=0; i<mColor.size(); i++)
-            mColor[i] = mColor[i] + aOther.mColor[i];
+        float       *dst = &mColor[0].x;
+        const float *src = &aOther.mColor[0].x;
+        const int   size = int(mColor.size() * 3);
+
+#pragma omp parallel for
+        for(int i=0; i<size; i++)
+            dst[i] += src[i];
     }
 
     void Scale(float aScale)
     {
-        for(size_t i=0; i<mColor.size(); i++)
-            mColor[i] = mColor[i] * Vec3f(aScale);
+        float     *dst = &mColor[0].x;
+        const int size = int(mColor.size() * 3);
+
+#pragma omp parallel for
+        for(int i=0; i<size; i++)
+            dst[i] *= aScale;
+    }
+
+    // Same as Add of aScale times aOther, but on the calling thread only,
+    // for threads besides the rendering ones (see preview.hxx)
+    void AddScaledSerial(const Framebuffer& aOther, float aScale)
+    {
+        float       *dst = &mColor[0].x;
+        const float *src = &aOther.mColor[0].x;
+        const int   size = int(mColor.size() * 3);
+
+        for(int i=0; i<size; i++)
+            dst[i] += src[i] * aScale;
     }
 
     //////////////////////////////////////////////////////////////////////////
     // Statistics
     float TotalLuminance()
     {
-        float lum = 0;
+        const int size = int(mColor.size());
+        double    lum  = 0;
 
-        for(int y=0; y<mResY; y++)
+#pragma omp parallel for reduction(+:lum)
+        for(int i=0; i<size; i++)
+            lum += Luminance(mColor[i]);
+
+        return float(lum);
+    }
+
+    // Root mean square difference of all color channels, or -1 on
+    // resolution mismatch
+    float Rmse(const Framebuffer& aOther) const
+    {
+        if(mColor.size() != aOther.mColor.size() || mColor.empty())
+            return -1.f;
+
+        double sum = 0;
+
+        for(size_t i=0; i<mColor.size(); i++)
         {
-            for(int x=0; x<mResX; x++)
-            {
-                lum += Luminance(mColor[x + y*mResX]);
-            }
+            const Vec3f d = mColor[i] - aOther.mColor[i];
+            sum += double(d.x) * d.x + double(d.y) * d.y + double(d.z) * d.z;
         }
 
-        return lum;
+        return float(std::sqrt(sum / (3.0 * mColor.size())));
     }
 
     //////////////////////////////////////////////////////////////////////////
     // Saving
+    //
+    // All encoders convert rows in parallel into one memory buffer,
+    // which is then written at once.
+
+    typedef unsigned char byte;
+
+    // Maps linear values to gamma corrected bytes. Instead of computing
+    // pow(v, 1/gamma) * 255 for every channel, v is compared with the
+    // 255 values where the byte changes, which is a binary search.
+    class GammaTable
+    {
+    public:
+
+        GammaTable(float aGamma)
+        {
+            // Byte k is the first one with pow(v, 1/gamma) * 255 >= k
+            mThreshold[0] = 0.f;
+            for(int k=1; k<256; k++)
+                mThreshold[k] = std::pow(float(k) / 255.f, aGamma);
+        }
+
+        byte ToByte(const float aValue) const
+        {
+            int k = 0;
+            for(int step=128; step>0; step >>= 1)
+            {
+                if(aValue >= mThreshold[k + step])
+                    k += step;
+            }
+            return byte(k);
+        }
+
+    private:
+
+        float mThreshold[256];
+    };
+
+    // Gamma corrected RGB bytes of aScale times the pixels, rows from top
+    // to bottom, on the calling thread only
+    void GetBytesSerial(
+        byte             *oPixels,
+        const float      aScale,
+        const GammaTable &aGamma) const
+    {
+        for(size_t i=0; i<mColor.size(); i++)
+        {
+            oPixels[3*i + 0] = aGamma.ToByte(mColor[i].x * aScale);
+            oPixels[3*i + 1] = aGamma.ToByte(mColor[i].y * aScale);
+            oPixels[3*i + 2] = aGamma.ToByte(mColor[i].z * aScale);
+        }
+    }
+
+    // Binary PPM (P6)
     void SavePPM(
         const char *aFilename,
         float       aGamma = 1.f)
     {
-        const float invGamma = 1.f / aGamma;
+        char header[64];
+        const int headerSize = sprintf(header, "P6\n%d %d\n255\n", mResX, mResY);
 
-        std::ofstream ppm(aFilename);
-        ppm << "P3" << std::endl;
-        ppm << mResX << " " << mResY << std::endl;
-        ppm << "255" << std::endl;
+        std::vector<byte> data(headerSize + 3 * mResX * mResY);
+        memcpy(&data[0], header, headerSize);
 
-        Vec3f *ptr = &mColor[0];
+        const GammaTable gamma(aGamma);
+        byte *pixels = &data[headerSize];
 
+#pragma omp parallel for
         for(int y=0; y<mResY; y++)
         {
+            const Vec3f *src = &mColor[y * mResX];
+            byte        *dst = pixels + 3 * y * mResX;
+
             for(int x=0; x<mResX; x++)
             {
-                ptr = &mColor[x + y*mResX];
-                int r = int(std::pow(ptr->x, invGamma) * 255.f);
-                int g = int(std::pow(ptr->y, invGamma) * 255.f);
-                int b = int(std::pow(ptr->z, invGamma) * 255.f);
-
-                ppm << std::min(255, std::max(0, r)) << " "
-                    << std::min(255, std::max(0, g)) << " "
-                    << std::min(255, std::max(0, b)) << " ";
+                dst[3*x + 0] = gamma.ToByte(src[x].x);
+                dst[3*x + 1] = gamma.ToByte(src[x].y);
+                dst[3*x + 2] = gamma.ToByte(src[x].z);
             }
-
-            ppm << std::endl;
         }
+
+        std::ofstream ppm(aFilename, std::ios::binary);
+        ppm.write((const char*)&data[0], data.size());
     }
 
     void SavePFM(const char* aFilename)
@@ -145,6 +274,58 @@ public:
             mColor.size() * sizeof(Vec3f));
     }
 
+    // Loads file written by SavePFM, returns false on failure
+    bool LoadPFM(const char* aFilename)
+    {
+        std::ifstream pfm(aFilename, std::ios::binary);
+
+        std::string magic;
+        int   resX = 0, resY = 0;
+        float scale = 0;
+        pfm >> magic >> resX >> resY >> scale;
+        pfm.get(); // single whitespace before data
+
+        if(!pfm || magic != "PF" || resX <= 0 || resY <= 0 || scale >= 0)
+            return false;
+
+        Setup(Vec2f(float(resX), float(resY)));
+        pfm.read(reinterpret_cast<char*>(&mColor[0]),
+            mColor.size() * sizeof(Vec3f));
+
+        return !pfm.fail();
+    }
+
+    // Raw accumulated data for checkpoints, resolution and pixels.
+    // A released framebuffer is stored as empty
+    void SaveRaw(std::ostream &aoStream) const
+    {
+        const bool empty  = mColor.empty();
+        const int  res[2] = { empty ? 0 : mResX, empty ? 0 : mResY };
+        aoStream.write((const char*)res, sizeof(res));
+
+        if(!mColor.empty())
+            aoStream.write((const char*)&mColor[0], mColor.size() * sizeof(Vec3f));
+    }
+
+    bool LoadRaw(std::istream &aoStream)
+    {
+        int res[2] = { 0, 0 };
+        aoStream.read((char*)res, sizeof(res));
+
+        if(aoStream.fail() || res[0] < 0 || res[1] < 0)
+            return false;
+
+        if(res[0] == 0 || res[1] == 0)
+        {
+            Release();
+            return true;
+        }
+
+        Setup(Vec2f(float(res[0]), float(res[1])));
+        aoStream.read((char*)&mColor[0], mColor.size() * sizeof(Vec3f));
+        return !aoStream.fail();
+    }
+
     //////////////////////////////////////////////////////////////////////////
     // Saving BMP
     struct BmpHeader
@@ -171,83 +352,312 @@ public:
         const char *aFilename,
         float       aGamma = 1.f)
     {
-        std::ofstream bmp(aFilename, std::ios::binary);
+        // Rows are padded to multiple of 4 bytes
+        const int rowSize    = (3 * mResX + 3) & ~3;
+        const int headerSize = int(sizeof(BmpHeader) + 2);
+
         BmpHeader header;
-        bmp.write("BM", 2);
-        header.mFileSize   = uint(sizeof(BmpHeader) + 2) + mResX * mResY * 3;
+        header.mFileSize   = uint(headerSize + rowSize * mResY);
         header.mReserved01 = 0;
-        header.mDataOffset = uint(sizeof(BmpHeader) + 2);
+        header.mDataOffset = uint(headerSize);
         header.mHeaderSize = 40;
         header.mWidth      = mResX;
         header.mHeight     = mResY;
         header.mColorPlates     = 1;
         header.mBitsPerPixel    = 24;
         header.mCompression     = 0;
-        header.mImageSize       = mResX * mResY * 3;
+        header.mImageSize       = uint(rowSize * mResY);
         header.mHorizRes        = 2953;
         header.mVertRes         = 2953;
         header.mPaletteColors   = 0;
         header.mImportantColors = 0;
 
-        bmp.write((char*)&header, sizeof(header));
+        std::vector<byte> data(header.mFileSize, 0);
+        memcpy(&data[0], "BM", 2);
+        memcpy(&data[2], &header, sizeof(header));
 
-        const float invGamma = 1.f / aGamma;
+        const GammaTable gamma(aGamma);
+        byte *pixels = &data[headerSize];
+
+#pragma omp parallel for
         for(int y=0; y<mResY; y++)
         {
+            // bmp is stored from bottom up
+            const Vec3f *src = &mColor[(mResY-y-1) * mResX];
+            byte        *dst = pixels + y * rowSize;
+
             for(int x=0; x<mResX; x++)
             {
-                // bmp is stored from bottom up
-                const Vec3f &rgbF = mColor[x + (mResY-y-1)*mResX];
-                typedef unsigned char byte;
-                float gammaBgr[3];
-                gammaBgr[0] = std::pow(rgbF.z, invGamma) * 255.f;
-                gammaBgr[1] = std::pow(rgbF.y, invGamma) * 255.f;
-                gammaBgr[2] = std::pow(rgbF.x, invGamma) * 255.f;
-
-                byte bgrB[3];
-                bgrB[0] = byte(std::min(255.f, std::max(0.f, gammaBgr[0])));
-                bgrB[1] = byte(std::min(255.f, std::max(0.f, gammaBgr[1])));
-                bgrB[2] = byte(std::min(255.f, std::max(0.f, gammaBgr[2])));
-
-                bmp.write((char*)&bgrB, sizeof(bgrB));
+                dst[3*x + 0] = gamma.ToByte(src[x].z);
+                dst[3*x + 1] = gamma.ToByte(src[x].y);
+                dst[3*x + 2] = gamma.ToByte(src[x].x);
             }
         }
+
+        std::ofstream bmp(aFilename, std::ios::binary);
+        bmp.write((const char*)&data[0], data.size());
     }
 
     //////////////////////////////////////////////////////////////////////////
     // Saving HDR
+    static void ToRgbe(const Vec3f &aRgbF, byte *oRgbe)
+    {
+        float v = std::max(aRgbF.x, std::max(aRgbF.y, aRgbF.z));
+
+        if(v >= 1e-32f)
+        {
+            int e;
+            v = float(frexp(v, &e) * 256.f / v);
+            oRgbe[0] = byte(aRgbF.x * v);
+            oRgbe[1] = byte(aRgbF.y * v);
+            oRgbe[2] = byte(aRgbF.z * v);
+            oRgbe[3] = byte(e + 128);
+        }
+        else
+        {
+            oRgbe[0] = oRgbe[1] = oRgbe[2] = oRgbe[3] = 0;
+        }
+    }
+
+    // Run length encodes one channel of a scanline the Radiance way:
+    // runs of at least 4 equal bytes are stored as (128 + count, value),
+    // everything else as (count, count values), count is at most 127 or
+    // 128 respectively
+    static void EncodeRle(
+        const byte        *aData,
+        const int         aCount,
+        std::vector<byte> &aoOut)
+    {
+        const int kMinRun = 4;
+        int cur = 0;
+
+        while(cur < aCount)
+        {
+            // Find next run of at least kMinRun
+            int runStart = cur;
+            int runCount = 0;
+            int oldRunCount = 0;
+
+            while(runCount < kMinRun && runStart < aCount)
+            {
+                runStart   += runCount;
+                oldRunCount = runCount;
+                runCount    = 1;
+
+                while(runStart + runCount < aCount && runCount < 127 &&
+                    aData[runStart] == aData[runStart + runCount])
+                {
+                    runCount++;
+                }
+            }
+
+            // Short run just before the long one is still worth a run
+            if(oldRunCount > 1 && oldRunCount == runStart - cur)
+            {
+                aoOut.push_back(byte(128 + oldRunCount));
+                aoOut.push_back(aData[cur]);
+                cur = runStart;
+            }
+
+            while(cur < runStart)
+            {
+                const int count = std::min(128, runStart - cur);
+                aoOut.push_back(byte(count));
+                aoOut.insert(aoOut.end(), aData + cur, aData + cur + count);
+                cur += count;
+            }
+
+            if(runCount >= kMinRun)
+            {
+                aoOut.push_back(byte(128 + runCount));
+                aoOut.push_back(aData[runStart]);
+                cur += runCount;
+            }
+        }
+    }
+
     void SaveHDR(const char* aFilename)
     {
-        std::ofstream hdr(aFilename, std::ios::binary);
+        std::ostringstream header;
+        header << "#?RADIANCE" << '\n';
+        header << "# SmallVCM" << '\n';
+        header << "FORMAT=32-bit_rle_rgbe" << '\n' << '\n';
+        header << "-Y " << mResY << " +X " << mResX << '\n';
 
-        hdr << "#?RADIANCE" << '\n';
-        hdr << "# SmallVCM" << '\n';
-        hdr << "FORMAT=32-bit_rle_rgbe" << '\n' << '\n';
-        hdr << "-Y " << mResY << " +X " << mResX << '\n';
+        // The format can only run length encode these widths
+        const bool useRle = mResX >= 8 && mResX < 32768;
 
+        std::vector< std::vector<byte> > rows(mResY);
+
+#pragma omp parallel for
         for(int y=0; y<mResY; y++)
         {
+            std::vector<byte> &row = rows[y];
+            const Vec3f *src = &mColor[y * mResX];
+
+            if(!useRle)
+            {
+                row.resize(4 * mResX);
+                for(int x=0; x<mResX; x++)
+                    ToRgbe(src[x], &row[4*x]);
+                continue;
+            }
+
+            // Channels are encoded separately, one after another
+            std::vector<byte> channels(4 * mResX);
             for(int x=0; x<mResX; x++)
             {
-                typedef unsigned char byte;
-                byte rgbe[4] = {0,0,0,0};
+                byte rgbe[4];
+                ToRgbe(src[x], rgbe);
+                for(int c=0; c<4; c++)
+                    channels[c * mResX + x] = rgbe[c];
+            }
+
+            row.push_back(2);
+            row.push_back(2);
+            row.push_back(byte(mResX >> 8));
+            row.push_back(byte(mResX & 0xff));
 
-                const Vec3f &rgbF = mColor[x + y*mResX];
-                float v = std::max(rgbF.x, std::max(rgbF.y, rgbF.z));
+            for(int c=0; c<4; c++)
+                EncodeRle(&channels[c * mResX], mResX, row);
+        }
+
+        std::vector<byte> data;
+        const std::string headerStr = header.str();
+        data.insert(data.end(), headerStr.begin(), headerStr.end());
+
+        for(int y=0; y<mResY; y++)
+            data.insert(data.end(), rows[y].begin(), rows[y].end());
+
+        std::ofstream hdr(aFilename, std::ios::binary);
+        hdr.write((const char*)&data[0], data.size());
+    }
 
-                if(v >= 1e-32f)
+    //////////////////////////////////////////////////////////////////////////
+    // Saving EXR, uncompressed half float RGB split into tiles of
+    // kExrTileSize x kExrTileSize pixels. Every tile is converted on
+    // its own, straight into its place in the file.
+    static const int kExrTileSize = 64;
+
+    static void ExrAttribute(
+        std::vector<byte> &aoOut,
+        const char        *aName,
+        const char        *aType,
+        const void        *aValue,
+        const int         aSize)
+    {
+        aoOut.insert(aoOut.end(), aName, aName + strlen(aName) + 1);
+        aoOut.insert(aoOut.end(), aType, aType + strlen(aType) + 1);
+        aoOut.insert(aoOut.end(), (const byte*)&aSize, (const byte*)&aSize + 4);
+        aoOut.insert(aoOut.end(), (const byte*)aValue, (const byte*)aValue + aSize);
+    }
+
+    void SaveEXR(const char* aFilename)
+    {
+        std::vector<byte> data;
+
+        // Magic number and version 2 with the tiled flag
+        const int magic[2] = { 20000630, 2 | 0x200 };
+        data.insert(data.end(), (const byte*)magic, (const byte*)magic + 8);
+
+        // Channels have to be sorted by name. Each is its name, pixel
+        // type (1 is half), linear flag, 3 reserved bytes and x, y sampling
+        byte channels[3 * 18 + 1];
+        const char *names = "BGR";
+        for(int c=0; c<3; c++)
+        {
+            byte *ch = channels + c * 18;
+            const int desc[4] = { 1, 0, 1, 1 };
+            ch[0] = byte(names[c]);
+            ch[1] = 0;
+            memcpy(ch + 2, desc, sizeof(desc));
+        }
+        channels[3 * 18] = 0;
+
+        const int   window[4] = { 0, 0, mResX - 1, mResY - 1 };
+        const byte  zero      = 0; // no compression, increasing y
+        const float one       = 1.f;
+        const float center[2] = { 0.f, 0.f };
+
+        // Tile x and y size, and the level mode byte (one level)
+        byte tiles[9];
+        const uint tileSize[2] = { kExrTileSize, kExrTileSize };
+        memcpy(tiles, tileSize, sizeof(tileSize));
+        tiles[8] = 0;
+
+        ExrAttribute(data, "channels",           "chlist",      channels, sizeof(channels));
+        ExrAttribute(data, "compression",        "compression", &zero,    1);
+        ExrAttribute(data, "dataWindow",         "box2i",       window,   sizeof(window));
+        ExrAttribute(data, "displayWindow",      "box2i",       window,   sizeof(window));
+        ExrAttribute(data, "lineOrder",          "lineOrder",   &zero,    1);
+        ExrAttribute(data, "pixelAspectRatio",   "float",       &one,     sizeof(one));
+        ExrAttribute(data, "screenWindowCenter", "v2f",         center,   sizeof(center));
+        ExrAttribute(data, "screenWindowWidth",  "float",       &one,     sizeof(one));
+        ExrAttribute(data, "tiles",              "tiledesc",    tiles,    sizeof(tiles));
+        data.push_back(0);
+
+        // Offset table is followed by the tiles, row by row. Each tile
+        // starts with its coordinates, level and data size, then for
+        // each of its scanlines the B, G, and R halves
+        const int tilesX    = (mResX + kExrTileSize - 1) / kExrTileSize;
+        const int tilesY    = (mResY + kExrTileSize - 1) / kExrTileSize;
+        const int tileCount = tilesX * tilesY;
+
+        std::vector<uint64> offsets(tileCount);
+        uint64 offset = data.size() + tileCount * sizeof(uint64);
+
+        for(int t=0; t<tileCount; t++)
+        {
+            const int width  = std::min(kExrTileSize, mResX - (t % tilesX) * kExrTileSize);
+            const int height = std::min(kExrTileSize, mResY - (t / tilesX) * kExrTileSize);
+            offsets[t] = offset;
+            offset += 5 * sizeof(int) + width * height * 3 * sizeof(ushort);
+        }
+
+        const size_t tableStart = data.size();
+        data.resize(size_t(offset));
+        memcpy(&data[tableStart], &offsets[0], tileCount * sizeof(uint64));
+
+#pragma omp parallel for
+        for(int t=0; t<tileCount; t++)
+        {
+            const int tileX  = t % tilesX;
+            const int tileY  = t / tilesX;
+            const int minX   = tileX * kExrTileSize;
+            const int minY   = tileY * kExrTileSize;
+            const int width  = std::min(kExrTileSize, mResX - minX);
+            const int height = std::min(kExrTileSize, mResY - minY);
+
+            const int tileHeader[5] = { tileX, tileY, 0, 0,
+                int(width * height * 3 * sizeof(ushort)) };
+
+            byte *dst = &data[size_t(offsets[t])];
+            memcpy(dst, tileHeader, sizeof(tileHeader));
+
+            dst += sizeof(tileHeader);
+
+            // The file position need not be aligned for ushort
+            ushort line[3 * kExrTileSize];
+            const int lineSize = int(3 * width * sizeof(ushort));
+
+            for(int y=0; y<height; y++)
+            {
+                const Vec3f *src = &mColor[(minY + y) * mResX + minX];
+
+                for(int x=0; x<width; x++)
                 {
-                    int e;
-                    v = float(frexp(v, &e) * 256.f / v);
-                    rgbe[0] = byte(rgbF.x * v);
-                    rgbe[1] = byte(rgbF.y * v);
-                    rgbe[2] = byte(rgbF.z * v);
-                    rgbe[3] = byte(e + 128);
+                    line[x]             = FloatToHalf(src[x].z);
+                    line[x + width]     = FloatToHalf(src[x].y);
+                    line[x + 2 * width] = FloatToHalf(src[x].x);
                 }
 
-                hdr.write((char*)&rgbe[0], 4);
+                memcpy(dst, line, lineSize);
+                dst += lineSize;
             }
         }
+
+        std::ofstream exr(aFilename, std::ios::binary);
+        exr.write((const char*)&data[0], data.size());
     }
 
 private:
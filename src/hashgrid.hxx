@@ -27,32 +27,99 @@
 
 #include <vector>
 #include <cmath>
+#include <string.h>
+#include <algorithm>
+#ifndef NO_OMP
+#include <omp.h>
+#endif
 #include "math.hxx"
 
+// Range query kernel instruction set, NO_SIMD forces the scalar one
+#ifndef NO_SIMD
+#if defined(__AVX2__)
+#define HASHGRID_AVX2
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HASHGRID_SSE
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HASHGRID_NEON
+#include <arm_neon.h>
+#endif
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 class HashGrid
 {
+    // Below this many particles the parallel build does not pay off
+    enum { kMinParallelParticles = 16384 };
+
+    // Key of the sorted build, Morton code of the cell and particle index
+    struct SortKey
+    {
+        uint64 mCode;
+        int    mIndex;
+
+        bool operator<(const SortKey &aOther) const
+        {
+            return (mCode != aOther.mCode) ?
+                (mCode < aOther.mCode) : (mIndex < aOther.mIndex);
+        }
+    };
+
+    // Occupied cell of the sorted build. Slots written by an earlier build
+    // have an older mStamp and count as empty, so the table is never cleared.
+    struct SortedCell
+    {
+        uint64 mCode;
+        int    mBegin;
+        int    mEnd;
+        uint   mStamp;
+    };
+
 public:
+    HashGrid() : mNumCells(1), mIsSorted(false), mStamp(0) {}
+
+    // Number of cells of the hashed grid; for the sorted build the minimal
+    // size of its cell table
     void Reserve(int aNumCells)
     {
-        mCellEnds.resize(aNumCells);
+        mNumCells = std::max(1, aNumCells);
     }
 
-    template<typename tParticle>
+    // When called outside of a parallel region, the build runs on all
+    // OpenMP threads. The resulting cell layout is the same in both cases.
     void Build(
-        const std::vector<tParticle> &aParticles,
+        const std::vector<Vec3f> &aPositions,
         float aRadius)
     {
         mRadius      = aRadius;
         mRadiusSqr   = Sqr(mRadius);
         mCellSize    = mRadius * 2.f;
         mInvCellSize = 1.f / mCellSize;
+        mIsSorted    = false;
+
+        mCellEnds.resize(mNumCells);
+
+#ifndef NO_OMP
+        const int numThreads = omp_in_parallel() ? 1 : omp_get_max_threads();
+
+        if(numThreads > 1 && aPositions.size() >= kMinParallelParticles)
+        {
+            BuildParallel(aPositions, numThreads);
+            return;
+        }
+#endif
 
         mBBoxMin = Vec3f( 1e36f);
         mBBoxMax = Vec3f(-1e36f);
 
-        for(size_t i=0; i<aParticles.size(); i++)
+        for(size_t i=0; i<aPositions.size(); i++)
         {
-            const Vec3f &pos = aParticles[i].GetPosition();
+            const Vec3f &pos = aPositions[i];
             for(int j=0; j<3; j++)
             {
                 mBBoxMax.Get(j) = std::max(mBBoxMax.Get(j), pos.Get(j));
@@ -60,13 +127,17 @@ public:
             }
         }
 
-        mIndices.resize(aParticles.size());
+        // Queries just outside the particles still find those within radius
+        mBBoxMin -= Vec3f(mRadius);
+        mBBoxMax += Vec3f(mRadius);
+
+        ResizeParticles(int(aPositions.size()));
         memset(&mCellEnds[0], 0, mCellEnds.size() * sizeof(int));
 
         // set mCellEnds[x] to number of particles within x
-        for(size_t i=0; i<aParticles.size(); i++)
+        for(size_t i=0; i<aPositions.size(); i++)
         {
-            const Vec3f &pos = aParticles[i].GetPosition();
+            const Vec3f &pos = aPositions[i];
             mCellEnds[GetCellIndex(pos)]++;
         }
 
@@ -80,20 +151,21 @@ public:
             sum += temp;
         }
 
-        for(size_t i=0; i<aParticles.size(); i++)
+        for(size_t i=0; i<aPositions.size(); i++)
         {
-            const Vec3f &pos = aParticles[i].GetPosition();
+            const Vec3f &pos = aPositions[i];
             const int targetIdx = mCellEnds[GetCellIndex(pos)]++;
             mIndices[targetIdx] = int(i);
+            SetSortedPosition(targetIdx, pos);
         }
 
         // now mCellEnds[x] points to the index right after the last
         // element of cell x
 
         //// DEBUG
-        //for(size_t i=0; i<aParticles.size(); i++)
+        //for(size_t i=0; i<aPositions.size(); i++)
         //{
-        //    const Vec3f &pos  = aParticles[i].GetPosition();
+        //    const Vec3f &pos  = aPositions[i];
         //    Vec2i range = GetCellRange(GetCellIndex(pos));
         //    bool found = false;
         //    for(;range.x < range.y; range.x++)
@@ -106,10 +178,218 @@ public:
         //}
     }
 
-    template<typename tParticle, typename tQuery>
-    void Process(
-        const std::vector<tParticle> &aParticles,
-        tQuery& aQuery)
+#ifndef NO_OMP
+    // Same steps as the serial build, each split over aNumThreads threads.
+    // Every thread owns a contiguous chunk of particles and has its own
+    // histogram of cell counts. Threads with lower index place their
+    // particles first within each cell, so the particle order inside cells
+    // is identical to the serial build.
+    void BuildParallel(
+        const std::vector<Vec3f> &aPositions,
+        const int                aNumThreads)
+    {
+        const int numParticles = (int)aPositions.size();
+        const int numCells     = (int)mCellEnds.size();
+
+        ResizeParticles(numParticles);
+        mThreadCounts.resize(size_t(aNumThreads) * numCells);
+
+        std::vector<Vec3f> &threadBBoxMin = mChunkBBoxMin;
+        std::vector<Vec3f> &threadBBoxMax = mChunkBBoxMax;
+        std::vector<int>   &chunkSums     = mChunkBounds;
+        threadBBoxMin.assign(aNumThreads, Vec3f( 1e36f));
+        threadBBoxMax.assign(aNumThreads, Vec3f(-1e36f));
+        chunkSums.assign(aNumThreads + 1, 0);
+
+#pragma omp parallel num_threads(aNumThreads)
+        {
+            // The runtime can give us fewer threads than asked for,
+            // work is therefore split by the actual team size
+            const int numUsed  = omp_get_num_threads();
+            const int threadId = omp_get_thread_num();
+
+            const int particleBegin = int((long long)numParticles * threadId / numUsed);
+            const int particleEnd   = int((long long)numParticles * (threadId + 1) / numUsed);
+            const int cellBegin     = int((long long)numCells * threadId / numUsed);
+            const int cellEnd       = int((long long)numCells * (threadId + 1) / numUsed);
+
+            // Bounding box of own chunk
+            Vec3f &bboxMin = threadBBoxMin[threadId];
+            Vec3f &bboxMax = threadBBoxMax[threadId];
+
+            for(int i=particleBegin; i<particleEnd; i++)
+            {
+                const Vec3f &pos = aPositions[i];
+                for(int j=0; j<3; j++)
+                {
+                    bboxMax.Get(j) = std::max(bboxMax.Get(j), pos.Get(j));
+                    bboxMin.Get(j) = std::min(bboxMin.Get(j), pos.Get(j));
+                }
+            }
+
+#pragma omp barrier
+#pragma omp single
+            {
+                mBBoxMin = Vec3f( 1e36f);
+                mBBoxMax = Vec3f(-1e36f);
+
+                for(int t=0; t<numUsed; t++)
+                {
+                    for(int j=0; j<3; j++)
+                    {
+                        mBBoxMax.Get(j) = std::max(mBBoxMax.Get(j), threadBBoxMax[t].Get(j));
+                        mBBoxMin.Get(j) = std::min(mBBoxMin.Get(j), threadBBoxMin[t].Get(j));
+                    }
+                }
+
+                // Queries just outside the particles still find those within radius
+                mBBoxMin -= Vec3f(mRadius);
+                mBBoxMax += Vec3f(mRadius);
+            } // implicit barrier
+
+            // Per-thread histogram of own particles
+            int *counts = &mThreadCounts[size_t(threadId) * numCells];
+            memset(counts, 0, numCells * sizeof(int));
+
+            for(int i=particleBegin; i<particleEnd; i++)
+                counts[GetCellIndex(aPositions[i])]++;
+
+#pragma omp barrier
+
+            // Exclusive prefix sum over cells (and over threads within each
+            // cell). First every thread sums up its own range of cells...
+            int chunkSum = 0;
+            for(int c=cellBegin; c<cellEnd; c++)
+                for(int t=0; t<numUsed; t++)
+                    chunkSum += mThreadCounts[size_t(t) * numCells + c];
+
+            chunkSums[threadId + 1] = chunkSum;
+
+#pragma omp barrier
+#pragma omp single
+            {
+                for(int t=0; t<numUsed; t++)
+                    chunkSums[t + 1] += chunkSums[t];
+            } // implicit barrier
+
+            // ... then turns the counts into write positions of each thread.
+            // mCellEnds[x] is where the cell ends, as after the serial scatter
+            int sum = chunkSums[threadId];
+            for(int c=cellBegin; c<cellEnd; c++)
+            {
+                for(int t=0; t<numUsed; t++)
+                {
+                    int &count = mThreadCounts[size_t(t) * numCells + c];
+                    const int temp = count;
+                    count = sum;
+                    sum  += temp;
+                }
+                mCellEnds[c] = sum;
+            }
+
+#pragma omp barrier
+
+            // Scatter own particles, in order, to their positions
+            for(int i=particleBegin; i<particleEnd; i++)
+            {
+                const Vec3f &pos = aPositions[i];
+                const int targetIdx = counts[GetCellIndex(pos)]++;
+                mIndices[targetIdx] = i;
+                SetSortedPosition(targetIdx, pos);
+            }
+        }
+    }
+#endif
+
+    // Alternative build, which sorts particles by the Morton code of their
+    // cell. oOrder[i] is the original index of the i-th sorted particle.
+    // The caller is expected to reorder particle data the same way, because
+    // Process then reports indices into the sorted order. Cells map straight
+    // to contiguous ranges of particles, neighbouring cells are mostly close
+    // in memory, and there is no mIndices indirection.
+    void BuildSorted(
+        const std::vector<Vec3f> &aPositions,
+        float                    aRadius,
+        std::vector<int>         &oOrder)
+    {
+        mRadius      = aRadius;
+        mRadiusSqr   = Sqr(mRadius);
+        mCellSize    = mRadius * 2.f;
+        mInvCellSize = 1.f / mCellSize;
+        mIsSorted    = true;
+
+        const int numParticles = (int)aPositions.size();
+
+        ComputeBBox(aPositions);
+
+        // Sort particles by Morton code of their cell
+        mSortKeys.resize(numParticles);
+
+#pragma omp parallel for
+        for(int i=0; i<numParticles; i++)
+        {
+            mSortKeys[i].mCode  = GetMortonCode(GetCellCoord(aPositions[i]));
+            mSortKeys[i].mIndex = i;
+        }
+
+        SortKeys();
+
+        oOrder.resize(numParticles);
+        ResizeParticles(numParticles);
+
+#pragma omp parallel for
+        for(int i=0; i<numParticles; i++)
+        {
+            oOrder[i] = mSortKeys[i].mIndex;
+            SetSortedPosition(i, aPositions[oOrder[i]]);
+        }
+
+        // Table of occupied cells, at least half empty for short probing
+        int numOccupied = 0;
+        for(int i=0; i<numParticles; i++)
+        {
+            if(i == 0 || mSortKeys[i].mCode != mSortKeys[i-1].mCode)
+                numOccupied++;
+        }
+
+        uint tableSize = 1;
+        while(tableSize < uint(mNumCells) || tableSize < 2u * uint(numOccupied))
+            tableSize *= 2;
+
+        mCellMask = tableSize - 1;
+        mSortedCells.resize(tableSize);
+
+        // New slots have stamp 0, which is never current
+        if(++mStamp == 0)
+        {
+            memset(&mSortedCells[0], 0, tableSize * sizeof(SortedCell));
+            mStamp = 1;
+        }
+
+        for(int begin=0; begin<numParticles; )
+        {
+            const uint64 code = mSortKeys[begin].mCode;
+
+            int end = begin + 1;
+            while(end < numParticles && mSortKeys[end].mCode == code)
+                end++;
+
+            uint slot = HashMortonCode(code) & mCellMask;
+            while(mSortedCells[slot].mStamp == mStamp)
+                slot = (slot + 1) & mCellMask;
+
+            mSortedCells[slot].mCode  = code;
+            mSortedCells[slot].mBegin = begin;
+            mSortedCells[slot].mEnd   = end;
+            mSortedCells[slot].mStamp = mStamp;
+
+            begin = end;
+        }
+    }
+
+    // Calls aQuery.Process(index) for every particle within radius
+    template<typename tQuery>
+    void Process(tQuery& aQuery) const
     {
         const Vec3f queryPos = aQuery.GetPosition();
 
@@ -137,38 +417,303 @@ public:
         const int  pyo = py + (fractCoord.y < 0.5f ? -1 : +1);
         const int  pzo = pz + (fractCoord.z < 0.5f ? -1 : +1);
 
-        int found = 0;
+        if(mIsSorted)
+        {
+            const Vec3i coords[8] = {
+                Vec3i(px , py , pz ), Vec3i(px , py , pzo),
+                Vec3i(px , pyo, pz ), Vec3i(px , pyo, pzo),
+                Vec3i(pxo, py , pz ), Vec3i(pxo, py , pzo),
+                Vec3i(pxo, pyo, pz ), Vec3i(pxo, pyo, pzo) };
+
+            for(int j=0; j<8; j++)
+            {
+                const SortedCell *cell = FindSortedCell(GetMortonCode(coords[j]));
+                if(cell)
+                    ProcessRange<false>(cell->mBegin, cell->mEnd, queryPos, aQuery);
+            }
+
+            return;
+        }
+
+        // The hash can map several of the visited cells to the same
+        // index, particles of such cell must not be processed twice
+        int cellIndices[8];
+        cellIndices[0] = GetCellIndex(Vec3i(px , py , pz ));
+        cellIndices[1] = GetCellIndex(Vec3i(px , py , pzo));
+        cellIndices[2] = GetCellIndex(Vec3i(px , pyo, pz ));
+        cellIndices[3] = GetCellIndex(Vec3i(px , pyo, pzo));
+        cellIndices[4] = GetCellIndex(Vec3i(pxo, py , pz ));
+        cellIndices[5] = GetCellIndex(Vec3i(pxo, py , pzo));
+        cellIndices[6] = GetCellIndex(Vec3i(pxo, pyo, pz ));
+        cellIndices[7] = GetCellIndex(Vec3i(pxo, pyo, pzo));
 
         for(int j=0; j<8; j++)
         {
-            Vec2i activeRange;
-            switch(j)
+            bool visited = false;
+            for(int k=0; k<j; k++)
+                visited |= (cellIndices[k] == cellIndices[j]);
+
+            if(visited)
+                continue;
+
+            const Vec2i activeRange = GetCellRange(cellIndices[j]);
+            ProcessRange<true>(activeRange.x, activeRange.y, queryPos, aQuery);
+        }
+    }
+
+private:
+
+    void ResizeParticles(int aNumParticles)
+    {
+        // Sorted build needs no index indirection
+        mIndices.resize(mIsSorted ? 0 : aNumParticles);
+        mSortedX.resize(aNumParticles);
+        mSortedY.resize(aNumParticles);
+        mSortedZ.resize(aNumParticles);
+    }
+
+    void SetSortedPosition(int aSortedIdx, const Vec3f &aPosition)
+    {
+        mSortedX[aSortedIdx] = aPosition.x;
+        mSortedY[aSortedIdx] = aPosition.y;
+        mSortedZ[aSortedIdx] = aPosition.z;
+    }
+
+    template<bool tIndirect>
+    int GetParticleIndex(int aSortedIdx) const
+    {
+        return tIndirect ? mIndices[aSortedIdx] : aSortedIdx;
+    }
+
+    static int LowestBit(uint aMask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, aMask);
+        return int(index);
+#else
+        return __builtin_ctz(aMask);
+#endif
+    }
+
+    // Computes bounding box of all particles
+    void ComputeBBox(const std::vector<Vec3f> &aPositions)
+    {
+        const int numParticles = (int)aPositions.size();
+        const int chunkSize    = 4096;
+        const int numChunks    = (numParticles + chunkSize - 1) / chunkSize;
+
+        std::vector<Vec3f> &chunkMin = mChunkBBoxMin;
+        std::vector<Vec3f> &chunkMax = mChunkBBoxMax;
+        chunkMin.assign(numChunks, Vec3f( 1e36f));
+        chunkMax.assign(numChunks, Vec3f(-1e36f));
+
+#pragma omp parallel for
+        for(int c=0; c<numChunks; c++)
+        {
+            const int end = std::min(numParticles, (c + 1) * chunkSize);
+            for(int i=c*chunkSize; i<end; i++)
             {
-            case 0: activeRange = GetCellRange(GetCellIndex(Vec3i(px , py , pz ))); break;
-            case 1: activeRange = GetCellRange(GetCellIndex(Vec3i(px , py , pzo))); break;
-            case 2: activeRange = GetCellRange(GetCellIndex(Vec3i(px , pyo, pz ))); break;
-            case 3: activeRange = GetCellRange(GetCellIndex(Vec3i(px , pyo, pzo))); break;
-            case 4: activeRange = GetCellRange(GetCellIndex(Vec3i(pxo, py , pz ))); break;
-            case 5: activeRange = GetCellRange(GetCellIndex(Vec3i(pxo, py , pzo))); break;
-            case 6: activeRange = GetCellRange(GetCellIndex(Vec3i(pxo, pyo, pz ))); break;
-            case 7: activeRange = GetCellRange(GetCellIndex(Vec3i(pxo, pyo, pzo))); break;
+                for(int j=0; j<3; j++)
+                {
+                    chunkMax[c].Get(j) = std::max(chunkMax[c].Get(j), aPositions[i].Get(j));
+                    chunkMin[c].Get(j) = std::min(chunkMin[c].Get(j), aPositions[i].Get(j));
+                }
             }
+        }
 
-            for(; activeRange.x < activeRange.y; activeRange.x++)
+        mBBoxMin = Vec3f( 1e36f);
+        mBBoxMax = Vec3f(-1e36f);
+
+        for(int c=0; c<numChunks; c++)
+        {
+            for(int j=0; j<3; j++)
             {
-                const int particleIndex   = mIndices[activeRange.x];
-                const tParticle &particle = aParticles[particleIndex];
+                mBBoxMax.Get(j) = std::max(mBBoxMax.Get(j), chunkMax[c].Get(j));
+                mBBoxMin.Get(j) = std::min(mBBoxMin.Get(j), chunkMin[c].Get(j));
+            }
+        }
+
+        // Queries just outside the particles still find those within radius
+        mBBoxMin -= Vec3f(mRadius);
+        mBBoxMax += Vec3f(mRadius);
+    }
+
+    // Sorts mSortKeys. Outside of a parallel region, chunks are sorted
+    // by all threads and then merged pairwise.
+    void SortKeys()
+    {
+        const int numKeys = (int)mSortKeys.size();
+#ifndef NO_OMP
+        const int numChunks = omp_in_parallel() ? 1 : omp_get_max_threads();
+#else
+        const int numChunks = 1;
+#endif
+        if(numChunks == 1 || numKeys < kMinParallelParticles)
+        {
+            std::sort(mSortKeys.begin(), mSortKeys.end());
+            return;
+        }
+
+        std::vector<int> &bounds = mChunkBounds;
+        bounds.resize(numChunks + 1);
+        for(int c=0; c<=numChunks; c++)
+            bounds[c] = int((long long)numKeys * c / numChunks);
+
+#pragma omp parallel for
+        for(int c=0; c<numChunks; c++)
+            std::sort(mSortKeys.begin() + bounds[c], mSortKeys.begin() + bounds[c+1]);
 
-                const float distSqr =
-                    (aQuery.GetPosition() - particle.GetPosition()).LenSqr();
+        mSortTemp.resize(numKeys);
 
-                if(distSqr <= mRadiusSqr)
-                    aQuery.Process(particle);
+        for(int width=1; width<numChunks; width*=2)
+        {
+#pragma omp parallel for
+            for(int c=0; c<numChunks; c+=2*width)
+            {
+                const int begin  = bounds[c];
+                const int middle = bounds[std::min(c + width, numChunks)];
+                const int end    = bounds[std::min(c + 2 * width, numChunks)];
+
+                std::merge(
+                    mSortKeys.begin() + begin,  mSortKeys.begin() + middle,
+                    mSortKeys.begin() + middle, mSortKeys.begin() + end,
+                    mSortTemp.begin() + begin);
             }
+
+            mSortKeys.swap(mSortTemp);
         }
     }
 
-private:
+    // Interleaves the lower 21 bits of the cell coordinates. Coordinates
+    // outside of this range alias, which costs only extra distance tests.
+    static uint64 GetMortonCode(const Vec3i &aCoord)
+    {
+        return SpreadBits(uint(aCoord.x)) |
+            (SpreadBits(uint(aCoord.y)) << 1) |
+            (SpreadBits(uint(aCoord.z)) << 2);
+    }
+
+    static uint64 SpreadBits(uint aValue)
+    {
+        uint64 x = aValue & 0x1fffff;
+        x = (x | (x << 32)) & 0x001f00000000ffffull;
+        x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+        x = (x | (x <<  8)) & 0x100f00f00f00f00full;
+        x = (x | (x <<  4)) & 0x10c30c30c30c30c3ull;
+        x = (x | (x <<  2)) & 0x1249249249249249ull;
+        return x;
+    }
+
+    static uint HashMortonCode(uint64 aCode)
+    {
+        return uint((aCode * 0x9e3779b97f4a7c15ull) >> 32);
+    }
+
+    const SortedCell* FindSortedCell(uint64 aCode) const
+    {
+        for(uint slot = HashMortonCode(aCode) & mCellMask; ; slot = (slot + 1) & mCellMask)
+        {
+            const SortedCell &cell = mSortedCells[slot];
+
+            if(cell.mStamp != mStamp)
+                return NULL;
+
+            if(cell.mCode == aCode)
+                return &cell;
+        }
+    }
+
+    // Tests sorted particles [aBegin, aEnd) against the query, several
+    // at a time where SIMD is available. Particles are processed in the
+    // same order as by the scalar loop. When tIndirect, the reported index
+    // goes through mIndices, otherwise it is the sorted index itself.
+    template<bool tIndirect, typename tQuery>
+    void ProcessRange(
+        const int   aBegin,
+        const int   aEnd,
+        const Vec3f &aQueryPos,
+        tQuery      &aQuery) const
+    {
+        int i = aBegin;
+
+#if defined(HASHGRID_AVX2)
+        {
+            const __m256 qx = _mm256_set1_ps(aQueryPos.x);
+            const __m256 qy = _mm256_set1_ps(aQueryPos.y);
+            const __m256 qz = _mm256_set1_ps(aQueryPos.z);
+            const __m256 r2 = _mm256_set1_ps(mRadiusSqr);
+
+            for(; i + 8 <= aEnd; i += 8)
+            {
+                const __m256 dx = _mm256_sub_ps(qx, _mm256_loadu_ps(&mSortedX[i]));
+                const __m256 dy = _mm256_sub_ps(qy, _mm256_loadu_ps(&mSortedY[i]));
+                const __m256 dz = _mm256_sub_ps(qz, _mm256_loadu_ps(&mSortedZ[i]));
+                const __m256 distSqr = _mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+
+                uint mask = uint(_mm256_movemask_ps(_mm256_cmp_ps(distSqr, r2, _CMP_LE_OQ)));
+                for(; mask != 0; mask &= mask - 1)
+                    aQuery.Process(GetParticleIndex<tIndirect>(i + LowestBit(mask)));
+            }
+        }
+#endif
+
+#if defined(HASHGRID_SSE)
+        {
+            const __m128 qx = _mm_set1_ps(aQueryPos.x);
+            const __m128 qy = _mm_set1_ps(aQueryPos.y);
+            const __m128 qz = _mm_set1_ps(aQueryPos.z);
+            const __m128 r2 = _mm_set1_ps(mRadiusSqr);
+
+            for(; i + 4 <= aEnd; i += 4)
+            {
+                const __m128 dx = _mm_sub_ps(qx, _mm_loadu_ps(&mSortedX[i]));
+                const __m128 dy = _mm_sub_ps(qy, _mm_loadu_ps(&mSortedY[i]));
+                const __m128 dz = _mm_sub_ps(qz, _mm_loadu_ps(&mSortedZ[i]));
+                const __m128 distSqr = _mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+                uint mask = uint(_mm_movemask_ps(_mm_cmple_ps(distSqr, r2)));
+                for(; mask != 0; mask &= mask - 1)
+                    aQuery.Process(GetParticleIndex<tIndirect>(i + LowestBit(mask)));
+            }
+        }
+#elif defined(HASHGRID_NEON)
+        {
+            const float32x4_t qx = vdupq_n_f32(aQueryPos.x);
+            const float32x4_t qy = vdupq_n_f32(aQueryPos.y);
+            const float32x4_t qz = vdupq_n_f32(aQueryPos.z);
+            const float32x4_t r2 = vdupq_n_f32(mRadiusSqr);
+
+            for(; i + 4 <= aEnd; i += 4)
+            {
+                const float32x4_t dx = vsubq_f32(qx, vld1q_f32(&mSortedX[i]));
+                const float32x4_t dy = vsubq_f32(qy, vld1q_f32(&mSortedY[i]));
+                const float32x4_t dz = vsubq_f32(qz, vld1q_f32(&mSortedZ[i]));
+                const float32x4_t distSqr = vaddq_f32(vaddq_f32(
+                    vmulq_f32(dx, dx), vmulq_f32(dy, dy)), vmulq_f32(dz, dz));
+
+                const uint32x4_t inside = vcleq_f32(distSqr, r2);
+                if(vgetq_lane_u32(inside, 0)) aQuery.Process(GetParticleIndex<tIndirect>(i + 0));
+                if(vgetq_lane_u32(inside, 1)) aQuery.Process(GetParticleIndex<tIndirect>(i + 1));
+                if(vgetq_lane_u32(inside, 2)) aQuery.Process(GetParticleIndex<tIndirect>(i + 2));
+                if(vgetq_lane_u32(inside, 3)) aQuery.Process(GetParticleIndex<tIndirect>(i + 3));
+            }
+        }
+#endif
+
+        for(; i < aEnd; i++)
+        {
+            const float distSqr =
+                Sqr(aQueryPos.x - mSortedX[i]) +
+                Sqr(aQueryPos.y - mSortedY[i]) +
+                Sqr(aQueryPos.z - mSortedZ[i]);
+
+            if(distSqr <= mRadiusSqr)
+                aQuery.Process(GetParticleIndex<tIndirect>(i));
+        }
+    }
 
     Vec2i GetCellRange(int aCellIndex) const
     {
@@ -186,7 +731,7 @@ private:
             (z * 83492791)) % uint(mCellEnds.size()));
     }
 
-    int GetCellIndex(const Vec3f &aPoint) const
+    Vec3i GetCellCoord(const Vec3f &aPoint) const
     {
         const Vec3f distMin = aPoint - mBBoxMin;
 
@@ -195,9 +740,12 @@ private:
             std::floor(mInvCellSize * distMin.y),
             std::floor(mInvCellSize * distMin.z));
 
-        const Vec3i coordI  = Vec3i(int(coordF.x), int(coordF.y), int(coordF.z));
+        return Vec3i(int(coordF.x), int(coordF.y), int(coordF.z));
+    }
 
-        return GetCellIndex(coordI);
+    int GetCellIndex(const Vec3f &aPoint) const
+    {
+        return GetCellIndex(GetCellCoord(aPoint));
     }
 
 private:
@@ -205,7 +753,22 @@ private:
     Vec3f mBBoxMin;
     Vec3f mBBoxMax;
     std::vector<int> mIndices;
+    // Particle positions in the order of mIndices, for the query kernel
+    std::vector<float> mSortedX, mSortedY, mSortedZ;
     std::vector<int> mCellEnds;
+    std::vector<int> mThreadCounts; // Per-thread histograms of parallel build
+    int              mNumCells;     // Requested number of cells
+
+    // Per-thread or per-chunk scratch of the builds, kept between them
+    std::vector<Vec3f> mChunkBBoxMin, mChunkBBoxMax;
+    std::vector<int>   mChunkBounds;
+
+    // Sorted build
+    bool                    mIsSorted;
+    std::vector<SortKey>    mSortKeys, mSortTemp;
+    std::vector<SortedCell> mSortedCells; // Open addressing table of cells
+    uint                    mCellMask;    // Table size - 1
+    uint                    mStamp;       // Of the last sorted build
 
     float mRadius;
     float mRadiusSqr;
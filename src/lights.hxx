@@ -106,6 +106,10 @@ public:
 
     // Whether the light has delta function (point, directional) or not (area)
     virtual bool IsDelta() const = 0;
+
+    // Luminance of the total emitted flux, lights are picked proportionally
+    // to it. Infinite lights count what enters the scene's bounding sphere.
+    virtual float GetPower(const SceneSphere &aSceneSphere) const = 0;
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -224,6 +228,12 @@ public:
     // Whether the light has delta function (point, directional) or not (area)
     virtual bool IsDelta() const { return false; }
 
+    // Lambertian emitter, flux is pi * radiance * area
+    virtual float GetPower(const SceneSphere &/*aSceneSphere*/) const
+    {
+        return Luminance(mIntensity) * PI_F / mInvArea;
+    }
+
 public:
 
     Vec3f p0, e1, e2;
@@ -309,6 +319,12 @@ public:
     // Whether the light has delta function (point, directional) or not (area)
     virtual bool IsDelta() const  { return true; }
 
+    // Irradiance over the scene's cross section
+    virtual float GetPower(const SceneSphere &aSceneSphere) const
+    {
+        return Luminance(mIntensity) * PI_F * Sqr(aSceneSphere.mSceneRadius);
+    }
+
 public:
 
     Frame mFrame;
@@ -390,6 +406,12 @@ public:
     // Whether the light has delta function (point, directional) or not (area)
     virtual bool IsDelta() const  { return true; }
 
+    // Isotropic emitter, flux is 4 pi * intensity
+    virtual float GetPower(const SceneSphere &/*aSceneSphere*/) const
+    {
+        return Luminance(mIntensity) * 4.f * PI_F;
+    }
+
 public:
 
     Vec3f mPosition;
@@ -507,6 +529,13 @@ public:
     // Whether the light has delta function (point, directional) or not (area)
     virtual bool IsDelta() const  { return false; }
 
+    // As if the bounding sphere was a Lambertian emitter facing inwards
+    virtual float GetPower(const SceneSphere &aSceneSphere) const
+    {
+        return Luminance(mBackgroundColor * mScale) * 4.f * Sqr(PI_F) *
+            Sqr(aSceneSphere.mSceneRadius);
+    }
+
 public:
 
     Vec3f mBackgroundColor;
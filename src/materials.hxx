@@ -48,6 +48,46 @@ public:
         mPhongExponent      = 1.f;
         mMirrorReflectance  = Vec3f(0);
         mIOR = -1.f;
+        Precompute();
+    }
+
+    // Caches the lobe albedos and, for materials without Fresnel,
+    // the whole sampling setup so BSDF::Setup does not redo it per hit.
+    // Must be called again whenever the reflectances above change.
+    void Precompute()
+    {
+        mAlbedoDiffuse = Luminance(mDiffuseReflectance);
+        mAlbedoPhong   = Luminance(mPhongReflectance);
+        mAlbedoReflect = Luminance(mMirrorReflectance);
+        mAlbedoRefract = mIOR > 0.f ? 1.f : 0.f;
+        mHasFresnel    = mIOR >= 0.f;
+
+        // Without Fresnel the reflection coefficient is 1 for any direction,
+        // so nothing is refracted
+        const float totalAlbedo = mAlbedoDiffuse + mAlbedoPhong + mAlbedoReflect;
+
+        if(totalAlbedo < 1e-9f)
+        {
+            mDiffProb  = 0.f;
+            mPhongProb = 0.f;
+            mReflProb  = 0.f;
+            mRefrProb  = 0.f;
+            mContinuationProb = 0.f;
+        }
+        else
+        {
+            mDiffProb  = mAlbedoDiffuse / totalAlbedo;
+            mPhongProb = mAlbedoPhong   / totalAlbedo;
+            mReflProb  = mAlbedoReflect / totalAlbedo;
+            mRefrProb  = 0.f;
+            mContinuationProb =
+                (mDiffuseReflectance +
+                mPhongReflectance +
+                mMirrorReflectance).Max();
+            mContinuationProb = std::min(1.f, std::max(0.f, mContinuationProb));
+        }
+
+        mIsDelta = (mDiffProb == 0) && (mPhongProb == 0);
     }
 
     // diffuse is simply added to the others
@@ -63,6 +103,19 @@ public:
 
     // When mIOR >= 0, we also transmit (just clear glass)
     float mIOR;
+
+    // Filled by Precompute()
+    float mAlbedoDiffuse;
+    float mAlbedoPhong;
+    float mAlbedoReflect;
+    float mAlbedoRefract;
+    bool  mHasFresnel;       //!< Probabilities depend on direction
+    float mDiffProb;         //!< Sampling probabilities when !mHasFresnel
+    float mPhongProb;
+    float mReflProb;
+    float mRefrProb;
+    float mContinuationProb;
+    bool  mIsDelta;          //!< Purely specular when !mHasFresnel
 };
 
 #endif //__MATERIALS_HXX__
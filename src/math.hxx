@@ -26,6 +26,15 @@
 #define __MATH_HXX__
 
 #include <cmath>
+
+// Compilers without C++11 threads (NO_CXX11_THREADS) write checkpoints and
+// previews on the render threads instead of a background thread
+#if defined(_MSC_VER)
+#   if (_MSC_VER < 1700)
+#       define NO_CXX11_THREADS
+#   endif
+#endif
+
 // for portability issues
 #define PI_F     3.14159265358979f
 #define INV_PI_F (1.f / PI_F)
@@ -34,6 +43,8 @@ template<typename T>
 T Sqr(const T& a) { return a*a; }
 
 typedef unsigned uint;
+typedef unsigned short ushort;
+typedef unsigned long long uint64;
 
 //////////////////////////////////////////////////////////////////////////
 // Math section
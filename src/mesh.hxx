@@ -0,0 +1,549 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __MESH_HXX__
+#define __MESH_HXX__
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+#include "bvh.hxx"
+#include "primitives.hxx"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MESH_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Read-only view of a whole file. Uses mmap where available, so pages
+// are loaded on demand and shared with the file cache, other platforms
+// read the file into memory.
+
+class MappedFile
+{
+public:
+
+    MappedFile() :
+        mData(NULL),
+        mSize(0)
+    {}
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const char *aFilename)
+    {
+        Close();
+
+#if defined(MESH_MMAP)
+        const int fd = open(aFilename, O_RDONLY);
+        if(fd < 0)
+            return false;
+
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        void *data = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+
+        if(data == MAP_FAILED)
+            return false;
+
+        mData = (const char*)data;
+        mSize = size_t(st.st_size);
+#else
+        std::ifstream file(aFilename, std::ios::in | std::ios::binary);
+        if(!file)
+            return false;
+
+        file.seekg(0, std::ios::end);
+        const std::streamoff size = file.tellg();
+        file.seekg(0, std::ios::beg);
+
+        if(size <= 0)
+            return false;
+
+        mBuffer.resize(size_t(size));
+        file.read(&mBuffer[0], size);
+
+        if(file.fail())
+        {
+            mBuffer.clear();
+            return false;
+        }
+
+        mData = &mBuffer[0];
+        mSize = mBuffer.size();
+#endif
+        return true;
+    }
+
+    void Close()
+    {
+#if defined(MESH_MMAP)
+        if(mData)
+            munmap((void*)mData, mSize);
+#else
+        std::vector<char>().swap(mBuffer);
+#endif
+        mData = NULL;
+        mSize = 0;
+    }
+
+    // Exchanges the files of the two objects
+    void Swap(MappedFile &aoOther)
+    {
+        std::swap(mData, aoOther.mData);
+        std::swap(mSize, aoOther.mSize);
+#if !defined(MESH_MMAP)
+        mBuffer.swap(aoOther.mBuffer);
+#endif
+    }
+
+    const char* GetData() const { return mData; }
+    size_t      GetSize() const { return mSize; }
+
+private:
+
+    // Not copyable, would unmap twice
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char        *mData;
+    size_t            mSize;
+#if !defined(MESH_MMAP)
+    std::vector<char> mBuffer;
+#endif
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Binary cache of a mesh with its BVH, so it does not have to be parsed
+// and built again. The file is a MeshCacheHeader followed by the packed
+// triangle blocks and BVH nodes, each array starting at a 16 B aligned
+// offset, all in native layout. It is used in place, so it is only valid
+// on the same kind of machine, which the header checks.
+
+// Identifies what the cache was made from
+struct MeshCacheKey
+{
+    long long mSourceSize;  // Size and modification time of the mesh file
+    long long mSourceTime;
+    float     mFitMin[3];   // Box the mesh was fitted to in the scene
+    float     mFitMax[3];
+    int       mMatID;
+
+    bool operator==(const MeshCacheKey &aOther) const
+    {
+        return mSourceSize == aOther.mSourceSize &&
+            mSourceTime == aOther.mSourceTime &&
+            memcmp(mFitMin, aOther.mFitMin, sizeof(mFitMin)) == 0 &&
+            memcmp(mFitMax, aOther.mFitMax, sizeof(mFitMax)) == 0 &&
+            mMatID == aOther.mMatID;
+    }
+};
+
+struct MeshCacheHeader
+{
+    enum { kVersion = 2 }; // 2: packed triangle blocks
+
+    char         mMagic[8];      // "SVCMMESH"
+    int          mVersion;
+    int          mHeaderSize;    // Sizes of the stored types
+    int          mBlockSize;
+    int          mNodeSize;
+    int          mTriangleCount;
+    int          mBlockCount;
+    int          mNodeCount;
+    float        mBBoxMin[3];    // Exact bounds of the mesh
+    float        mBBoxMax[3];
+    MeshCacheKey mKey;
+
+    // Offsets of the arrays from the start of the file
+    size_t GetBlockOffset() const { return Align(sizeof(MeshCacheHeader)); }
+    size_t GetNodeOffset()  const { return Align(GetBlockOffset() + size_t(mBlockCount) * sizeof(Triangle4)); }
+    size_t GetFileSize()    const { return GetNodeOffset() + size_t(mNodeCount) * sizeof(BvhNode); }
+
+    // True when the header is from this version and the stored types
+    // have the same layout here
+    bool IsCompatible() const
+    {
+        return memcmp(mMagic, "SVCMMESH", 8) == 0 &&
+            mVersion    == kVersion &&
+            mHeaderSize == int(sizeof(MeshCacheHeader)) &&
+            mBlockSize  == int(sizeof(Triangle4)) &&
+            mNodeSize   == int(sizeof(BvhNode)) &&
+            mTriangleCount >= 0 && mBlockCount >= 0 && mNodeCount >= 0;
+    }
+
+    static size_t Align(size_t aOffset)
+    {
+        return (aOffset + 15) & ~size_t(15);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Triangles given one by one, as input of TriangleMesh::Setup
+
+struct TriangleList
+{
+    void Add(
+        const Vec3f &aP0,
+        const Vec3f &aP1,
+        const Vec3f &aP2,
+        int         aMatID)
+    {
+        const int first = (int)mVertices.size();
+        mVertices.push_back(aP0);
+        mVertices.push_back(aP1);
+        mVertices.push_back(aP2);
+        mTriangles.push_back(Vec3i(first, first + 1, first + 2));
+        mMatIDs.push_back(aMatID);
+    }
+
+    std::vector<Vec3f> mVertices;
+    std::vector<Vec3i> mTriangles;
+    std::vector<int>   mMatIDs;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Triangle mesh with its own BVH, so the whole mesh is a single object
+// in the scene BVH. Each leaf stores its triangles in Triangle4 blocks,
+// with vertices and normal precomputed, tested with the watertight
+// kernel four at a time. The blocks are either owned or point into
+// a mapped cache file.
+
+class TriangleMesh : public BvhBase<TriangleMesh>
+{
+    friend class BvhBase<TriangleMesh>;
+
+public:
+
+    TriangleMesh() :
+        mBlocks(NULL),
+        mBlockCount(0),
+        mTriangleCount(0)
+    {}
+
+    // Builds the BVH and packs the triangles, aTriangles holds vertex
+    // indices of each into aVertices, aMatIDs its material
+    void Setup(
+        const std::vector<Vec3f> &aVertices,
+        const std::vector<Vec3i> &aTriangles,
+        const std::vector<int>   &aMatIDs)
+    {
+        mCache.Close();
+
+        std::vector<BuildItem> items(aTriangles.size());
+        for(int i=0; i<(int)aTriangles.size(); i++)
+        {
+            BuildItem &item = items[i];
+            item.mBBoxMin = Vec3f( 1e36f);
+            item.mBBoxMax = Vec3f(-1e36f);
+
+            for(int k=0; k<3; k++)
+            {
+                const Vec3f &p = aVertices[aTriangles[i].Get(k)];
+                ExtendBBox(item.mBBoxMin, item.mBBoxMax, p, p);
+            }
+            item.mIndex = i;
+        }
+
+        BuildNodes(items, kPrimitiveLanes);
+
+        // Each leaf gets its own blocks, it then indexes the first one
+        mBlockStorage.clear();
+        mBlockStorage.reserve(items.size() / 2 + 1);
+
+        for(int n=0; n<(int)mNodeStorage.size(); n++)
+        {
+            Node &node = mNodeStorage[n];
+            if(node.mCount == 0)
+                continue;
+
+            const int first = (int)mBlockStorage.size();
+
+            for(int i=0; i<node.mCount; i++)
+            {
+                const int lane = i % kPrimitiveLanes;
+                if(lane == 0)
+                    mBlockStorage.push_back(Triangle4());
+
+                const Vec3i &tri = aTriangles[items[node.mOffset + i].mIndex];
+                mBlockStorage.back().Set(lane, aVertices[tri.x], aVertices[tri.y],
+                    aVertices[tri.z], aMatIDs[items[node.mOffset + i].mIndex]);
+            }
+
+            mBlockStorage.back().FillFrom((node.mCount - 1) % kPrimitiveLanes);
+            node.mOffset = first;
+        }
+
+        mBlockCount    = (int)mBlockStorage.size();
+        mTriangleCount = (int)items.size();
+        mBlocks        = mBlockCount > 0 ? &mBlockStorage[0] : NULL;
+    }
+
+    // Writes mesh with its BVH to cache file. The file is written under
+    // a temporary name and renamed, so a concurrent run never maps
+    // a partially written file.
+    bool SaveCache(
+        const char         *aFilename,
+        const MeshCacheKey &aKey) const
+    {
+        MeshCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.mMagic, "SVCMMESH", 8);
+        header.mVersion       = MeshCacheHeader::kVersion;
+        header.mHeaderSize    = int(sizeof(MeshCacheHeader));
+        header.mBlockSize     = int(sizeof(Triangle4));
+        header.mNodeSize      = int(sizeof(BvhNode));
+        header.mTriangleCount = mTriangleCount;
+        header.mBlockCount    = mBlockCount;
+        header.mNodeCount     = mNodeCount;
+        for(int i=0; i<3; i++)
+        {
+            header.mBBoxMin[i] = mBBoxMin.Get(i);
+            header.mBBoxMax[i] = mBBoxMax.Get(i);
+        }
+        header.mKey = aKey;
+
+        const std::string tmpName = std::string(aFilename) + ".tmp";
+        {
+            std::ofstream file(tmpName.c_str(), std::ios::out | std::ios::binary);
+            if(!file)
+                return false;
+
+            file.write((const char*)&header, sizeof(header));
+            WriteArray(file, header.GetBlockOffset(), mBlocks, mBlockCount);
+            WriteArray(file, header.GetNodeOffset(),  mNodes,  mNodeCount);
+
+            if(file.fail())
+            {
+                file.close();
+                remove(tmpName.c_str());
+                return false;
+            }
+        }
+
+#if defined(_WIN32)
+        // rename does not replace existing files on Windows
+        remove(aFilename);
+#endif
+        return rename(tmpName.c_str(), aFilename) == 0;
+    }
+
+    // Maps cache file written by SaveCache and uses its buffers in place.
+    // Fails, leaving the mesh unchanged, when the file is missing, made
+    // from something else than aKey describes, or damaged.
+    bool LoadCache(
+        const char         *aFilename,
+        const MeshCacheKey &aKey)
+    {
+        MappedFile file;
+        if(!file.Open(aFilename) || file.GetSize() < sizeof(MeshCacheHeader))
+            return false;
+
+        MeshCacheHeader header;
+        memcpy(&header, file.GetData(), sizeof(header));
+
+        if(!header.IsCompatible() || !(header.mKey == aKey) ||
+           header.GetFileSize() != file.GetSize())
+            return false;
+
+        const char *data = file.GetData();
+
+        // Nodes must reference existing nodes and blocks, so traversal
+        // stays within the buffers
+        const Triangle4 *blocks = (const Triangle4*)(data + header.GetBlockOffset());
+        const BvhNode   *nodes  = (const BvhNode*)(data + header.GetNodeOffset());
+
+        for(int i=0; i<header.mNodeCount; i++)
+        {
+            const BvhNode &node = nodes[i];
+            const bool valid = node.mCount > 0 ?
+                (node.mOffset >= 0 && node.mOffset + GetBlockCount(node.mCount) <= header.mBlockCount) :
+                (node.mCount == 0 && node.mOffset > i && node.mOffset < header.mNodeCount &&
+                 node.mAxis >= 0 && node.mAxis < 3);
+
+            if(!valid)
+                return false;
+        }
+
+        if((header.mNodeCount == 0) != (header.mTriangleCount == 0))
+            return false;
+
+        // Load gives all triangles the material of the key, padding
+        // lanes included, anything else would index past the materials
+        for(int i=0; i<header.mBlockCount; i++)
+        {
+            for(int lane=0; lane<kPrimitiveLanes; lane++)
+            {
+                if(blocks[i].mMatID[lane] != aKey.mMatID)
+                    return false;
+            }
+        }
+
+        std::vector<Triangle4>().swap(mBlockStorage);
+
+        mBlocks        = blocks;
+        mBlockCount    = header.mBlockCount;
+        mTriangleCount = header.mTriangleCount;
+
+        SetNodes(nodes, header.mNodeCount,
+            Vec3f(header.mBBoxMin[0], header.mBBoxMin[1], header.mBBoxMin[2]),
+            Vec3f(header.mBBoxMax[0], header.mBBoxMax[1], header.mBBoxMax[2]));
+
+        mCache.Swap(file);
+        return true;
+    }
+
+    int GetTriangleCount() const { return mTriangleCount; }
+
+private:
+
+    static int GetBlockCount(int aTriangleCount)
+    {
+        return (aTriangleCount + kPrimitiveLanes - 1) / kPrimitiveLanes;
+    }
+
+    template<typename T>
+    static void WriteArray(
+        std::ofstream &aoFile,
+        size_t        aOffset,
+        const T       *aData,
+        int           aCount)
+    {
+        // Pads up to the aligned offset
+        static const char zeros[16] = {0};
+        aoFile.write(zeros, std::streamsize(aOffset - size_t(aoFile.tellp())));
+
+        if(aCount > 0)
+            aoFile.write((const char*)aData, std::streamsize(sizeof(T) * size_t(aCount)));
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Leaf intersection
+
+    typedef ShearedRay LeafRay;
+
+    bool IntersectLeaf(
+        const Node    &aLeaf,
+        const Ray     &,
+        const LeafRay &aLeafRay,
+        Isect         &oResult) const
+    {
+        bool anyIntersection = false;
+
+        const int end = aLeaf.mOffset + GetBlockCount(aLeaf.mCount);
+        for(int i=aLeaf.mOffset; i<end; i++)
+        {
+            if(mBlocks[i].Intersect(aLeafRay, oResult))
+                anyIntersection = true;
+        }
+
+        return anyIntersection;
+    }
+
+    bool IntersectLeafP(
+        const Node    &aLeaf,
+        const Ray     &,
+        const LeafRay &aLeafRay,
+        Isect         &oResult) const
+    {
+        const int end = aLeaf.mOffset + GetBlockCount(aLeaf.mCount);
+        for(int i=aLeaf.mOffset; i<end; i++)
+        {
+            if(mBlocks[i].Intersect(aLeafRay, oResult))
+                return true;
+        }
+
+        return false;
+    }
+
+    void IntersectLeafN(
+        const Node    &aLeaf,
+        const Ray     *aRays,
+        const LeafRay *aLeafRays,
+        Isect         *aoResults,
+        char          *aoHits,
+        int,
+        int           aMask) const
+    {
+        for(int j=0; j<kPacketSize; j++)
+        {
+            if(!(aMask & (1 << j)))
+                continue;
+
+            if(IntersectLeaf(aLeaf, aRays[j], aLeafRays[j], aoResults[j]))
+                aoHits[j] = 1;
+        }
+    }
+
+    void OccludedLeafN(
+        const Node    &aLeaf,
+        const Ray     *aRays,
+        const LeafRay *aLeafRays,
+        Isect         *aoResults,
+        char          *aoOccluded,
+        int,
+        int           aMask) const
+    {
+        for(int j=0; j<kPacketSize; j++)
+        {
+            if(!(aMask & (1 << j)))
+                continue;
+
+            if(!aoOccluded[j] && IntersectLeafP(aLeaf, aRays[j], aLeafRays[j], aoResults[j]))
+                aoOccluded[j] = 1;
+        }
+    }
+
+private:
+
+    // Blocks in use, point to the storage below or into mCache
+    const Triangle4        *mBlocks;
+    int                    mBlockCount;
+    int                    mTriangleCount;
+
+    std::vector<Triangle4> mBlockStorage;
+    MappedFile             mCache;
+};
+
+#endif //__MESH_HXX__
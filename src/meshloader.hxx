@@ -0,0 +1,654 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __MESHLOADER_HXX__
+#define __MESHLOADER_HXX__
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "math.hxx"
+#include "mesh.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Loading of triangle meshes from Wavefront OBJ and Stanford PLY files.
+// Only positions and faces are read, polygons are triangulated as fans.
+// Meshes are assumed to be Y-up, as most are, and are turned Z-up to
+// match the scenes.
+
+class MeshLoader
+{
+public:
+
+    // Loads mesh, scaled uniformly to fit into the box and placed at
+    // its bottom center, with all triangles of material aMatID. Uses
+    // cache file aMeshFile + ".cache" when it is up to date, otherwise
+    // parses the mesh and writes the cache for the next run.
+    // Returns NULL, with a message, on failure.
+    static TriangleMesh* Load(
+        const std::string &aMeshFile,
+        const Vec3f       &aFitMin,
+        const Vec3f       &aFitMax,
+        int               aMatID)
+    {
+        MeshCacheKey key;
+        memset(&key, 0, sizeof(key));
+
+        struct stat st;
+        if(stat(aMeshFile.c_str(), &st) != 0)
+        {
+            printf("Could not open mesh %s\n", aMeshFile.c_str());
+            return NULL;
+        }
+
+        key.mSourceSize = (long long)st.st_size;
+        key.mSourceTime = (long long)st.st_mtime;
+        for(int i=0; i<3; i++)
+        {
+            key.mFitMin[i] = aFitMin.Get(i);
+            key.mFitMax[i] = aFitMax.Get(i);
+        }
+        key.mMatID = aMatID;
+
+        const std::string cacheFile = aMeshFile + ".cache";
+
+        TriangleMesh *mesh = new TriangleMesh;
+        if(mesh->LoadCache(cacheFile.c_str(), key))
+            return mesh;
+
+        std::vector<Vec3f> vertices;
+        std::vector<Vec3i> triangles;
+        std::string        error;
+
+        if(!LoadFile(aMeshFile, vertices, triangles, error))
+        {
+            printf("Could not load mesh %s: %s\n", aMeshFile.c_str(), error.c_str());
+            delete mesh;
+            return NULL;
+        }
+
+        Fit(vertices, aFitMin, aFitMax);
+
+        const std::vector<int> matIDs(triangles.size(), aMatID);
+        mesh->Setup(vertices, triangles, matIDs);
+
+        if(!mesh->SaveCache(cacheFile.c_str(), key))
+            printf("Could not write mesh cache %s\n", cacheFile.c_str());
+
+        return mesh;
+    }
+
+    // Parses OBJ or PLY file, by extension, outputs the triangles
+    static bool LoadFile(
+        const std::string  &aFilename,
+        std::vector<Vec3f> &oVertices,
+        std::vector<Vec3i> &oTriangles,
+        std::string        &oError)
+    {
+        oVertices.clear();
+        oTriangles.clear();
+
+        std::string ext = aFilename.substr(std::min(aFilename.size(),
+            aFilename.find_last_of('.')));
+        for(size_t i=0; i<ext.size(); i++)
+            ext[i] = char(tolower(ext[i]));
+
+        if(ext != ".obj" && ext != ".ply")
+        {
+            oError = "unknown format, expected .obj or .ply";
+            return false;
+        }
+
+        std::vector<char> data;
+        if(!ReadFile(aFilename, data))
+        {
+            oError = "cannot read file";
+            return false;
+        }
+
+        const bool ok = (ext == ".obj") ?
+            ParseObj(data, oVertices, oTriangles, oError) :
+            ParsePly(data, oVertices, oTriangles, oError);
+
+        if(ok && oTriangles.empty())
+        {
+            oError = "no triangles";
+            return false;
+        }
+
+        return ok;
+    }
+
+private:
+
+    static bool ReadFile(
+        const std::string &aFilename,
+        std::vector<char> &oData)
+    {
+        MappedFile file;
+        if(!file.Open(aFilename.c_str()))
+            return false;
+
+        // Terminated, so parsing can run over the end safely
+        oData.assign(file.GetData(), file.GetData() + file.GetSize());
+        oData.push_back('\0');
+        return true;
+    }
+
+    // Turns Y-up to Z-up, facing the camera, and fits into the box
+    static void Fit(
+        std::vector<Vec3f> &aoVertices,
+        const Vec3f        &aFitMin,
+        const Vec3f        &aFitMax)
+    {
+        Vec3f bboxMin( 1e36f);
+        Vec3f bboxMax(-1e36f);
+
+        for(size_t i=0; i<aoVertices.size(); i++)
+        {
+            const Vec3f p = aoVertices[i];
+            aoVertices[i] = Vec3f(p.x, -p.z, p.y);
+
+            for(int j=0; j<3; j++)
+            {
+                bboxMin.Get(j) = std::min(bboxMin.Get(j), aoVertices[i].Get(j));
+                bboxMax.Get(j) = std::max(bboxMax.Get(j), aoVertices[i].Get(j));
+            }
+        }
+
+        const Vec3f size    = bboxMax - bboxMin;
+        const Vec3f fitSize = aFitMax - aFitMin;
+
+        float scale = 1e36f;
+        for(int j=0; j<3; j++)
+        {
+            if(size.Get(j) > 0.f)
+                scale = std::min(scale, fitSize.Get(j) / size.Get(j));
+        }
+        if(scale == 1e36f)
+            scale = 1.f;
+
+        // Centered in x and y, standing on the bottom of the box
+        const Vec3f from((bboxMin.x + bboxMax.x) * 0.5f,
+            (bboxMin.y + bboxMax.y) * 0.5f, bboxMin.z);
+        const Vec3f to((aFitMin.x + aFitMax.x) * 0.5f,
+            (aFitMin.y + aFitMax.y) * 0.5f, aFitMin.z);
+
+        for(size_t i=0; i<aoVertices.size(); i++)
+            aoVertices[i] = (aoVertices[i] - from) * scale + to;
+    }
+
+    // Adds polygon as triangle fan, skips degenerate ones
+    static void AddPolygon(
+        const std::vector<int> &aPolygon,
+        std::vector<Vec3i>     &aoTriangles)
+    {
+        for(size_t i=2; i<aPolygon.size(); i++)
+        {
+            const Vec3i tri(aPolygon[0], aPolygon[i-1], aPolygon[i]);
+            if(tri.x != tri.y && tri.y != tri.z && tri.z != tri.x)
+                aoTriangles.push_back(tri);
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // OBJ, reads "v x y z" and "f v1 v2 v3 ..." lines, where vertices can
+    // be given as v, v/vt, v//vn or v/vt/vn, and negative indices count
+    // from the last vertex. Everything else is ignored.
+
+    static bool ParseObj(
+        const std::vector<char> &aData,
+        std::vector<Vec3f>      &oVertices,
+        std::vector<Vec3i>      &oTriangles,
+        std::string             &oError)
+    {
+        const char *ptr = &aData[0];
+        std::vector<int> polygon;
+        int line = 0;
+
+        while(*ptr)
+        {
+            line++;
+            const char *next = ptr;
+            while(*next && *next != '\n')
+                next++;
+
+            SkipSpaces(ptr);
+
+            if(ptr[0] == 'v' && IsSpace(ptr[1]))
+            {
+                char *end;
+                Vec3f p;
+                ptr++;
+                for(int j=0; j<3; j++)
+                {
+                    p.Get(j) = strtof(ptr, &end);
+                    if(end == ptr || end > next)
+                        return ObjError(line, oError);
+                    ptr = end;
+                }
+                oVertices.push_back(p);
+            }
+            else if(ptr[0] == 'f' && IsSpace(ptr[1]))
+            {
+                ptr++;
+                polygon.clear();
+
+                for(;;)
+                {
+                    SkipSpaces(ptr);
+                    if(ptr >= next || *ptr == '\r')
+                        break;
+
+                    char *end;
+                    long idx = strtol(ptr, &end, 10);
+                    if(end == ptr)
+                        return ObjError(line, oError);
+
+                    // Relative index, -1 is the last vertex
+                    if(idx < 0)
+                        idx += (long)oVertices.size() + 1;
+
+                    if(idx < 1 || idx > (long)oVertices.size())
+                        return ObjError(line, oError);
+
+                    polygon.push_back(int(idx - 1));
+
+                    // Skips texture coordinate and normal indices
+                    ptr = end;
+                    while(ptr < next && !IsSpace(*ptr))
+                        ptr++;
+                }
+
+                AddPolygon(polygon, oTriangles);
+            }
+
+            ptr = *next ? next + 1 : next;
+        }
+
+        return true;
+    }
+
+    static bool ObjError(
+        int         aLine,
+        std::string &oError)
+    {
+        char buffer[64];
+        sprintf(buffer, "invalid line %d", aLine);
+        oError = buffer;
+        return false;
+    }
+
+    static bool IsSpace(char aChar)
+    {
+        return aChar == ' ' || aChar == '\t';
+    }
+
+    static void SkipSpaces(const char *&aoPtr)
+    {
+        while(IsSpace(*aoPtr))
+            aoPtr++;
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // PLY, in ascii, binary_little_endian or binary_big_endian format.
+    // Reads x, y, z of the vertex element and the vertex_indices (or
+    // vertex_index) list of the face element, other elements and
+    // properties are skipped.
+
+    enum PlyFormat
+    {
+        kPlyAscii,
+        kPlyLittleEndian,
+        kPlyBigEndian
+    };
+
+    struct PlyProperty
+    {
+        std::string mName;
+        int         mType;      // Size in bytes, negative for floats,
+        bool        mSigned;    // see GetPlyType
+        bool        mList;
+        int         mCountType; // For lists
+        bool        mCountSigned;
+    };
+
+    struct PlyElement
+    {
+        std::string              mName;
+        int                      mCount;
+        std::vector<PlyProperty> mProperties;
+    };
+
+    // Size of type in bytes, negative for floating point, 0 when unknown
+    static int GetPlyType(
+        const std::string &aName,
+        bool              &oSigned)
+    {
+        oSigned = true;
+        if(aName == "char"   || aName == "int8")    return 1;
+        if(aName == "short"  || aName == "int16")   return 2;
+        if(aName == "int"    || aName == "int32")   return 4;
+        if(aName == "float"  || aName == "float32") return -4;
+        if(aName == "double" || aName == "float64") return -8;
+        oSigned = false;
+        if(aName == "uchar"  || aName == "uint8")   return 1;
+        if(aName == "ushort" || aName == "uint16")  return 2;
+        if(aName == "uint"   || aName == "uint32")  return 4;
+        return 0;
+    }
+
+    // Reads one value of given type, false when the data ended
+    static bool ReadPlyValue(
+        const char *&aoPtr,
+        const char *aEnd,
+        PlyFormat  aFormat,
+        int        aType,
+        bool       aSigned,
+        double     &oValue)
+    {
+        if(aFormat == kPlyAscii)
+        {
+            while(aoPtr < aEnd && isspace((unsigned char)*aoPtr))
+                aoPtr++;
+
+            char *end;
+            oValue = strtod(aoPtr, &end);
+            if(end == aoPtr)
+                return false;
+            aoPtr = end;
+            return true;
+        }
+
+        const int size = aType < 0 ? -aType : aType;
+        if(aEnd - aoPtr < size)
+            return false;
+
+        unsigned char bytes[8];
+        memcpy(bytes, aoPtr, size);
+        aoPtr += size;
+
+        // Byte order of this machine
+        const int one = 1;
+        const bool littleEndian = *(const char*)&one == 1;
+        if(littleEndian != (aFormat == kPlyLittleEndian))
+            std::reverse(bytes, bytes + size);
+
+        switch(aType)
+        {
+        case -4: { float  v; memcpy(&v, bytes, 4); oValue = v; break; }
+        case -8: { double v; memcpy(&v, bytes, 8); oValue = v; break; }
+        case 1:  oValue = aSigned ? double(*(const signed char*)bytes) : double(bytes[0]); break;
+        case 2:
+            {
+                unsigned short v; memcpy(&v, bytes, 2);
+                oValue = aSigned ? double(short(v)) : double(v);
+                break;
+            }
+        default:
+            {
+                unsigned int v; memcpy(&v, bytes, 4);
+                oValue = aSigned ? double(int(v)) : double(v);
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    static bool ParsePly(
+        const std::vector<char> &aData,
+        std::vector<Vec3f>      &oVertices,
+        std::vector<Vec3i>      &oTriangles,
+        std::string             &oError)
+    {
+        const char *ptr = &aData[0];
+        const char *end = ptr + aData.size() - 1; // without terminator
+
+        // Header, one keyword line after another
+        std::vector<PlyElement> elements;
+        PlyFormat format = kPlyAscii;
+        bool hasFormat = false;
+        bool first     = true;
+
+        for(;;)
+        {
+            const char *next = ptr;
+            while(next < end && *next != '\n')
+                next++;
+            if(next == end)
+            {
+                oError = "header not terminated";
+                return false;
+            }
+
+            std::string line(ptr, next);
+            if(!line.empty() && line[line.size() - 1] == '\r')
+                line.erase(line.size() - 1);
+            ptr = next + 1;
+
+            std::vector<std::string> tokens;
+            SplitTokens(line, tokens);
+
+            if(first)
+            {
+                if(tokens.size() != 1 || tokens[0] != "ply")
+                {
+                    oError = "not a PLY file";
+                    return false;
+                }
+                first = false;
+                continue;
+            }
+
+            if(tokens.empty() || tokens[0] == "comment" || tokens[0] == "obj_info")
+                continue;
+
+            if(tokens[0] == "end_header")
+                break;
+
+            if(tokens[0] == "format" && tokens.size() >= 2)
+            {
+                if(tokens[1] == "ascii")                     format = kPlyAscii;
+                else if(tokens[1] == "binary_little_endian") format = kPlyLittleEndian;
+                else if(tokens[1] == "binary_big_endian")    format = kPlyBigEndian;
+                else
+                {
+                    oError = "unknown format " + tokens[1];
+                    return false;
+                }
+                hasFormat = true;
+            }
+            else if(tokens[0] == "element" && tokens.size() == 3)
+            {
+                PlyElement element;
+                element.mName  = tokens[1];
+                element.mCount = atoi(tokens[2].c_str());
+                if(element.mCount < 0)
+                {
+                    oError = "invalid element count";
+                    return false;
+                }
+                elements.push_back(element);
+            }
+            else if(tokens[0] == "property" && !elements.empty())
+            {
+                PlyProperty prop;
+                prop.mList        = tokens.size() == 5 && tokens[1] == "list";
+                prop.mCountType   = 0;
+                prop.mCountSigned = false;
+
+                if(prop.mList)
+                {
+                    prop.mCountType = GetPlyType(tokens[2], prop.mCountSigned);
+                    prop.mType      = GetPlyType(tokens[3], prop.mSigned);
+                    prop.mName      = tokens[4];
+                }
+                else if(tokens.size() == 3)
+                {
+                    prop.mType = GetPlyType(tokens[1], prop.mSigned);
+                    prop.mName = tokens[2];
+                }
+                else
+                    prop.mType = 0;
+
+                if(prop.mType == 0 || (prop.mList && prop.mCountType <= 0))
+                {
+                    oError = "invalid property: " + line;
+                    return false;
+                }
+                elements.back().mProperties.push_back(prop);
+            }
+            else
+            {
+                oError = "invalid header line: " + line;
+                return false;
+            }
+        }
+
+        if(!hasFormat)
+        {
+            oError = "missing format";
+            return false;
+        }
+
+        // Body, elements in the order of the header
+        std::vector<int> polygon;
+
+        for(size_t e=0; e<elements.size(); e++)
+        {
+            const PlyElement &element = elements[e];
+            const bool isVertex = element.mName == "vertex";
+            const bool isFace   = element.mName == "face";
+
+            // Position of x, y, z in vertex properties
+            int coordIdx[3] = { -1, -1, -1 };
+            if(isVertex)
+            {
+                for(int p=0; p<(int)element.mProperties.size(); p++)
+                {
+                    const std::string &name = element.mProperties[p].mName;
+                    if(name == "x") coordIdx[0] = p;
+                    if(name == "y") coordIdx[1] = p;
+                    if(name == "z") coordIdx[2] = p;
+                }
+                if(coordIdx[0] < 0 || coordIdx[1] < 0 || coordIdx[2] < 0)
+                {
+                    oError = "vertex without x, y, z";
+                    return false;
+                }
+                // Each vertex takes at least a byte, so a bogus count in the
+                // header can not reserve more than the file could hold
+                oVertices.reserve(std::min(element.mCount, int(end - ptr)));
+            }
+
+            for(int i=0; i<element.mCount; i++)
+            {
+                Vec3f p(0.f);
+
+                for(int k=0; k<(int)element.mProperties.size(); k++)
+                {
+                    const PlyProperty &prop = element.mProperties[k];
+                    double value;
+
+                    if(!prop.mList)
+                    {
+                        if(!ReadPlyValue(ptr, end, format, prop.mType, prop.mSigned, value))
+                            return PlyTruncated(oError);
+
+                        for(int j=0; j<3; j++)
+                            if(isVertex && coordIdx[j] == k) p.Get(j) = float(value);
+                        continue;
+                    }
+
+                    double count;
+                    if(!ReadPlyValue(ptr, end, format, prop.mCountType, prop.mCountSigned, count))
+                        return PlyTruncated(oError);
+
+                    const bool indices = isFace &&
+                        (prop.mName == "vertex_indices" || prop.mName == "vertex_index");
+                    polygon.clear();
+
+                    for(int j=0; j<int(count); j++)
+                    {
+                        if(!ReadPlyValue(ptr, end, format, prop.mType, prop.mSigned, value))
+                            return PlyTruncated(oError);
+                        polygon.push_back(int(value));
+                    }
+
+                    if(!indices)
+                        continue;
+
+                    // Vertices precede faces in any sensible file
+                    for(size_t j=0; j<polygon.size(); j++)
+                    {
+                        if(polygon[j] < 0 || polygon[j] >= (int)oVertices.size())
+                        {
+                            oError = "face references missing vertex";
+                            return false;
+                        }
+                    }
+
+                    AddPolygon(polygon, oTriangles);
+                }
+
+                if(isVertex)
+                    oVertices.push_back(p);
+            }
+        }
+
+        return true;
+    }
+
+    static bool PlyTruncated(std::string &oError)
+    {
+        oError = "data ended early";
+        return false;
+    }
+
+    static void SplitTokens(
+        const std::string        &aLine,
+        std::vector<std::string> &oTokens)
+    {
+        size_t i = 0;
+        while(i < aLine.size())
+        {
+            while(i < aLine.size() && isspace((unsigned char)aLine[i]))
+                i++;
+            const size_t start = i;
+            while(i < aLine.size() && !isspace((unsigned char)aLine[i]))
+                i++;
+            if(i > start)
+                oTokens.push_back(aLine.substr(start, i - start));
+        }
+    }
+};
+
+#endif //__MESHLOADER_HXX__
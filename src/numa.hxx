@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __NUMA_HXX__
+#define __NUMA_HXX__
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <stdio.h>
+
+#if defined(__linux__)
+#define NUMA_AFFINITY
+#include <sched.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// NUMA placement (--numa). Threads are pinned to the CPUs the process
+// may run on, filling one NUMA node after another, so a render that
+// fits a socket stays on it. Memory is placed by first touch, i.e., on
+// the node of the thread that writes a page first, which is why
+// render() has each pinned thread create its own renderer, and the
+// first thread of each further node load a replica of the scene.
+//
+// Nodes and their CPUs come from Linux sysfs, other platforms (and
+// machines without the information) are treated as one node where
+// threads are not pinned.
+class NumaTopology
+{
+public:
+
+    NumaTopology()
+    {
+        Detect();
+    }
+
+    int GetNodeCount() const { return mNodeCount; }
+
+    // CPU for thread aThreadId, or -1 when threads are not pinned.
+    // More threads than CPUs wrap around
+    int GetThreadCpu(const int aThreadId) const
+    {
+        if(mCpus.empty())
+            return -1;
+        return mCpus[aThreadId % mCpus.size()];
+    }
+
+    // Node of thread aThreadId, in [0, GetNodeCount())
+    int GetThreadNode(const int aThreadId) const
+    {
+        if(mCpus.empty())
+            return 0;
+        return mCpuNodes[aThreadId % mCpus.size()];
+    }
+
+    // Lowest of the first aNumThreads threads on node aNode, or -1
+    int GetFirstThread(const int aNode, const int aNumThreads) const
+    {
+        for(int i=0; i<aNumThreads; i++)
+        {
+            if(GetThreadNode(i) == aNode)
+                return i;
+        }
+        return -1;
+    }
+
+    // Binds the calling thread to aCpu, false when it cannot be done
+    static bool PinCurrentThread(const int aCpu)
+    {
+#if defined(NUMA_AFFINITY)
+        if(aCpu < 0 || aCpu >= CPU_SETSIZE)
+            return false;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(aCpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+
+private:
+
+    void Detect()
+    {
+        mNodeCount = 1;
+        mCpus.clear();
+        mCpuNodes.clear();
+
+#if defined(NUMA_AFFINITY)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return;
+
+        std::vector<bool> assigned(CPU_SETSIZE, false);
+        int node = 0;
+
+        // Nodes may be numbered with gaps, those without allowed CPUs
+        // are skipped, so our node indices stay dense
+        for(int sysNode=0; sysNode<1024; sysNode++)
+        {
+            char name[96];
+            sprintf(name, "/sys/devices/system/node/node%d/cpulist", sysNode);
+
+            std::ifstream file(name);
+            if(!file)
+                continue;
+
+            std::string list;
+            std::getline(file, list);
+
+            const size_t before = mCpus.size();
+            AddCpuList(list, allowed, node, assigned);
+
+            if(mCpus.size() > before)
+                node++;
+        }
+
+        // Allowed CPUs not listed in any node make up one more
+        bool extra = false;
+        for(int cpu=0; cpu<CPU_SETSIZE; cpu++)
+        {
+            if(CPU_ISSET(cpu, &allowed) && !assigned[cpu])
+            {
+                mCpus.push_back(cpu);
+                mCpuNodes.push_back(node);
+                extra = true;
+            }
+        }
+
+        mNodeCount = std::max(1, extra ? node + 1 : node);
+#endif
+    }
+
+#if defined(NUMA_AFFINITY)
+    // Adds allowed CPUs of sysfs list like "0-3,8-11" to node aNode
+    void AddCpuList(
+        const std::string &aList,
+        const cpu_set_t   &aAllowed,
+        const int         aNode,
+        std::vector<bool> &aoAssigned)
+    {
+        const char *str = aList.c_str();
+
+        while(*str)
+        {
+            int first, last, length;
+            if(sscanf(str, "%d%n", &first, &length) != 1)
+                break;
+            str += length;
+
+            last = first;
+            if(*str == '-')
+            {
+                if(sscanf(str + 1, "%d%n", &last, &length) != 1)
+                    break;
+                str += 1 + length;
+            }
+
+            for(int cpu=first; cpu<=last && cpu<CPU_SETSIZE; cpu++)
+            {
+                if(cpu >= 0 && CPU_ISSET(cpu, &aAllowed) && !aoAssigned[cpu])
+                {
+                    mCpus.push_back(cpu);
+                    mCpuNodes.push_back(aNode);
+                    aoAssigned[cpu] = true;
+                }
+            }
+
+            if(*str != ',')
+                break;
+            str++;
+        }
+    }
+#endif
+
+    std::vector<int> mCpus;     // allowed CPUs, node after node
+    std::vector<int> mCpuNodes; // node of each of mCpus
+    int              mNodeCount;
+};
+
+#endif //__NUMA_HXX__
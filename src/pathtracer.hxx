@@ -39,183 +39,399 @@ public:
         const Scene& aScene,
         int aSeed = 1234
     ) :
-        AbstractRenderer(aScene), mRng(aSeed)
+        AbstractRenderer(aScene, aSeed), mCurrentIteration(0)
     {}
 
     virtual void RunIteration(int aIteration)
     {
-        // We sample lights uniformly
-        const int   lightCount    = mScene.GetLightCount();
-        const float lightPickProb = 1.f / lightCount;
-
         const int resX = int(mScene.mCamera.mResolution.x);
         const int resY = int(mScene.mCamera.mResolution.y);
 
-        for(int pixID = 0; pixID < resX * resY; pixID++)
+        mCurrentIteration = aIteration;
+        RenderPixels(0, resX * resY);
+
+        CountIteration();
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Cooperative rendering interface, see AbstractRenderer
+    //////////////////////////////////////////////////////////////////////////
+
+    virtual bool SupportsCooperative() const { return true; }
+
+    virtual void BeginIteration(int aIteration)
+    {
+        mCurrentIteration = aIteration;
+    }
+
+    virtual int GetCameraPathCount() const
+    {
+        return int(mScene.mCamera.mResolution.x * mScene.mCamera.mResolution.y);
+    }
+
+    virtual void RunCameraPaths(int aBegin, int aEnd)
+    {
+        RenderPixels(aBegin, aEnd);
+    }
+
+    virtual void RunCameraTile(const Vec2i &aTileMin, const Vec2i &aTileMax)
+    {
+        if(!mWavefront)
         {
-            const int x = pixID % resX;
-            const int y = pixID / resX;
+            AbstractRenderer::RunCameraTile(aTileMin, aTileMax);
+            return;
+        }
+
+        // Whole tile is one wave
+        GetTilePixels(aTileMin, aTileMax, mWave.mPixels);
+        RenderPixelsWavefront();
+    }
+
+private:
 
-            const Vec2f sample = Vec2f(float(x), float(y)) + mRng.GetVec2f();
+    // Maximal number of paths traced together in wavefront mode
+    enum { kWavefrontSize = 4096 };
 
-            Ray   ray = mScene.mCamera.GenerateRay(sample);
-            Isect isect;
-            isect.dist = 1e36f;
+    // State of a path between two bounces
+    struct PathState
+    {
+        Ray   mRay;          // Ray of the next segment
+        Vec3f mPathWeight;   // Throughput divided by the sampling pdf
+        uint  mPathLength;   // Number of path segments, incl. the next one
+        bool  mLastSpecular; // Whether last scattering was specular
+        float mLastPdfW;     // Pdf of last scattering, for MIS
+        uint  mDimension;    // Where its samples continue, see AbstractSampler
+    };
+
+    // Paths traced together in wavefront mode. States are indexed by path
+    // within wave, rays and hits by position of the path in mActive.
+    struct Wavefront
+    {
+        std::vector<int>       mPixels;     // Pixels of all paths to trace
+        std::vector<PathState> mStates;
+        std::vector<Vec2f>     mSamples;
+        std::vector<Vec3f>     mColors;
+        std::vector<Ray>       mRays;
+        std::vector<Isect>     mIsects;
+        std::vector<char>      mHits;
+
+        std::vector<int>       mActive;     // Paths not yet terminated
+        std::vector<int>       mNextActive;
+        std::vector<int>       mBinned;     // mActive positions binned by material
+        std::vector<int>       mKeys;       // Bin of each active path
+        std::vector<int>       mBinStarts;
+
+        void Resize(int aPathCount)
+        {
+            mStates.resize(aPathCount);
+            mRays.resize(aPathCount);
+            mIsects.resize(aPathCount);
+            mHits.resize(aPathCount);
+            mSamples.resize(aPathCount);
+            mColors.resize(aPathCount);
+            mActive.resize(aPathCount);
+        }
+    };
+
+    // Traces one path for each pixel in [aPixelBegin, aPixelEnd)
+    void RenderPixels(
+        const int aPixelBegin,
+        const int aPixelEnd)
+    {
+        if(mWavefront)
+        {
+            mWave.mPixels.resize(aPixelEnd - aPixelBegin);
 
-            Vec3f pathWeight(1.f);
+            for(int pixID = aPixelBegin; pixID < aPixelEnd; pixID++)
+                mWave.mPixels[pixID - aPixelBegin] = pixID;
+
+            RenderPixelsWavefront();
+            return;
+        }
+
+        PhaseTimer timer(mStats, RenderStats::kCameraTracing);
+
+        for(int pixID = aPixelBegin; pixID < aPixelEnd; pixID++)
+        {
+            if(!NeedsCameraPath(pixID))
+                continue;
+
+            PathState state;
+            const Vec2f sample = GeneratePath(pixID, state);
             Vec3f color(0.f);
-            uint  pathLength   = 1;
-            bool  lastSpecular = true;
-            float lastPdfW     = 1;
 
-            for(;; ++pathLength)
+            for(;;)
             {
-                if(!mScene.Intersect(ray, isect))
+                Isect isect(1e36f);
+
+                mStats.mRays++;
+                if(!mScene.Intersect(state.mRay, isect))
                 {
-                    if(pathLength < mMinPathLength)
-                        break;
-
-                    const BackgroundLight* background = mScene.GetBackground();
-                    if(!background)
-                        break;
-                    // For background we cheat with the A/W suffixes,
-                    // and GetRadiance actually returns W instead of A
-                    float directPdfW;
-                    Vec3f contrib = background->GetRadiance(mScene.mSceneSphere,
-                        ray.dir, Vec3f(0), &directPdfW);
-                    if(contrib.IsZero())
-                        break;
-
-                    float misWeight = 1.f;
-                    if(pathLength > 1 && !lastSpecular)
-                    {
-                        misWeight = Mis2(lastPdfW, directPdfW * lightPickProb);
-                    }
+                    ShadeMiss(state, color);
+                    break;
+                }
 
-                    color += pathWeight * misWeight * contrib;
+                if(!ShadeHit(state, isect, color))
                     break;
+            }
+            AddColor(pixID, sample, color);
+        }
+    }
+
+    // Wavefront version of RenderPixels, traces paths for pixels in
+    // mWave.mPixels, in waves of kWavefrontSize
+    void RenderPixelsWavefront()
+    {
+        PhaseTimer timer(mStats, RenderStats::kCameraTracing);
+
+        Wavefront &wave = mWave;
+        RemoveConvergedPixels(wave.mPixels);
+        const int totalCount = (int)wave.mPixels.size();
+
+        for(int waveBegin = 0; waveBegin < totalCount; waveBegin += kWavefrontSize)
+        {
+            const int pathCount = std::min(int(kWavefrontSize), totalCount - waveBegin);
+
+            wave.Resize(pathCount);
+
+            for(int i=0; i<pathCount; i++)
+            {
+                wave.mSamples[i] = GeneratePath(wave.mPixels[waveBegin + i], wave.mStates[i]);
+                wave.mColors[i]  = Vec3f(0.f);
+                wave.mActive[i]  = i;
+            }
+
+            while(!wave.mActive.empty())
+            {
+                // Intersect all active paths together, and bin them by material
+                const int activeCount = (int)wave.mActive.size();
+                wave.mKeys.resize(activeCount);
+
+                for(int j=0; j<activeCount; j++)
+                {
+                    wave.mRays[j]   = wave.mStates[wave.mActive[j]].mRay;
+                    wave.mIsects[j] = Isect(1e36f);
                 }
 
-                Vec3f hitPoint = ray.org + ray.dir * isect.dist;
-                isect.dist += EPS_RAY;
+                mScene.IntersectN(&wave.mRays[0], &wave.mIsects[0],
+                    &wave.mHits[0], activeCount);
+                mStats.mRays += activeCount;
 
-                BSDF<false> bsdf(ray, isect, mScene);
-                if(!bsdf.IsValid())
-                    break;
+                for(int j=0; j<activeCount; j++)
+                    wave.mKeys[j] = wave.mHits[j] ? wave.mIsects[j].matID + 1 : 0;
+
+                BinByKey(wave.mKeys, mScene.GetMaterialCount() + 1,
+                    wave.mBinned, wave.mBinStarts);
 
-                // directly hit some light, lights do not reflect
-                if(isect.lightID >= 0)
+                // Shade bin by bin, and compact terminated paths away
+                wave.mNextActive.clear();
+                for(int k=0; k<activeCount; k++)
                 {
-                    if(pathLength < mMinPathLength)
-                        break;
-
-                    const AbstractLight *light = mScene.GetLightPtr(isect.lightID);
-                    float directPdfA;
-                    Vec3f contrib = light->GetRadiance(mScene.mSceneSphere,
-                        ray.dir, hitPoint, &directPdfA);
-                    if(contrib.IsZero())
-                        break;
-
-                    float misWeight = 1.f;
-                    if(pathLength > 1 && !lastSpecular)
+                    const int j = wave.mBinned[k];
+                    const int i = wave.mActive[j];
+
+                    if(!wave.mHits[j])
                     {
-                        const float directPdfW = PdfAtoW(directPdfA, isect.dist,
-                            bsdf.CosThetaFix());
-                        misWeight = Mis2(lastPdfW, directPdfW * lightPickProb);
+                        ShadeMiss(wave.mStates[i], wave.mColors[i]);
+                        continue;
                     }
 
-                    color += pathWeight * misWeight * contrib;
-                    break;
+                    PathState &state = wave.mStates[i];
+                    mSampler->StartPath(Rng::kCameraStream, wave.mPixels[waveBegin + i],
+                        mCurrentIteration, state.mDimension);
+
+                    const bool active = ShadeHit(state, wave.mIsects[j], wave.mColors[i]);
+                    state.mDimension = mSampler->GetDimension();
+
+                    if(active)
+                        wave.mNextActive.push_back(i);
                 }
 
-                if(pathLength >= mMaxPathLength)
-                    break;
+                wave.mActive.swap(wave.mNextActive);
+            }
 
-                if(bsdf.ContinuationProb() == 0)
-                    break;
+            for(int i=0; i<pathCount; i++)
+                AddColor(wave.mPixels[waveBegin + i], wave.mSamples[i], wave.mColors[i]);
+        }
+    }
+
+    // Generates primary ray through pixel aPixID, returns the screen sample
+    Vec2f GeneratePath(
+        const int aPixID,
+        PathState &oState)
+    {
+        const int resX = int(mScene.mCamera.mResolution.x);
+        const int x = aPixID % resX;
+        const int y = aPixID / resX;
+
+        mSampler->StartPath(Rng::kCameraStream, aPixID, mCurrentIteration);
+        const Vec2f sample = Vec2f(float(x), float(y)) + mSampler->Get2D();
+
+        oState.mRay          = mScene.mCamera.GenerateRay(sample);
+        oState.mPathWeight   = Vec3f(1.f);
+        oState.mPathLength   = 1;
+        oState.mLastSpecular = true;
+        oState.mLastPdfW     = 1;
+        oState.mDimension    = mSampler->GetDimension();
+
+        return sample;
+    }
+
+    // Adds radiance from environment for path that left the scene
+    void ShadeMiss(
+        const PathState &aState,
+        Vec3f           &aoColor) const
+    {
+        if(aState.mPathLength < mMinPathLength)
+            return;
+
+        const BackgroundLight* background = mScene.GetBackground();
+        if(!background)
+            return;
+
+        const float lightPickProb = mScene.GetLightPickProb(mScene.GetBackgroundID());
+        // For background we cheat with the A/W suffixes,
+        // and GetRadiance actually returns W instead of A
+        float directPdfW;
+        Vec3f contrib = background->GetRadiance(mScene.mSceneSphere,
+            aState.mRay.dir, Vec3f(0), &directPdfW);
+        if(contrib.IsZero())
+            return;
+
+        float misWeight = 1.f;
+        if(aState.mPathLength > 1 && !aState.mLastSpecular)
+        {
+            misWeight = Mis2(aState.mLastPdfW, directPdfW * lightPickProb);
+        }
+
+        aoColor += aState.mPathWeight * misWeight * contrib;
+    }
+
+    // Processes a hit of the path: adds emission and next event estimation,
+    // and samples the next direction. Returns false when the path terminates.
+    bool ShadeHit(
+        PathState &aoState,
+        Isect     &aoIsect,
+        Vec3f     &aoColor)
+    {
+        Vec3f hitPoint = aoState.mRay.org + aoState.mRay.dir * aoIsect.dist;
+        aoIsect.dist += EPS_RAY;
+
+        BSDF<false> bsdf(aoState.mRay, aoIsect, mScene);
+        if(!bsdf.IsValid())
+            return false;
 
-                // next event estimation
-                if(!bsdf.IsDelta() && pathLength + 1 >= mMinPathLength)
+        // directly hit some light, lights do not reflect
+        if(aoIsect.lightID >= 0)
+        {
+            if(aoState.mPathLength < mMinPathLength)
+                return false;
+
+            const AbstractLight *light = mScene.GetLightPtr(aoIsect.lightID);
+            float directPdfA;
+            Vec3f contrib = light->GetRadiance(mScene.mSceneSphere,
+                aoState.mRay.dir, hitPoint, &directPdfA);
+            if(contrib.IsZero())
+                return false;
+
+            float misWeight = 1.f;
+            if(aoState.mPathLength > 1 && !aoState.mLastSpecular)
+            {
+                const float directPdfW = PdfAtoW(directPdfA, aoIsect.dist,
+                    bsdf.CosThetaFix());
+                misWeight = Mis2(aoState.mLastPdfW,
+                    directPdfW * mScene.GetLightPickProb(aoIsect.lightID));
+            }
+
+            aoColor += aoState.mPathWeight * misWeight * contrib;
+            return false;
+        }
+
+        if(aoState.mPathLength >= mMaxPathLength)
+            return false;
+
+        if(bsdf.ContinuationProb() == 0)
+            return false;
+
+        // next event estimation
+        if(!bsdf.IsDelta() && aoState.mPathLength + 1 >= mMinPathLength)
+        {
+            int lightID = mScene.PickLight(mSampler->Get1D());
+            const AbstractLight *light = mScene.GetLightPtr(lightID);
+            const float lightPickProb = mScene.GetLightPickProb(lightID);
+
+            Vec3f directionToLight;
+            float distance, directPdfW;
+            Vec3f radiance = light->Illuminate(mScene.mSceneSphere, hitPoint,
+                mSampler->Get2D(), directionToLight, distance, directPdfW);
+
+            if(!radiance.IsZero())
+            {
+                float bsdfPdfW, cosThetaOut;
+                const Vec3f factor = bsdf.Evaluate(mScene,
+                    directionToLight, cosThetaOut, &bsdfPdfW);
+
+                if(!factor.IsZero())
                 {
-                    int lightID = int(mRng.GetFloat() * lightCount);
-                    const AbstractLight *light = mScene.GetLightPtr(lightID);
+                    float weight = 1.f;
+                    if(!light->IsDelta())
+                    {
+                        const float contProb = bsdf.ContinuationProb();
+                        bsdfPdfW *= contProb;
+                        weight = Mis2(directPdfW * lightPickProb, bsdfPdfW);
+                    }
 
-                    Vec3f directionToLight;
-                    float distance, directPdfW;
-                    Vec3f radiance = light->Illuminate(mScene.mSceneSphere, hitPoint,
-                        mRng.GetVec2f(), directionToLight, distance, directPdfW);
+                    Vec3f contrib = (weight * cosThetaOut / (lightPickProb * directPdfW)) *
+                        (radiance * factor);
 
-                    if(!radiance.IsZero())
+                    mStats.mShadowRays++;
+                    if(!mScene.Occluded(hitPoint, directionToLight, distance))
                     {
-                        float bsdfPdfW, cosThetaOut;
-                        const Vec3f factor = bsdf.Evaluate(mScene,
-                            directionToLight, cosThetaOut, &bsdfPdfW);
-
-                        if(!factor.IsZero())
-                        {
-                            float weight = 1.f;
-                            if(!light->IsDelta())
-                            {
-                                const float contProb = bsdf.ContinuationProb();
-                                bsdfPdfW *= contProb;
-                                weight = Mis2(directPdfW * lightPickProb, bsdfPdfW);
-                            }
-
-                            Vec3f contrib = (weight * cosThetaOut / (lightPickProb * directPdfW)) *
-                                (radiance * factor);
-
-                            if(!mScene.Occluded(hitPoint, directionToLight, distance))
-                            {
-                                color += pathWeight * contrib;
-                            }
-                        }
+                        aoColor += aoState.mPathWeight * contrib;
                     }
                 }
+            }
+        }
 
-                // continue random walk
-                {
-                    Vec3f rndTriplet = mRng.GetVec3f();
-                    float pdf, cosThetaOut;
-                    uint  sampledEvent;
+        // continue random walk
+        {
+            Vec3f rndTriplet = mSampler->Get3D();
+            float pdf, cosThetaOut;
+            uint  sampledEvent;
 
-                    Vec3f factor = bsdf.Sample(mScene, rndTriplet, ray.dir,
-                        pdf, cosThetaOut, &sampledEvent);
+            Vec3f factor = bsdf.Sample(mScene, rndTriplet, aoState.mRay.dir,
+                pdf, cosThetaOut, &sampledEvent);
 
-                    if(factor.IsZero())
-                        break;
+            if(factor.IsZero())
+                return false;
 
-                    // Russian roulette
-                    const float contProb = bsdf.ContinuationProb();
+            // Russian roulette
+            const float contProb = bsdf.ContinuationProb();
 
-                    lastSpecular = (sampledEvent & BSDF<true>::kSpecular) != 0;
-                    lastPdfW     = pdf * contProb;
+            aoState.mLastSpecular = (sampledEvent & BSDF<true>::kSpecular) != 0;
+            aoState.mLastPdfW     = pdf * contProb;
 
-                    if(contProb < 1.f)
-                    {
-                        if(mRng.GetFloat() > contProb)
-                        {
-                            break;
-                        }
-                        pdf *= contProb;
-                    }
-
-                    pathWeight *= factor * (cosThetaOut / pdf);
-                    // We offset ray origin instead of setting tmin due to numeric
-                    // issues in ray-sphere intersection. The isect.dist has to be
-                    // extended by this EPS_RAY after hitpoint is determined
-                    ray.org    = hitPoint + EPS_RAY * ray.dir;
-                    ray.tmin   = 0.f;
-                    isect.dist = 1e36f;
+            if(contProb < 1.f)
+            {
+                if(mSampler->Get1D() > contProb)
+                {
+                    return false;
                 }
+                pdf *= contProb;
             }
-            mFramebuffer.AddColor(sample, color);
+
+            aoState.mPathWeight *= factor * (cosThetaOut / pdf);
+            // We offset ray origin instead of setting tmin due to numeric
+            // issues in ray-sphere intersection. The isect.dist has to be
+            // extended by this EPS_RAY after hitpoint is determined
+            aoState.mRay.org  = hitPoint + EPS_RAY * aoState.mRay.dir;
+            aoState.mRay.tmin = 0.f;
         }
 
-        mIterations++;
+        aoState.mPathLength++;
+        return true;
     }
 
-private:
-
     // Mis power (1 for balance heuristic)
     float Mis(float aPdf) const
     {
@@ -232,7 +448,8 @@ private:
 
 private:
 
-    Rng mRng;
+    int       mCurrentIteration;
+    Wavefront mWave;
 };
 
 #endif //__PATHTRACER_HXX__
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __PREVIEW_HXX__
+#define __PREVIEW_HXX__
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include "math.hxx"
+#if !defined(NO_CXX11_THREADS)
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#endif
+#include "config.hxx"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PREVIEW_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Live preview of a render in progress (--preview). The image is
+// published to a file, which viewers map to show it while rendering
+// goes on. Where mmap is available, the file is mapped shared (put it
+// on /dev/shm for shared memory proper), elsewhere it is rewritten
+// under a temporary name and renamed.
+//
+// The file is a PreviewHeader followed by two images of mResX * mResY
+// RGB bytes, gamma 2.2, rows from top to bottom. Image number k, which
+// is published by setting mSequence to k, is in buffer k & 1, so the
+// next one is written to the other buffer. A viewer reads mSequence,
+// copies the buffer, and keeps the copy when mSequence has not changed
+// meanwhile.
+struct PreviewHeader
+{
+    enum { kVersion = 1 };
+
+    char          mMagic[8];      // "SVCMPREV"
+    uint          mVersion;
+    uint          mResX;
+    uint          mResY;
+    volatile uint mSequence;      // number of published images
+    uint          mIterations[2]; // iterations in each buffer
+};
+
+// Renderers offer their framebuffer after each iteration. Once per
+// preview interval it is copied into the renderer's slot, which is all
+// the render threads pay. A background thread averages the slots the
+// same way render() does at the end, tonemaps, and publishes.
+class PreviewWriter
+{
+public:
+
+    PreviewWriter() :
+        mHeader(NULL),
+        mFileSize(0),
+        mImageSize(0),
+        mGamma(2.2f),
+        mDirty(false),
+        mStop(false)
+    {}
+
+    ~PreviewWriter()
+    {
+        Close();
+    }
+
+    // Creates the preview file, one slot per thread. Returns false, with
+    // a message, on failure
+    bool Open(
+        const Config &aConfig,
+        const bool   aCooperative)
+    {
+        Close();
+
+        const Vec2f resolution = aConfig.mScene->mCamera.mResolution;
+
+        mFilename    = aConfig.mPreviewName;
+        mInterval    = aConfig.mPreviewTime;
+        mCooperative = aCooperative;
+        mImageSize   = 3 * size_t(resolution.x) * size_t(resolution.y);
+        mFileSize    = sizeof(PreviewHeader) + 2 * mImageSize;
+
+#if defined(PREVIEW_MMAP)
+        const int fd = open(mFilename.c_str(), O_RDWR | O_CREAT, 0644);
+        void *data   = MAP_FAILED;
+
+        if(fd >= 0)
+        {
+            if(ftruncate(fd, off_t(mFileSize)) == 0)
+                data = mmap(NULL, mFileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            // The mapping stays valid after the descriptor is closed
+            close(fd);
+        }
+
+        if(data == MAP_FAILED)
+        {
+            printf("Could not map preview %s\n", mFilename.c_str());
+            return false;
+        }
+
+        mHeader = (PreviewHeader*)data;
+#else
+        mSegment.assign(mFileSize, 0);
+        mHeader = (PreviewHeader*)&mSegment[0];
+#endif
+
+        memcpy(mHeader->mMagic, "SVCMPREV", 8);
+        mHeader->mVersion       = PreviewHeader::kVersion;
+        mHeader->mResX          = uint(resolution.x);
+        mHeader->mResY          = uint(resolution.y);
+        mHeader->mSequence      = 0;
+        mHeader->mIterations[0] = 0;
+        mHeader->mIterations[1] = 0;
+
+        mSlots.resize(aConfig.mNumThreads);
+        for(size_t i=0; i<mSlots.size(); i++)
+        {
+            mSlots[i].mIterations = 0;
+            mSlots[i].mTime       = GetWallTime();
+        }
+
+        mImage.Setup(resolution);
+
+#if !defined(NO_CXX11_THREADS)
+        mDirty  = false;
+        mStop   = false;
+        mThread = std::thread(&PreviewWriter::Run, this);
+#endif
+        return true;
+    }
+
+    bool IsOpen() const { return mHeader != NULL; }
+
+    // Called by the thread of renderer aSlot, or by any thread while no
+    // renderer runs. With aForce the snapshot is taken regardless of
+    // the interval, e.g., for the final image
+    void Offer(
+        const int              aSlot,
+        const AbstractRenderer &aRenderer,
+        const bool             aForce = false)
+    {
+        if(!IsOpen())
+            return;
+
+        Slot &slot = mSlots[aSlot];
+
+        const double time = GetWallTime();
+        if(!aForce && time < slot.mTime + mInterval)
+            return;
+
+        slot.mTime = time;
+
+        // Renderers with a shared framebuffer are offered by its owner
+        if(!aRenderer.WasUsed() || !aRenderer.OwnsFramebuffer())
+            return;
+
+#if !defined(NO_CXX11_THREADS)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            slot.mImage      = aRenderer.GetAccumulation();
+            slot.mIterations = aRenderer.GetFramebufferIterations();
+            mDirty = true;
+        }
+        mWake.notify_one();
+#else
+        // No C++11 threads, publish right away
+#pragma omp critical(PreviewOffer)
+        {
+            slot.mImage      = aRenderer.GetAccumulation();
+            slot.mIterations = aRenderer.GetFramebufferIterations();
+            Compose();
+            Publish();
+        }
+#endif
+    }
+
+    // Publishes what is still pending and closes the file
+    void Close()
+    {
+        if(!IsOpen())
+            return;
+
+#if !defined(NO_CXX11_THREADS)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWake.notify_one();
+
+        if(mThread.joinable())
+            mThread.join();
+#endif
+
+#if defined(PREVIEW_MMAP)
+        munmap((void*)mHeader, mFileSize);
+#else
+        std::vector<byte>().swap(mSegment);
+#endif
+        mHeader = NULL;
+        std::vector<Slot>().swap(mSlots);
+    }
+
+private:
+
+    typedef Framebuffer::byte byte;
+
+    struct Slot
+    {
+        Framebuffer mImage;      // accumulation of the renderer
+        int         mIterations; // iterations in mImage, 0 ~ empty
+        double      mTime;       // when mImage was taken, or offered last
+    };
+
+#if !defined(NO_CXX11_THREADS)
+    // Background thread, publishes new snapshots at most once per interval
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+
+        for(;;)
+        {
+            while(!mDirty && !mStop)
+                mWake.wait(lock);
+
+            if(!mDirty)
+                break;
+
+            Compose();
+
+            lock.unlock();
+            Publish();
+            lock.lock();
+
+            if(!mStop)
+                mWake.wait_for(lock, std::chrono::duration<double>(mInterval));
+        }
+    }
+#endif
+
+    // Average of the slots into mImage, with the lock held
+    void Compose()
+    {
+        mImage.Clear();
+
+        int usedSlots = 0;
+        mImageIterations = 0;
+
+        for(size_t i=0; i<mSlots.size(); i++)
+        {
+            const Slot &slot = mSlots[i];
+            if(slot.mIterations == 0)
+                continue;
+
+            mImage.AddScaledSerial(slot.mImage, 1.f / slot.mIterations);
+            usedSlots++;
+
+            // Cooperating renderers all ran every iteration
+            if(mCooperative)
+                mImageIterations = uint(slot.mIterations);
+            else
+                mImageIterations += uint(slot.mIterations);
+        }
+
+        mImageScale = (mCooperative || usedSlots == 0) ? 1.f : 1.f / usedSlots;
+        mDirty = false;
+    }
+
+    // Tonemaps mImage into the back buffer and flips the buffers
+    void Publish()
+    {
+        const uint sequence = mHeader->mSequence + 1;
+        byte *pixels = (byte*)(mHeader + 1) + (sequence & 1) * mImageSize;
+
+        mImage.GetBytesSerial(pixels, mImageScale, mGamma);
+        mHeader->mIterations[sequence & 1] = mImageIterations;
+
+        // Pixels have to be visible before the new number is
+#if !defined(NO_CXX11_THREADS)
+        std::atomic_thread_fence(std::memory_order_release);
+#else
+#pragma omp flush
+#endif
+        mHeader->mSequence = sequence;
+
+#if !defined(PREVIEW_MMAP)
+        const std::string tmpName = mFilename + ".tmp";
+        {
+            std::ofstream file(tmpName.c_str(), std::ios::binary);
+            file.write((const char*)&mSegment[0], mSegment.size());
+
+            if(file.fail())
+                return;
+        }
+#if defined(_WIN32)
+        // rename does not replace existing files on Windows
+        remove(mFilename.c_str());
+#endif
+        rename(tmpName.c_str(), mFilename.c_str());
+#endif
+    }
+
+    PreviewHeader     *mHeader;    // start of the file, NULL ~ not open
+    size_t            mFileSize;
+    size_t            mImageSize;  // bytes of one buffer
+    std::string       mFilename;
+    float             mInterval;   // seconds between images
+    bool              mCooperative;
+#if !defined(PREVIEW_MMAP)
+    std::vector<byte> mSegment;    // contents of the file
+#endif
+
+    std::vector<Slot> mSlots;      // one per renderer
+    Framebuffer       mImage;      // composed image, background thread only
+    float             mImageScale;
+    uint              mImageIterations;
+    const Framebuffer::GammaTable mGamma;
+
+    bool              mDirty;      // slots changed since last Compose
+    bool              mStop;
+#if !defined(NO_CXX11_THREADS)
+    std::mutex              mMutex; // guards slots and flags above
+    std::condition_variable mWake;
+    std::thread             mThread;
+#endif
+};
+
+#endif //__PREVIEW_HXX__
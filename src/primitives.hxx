@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __PRIMITIVES_HXX__
+#define __PRIMITIVES_HXX__
+
+#include <cmath>
+#include <algorithm>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Packed primitives, intersected four at a time
+//
+// BVH leaves store their primitives in blocks of four in SoA layout, so
+// one SSE instruction works on the same value of all four. Blocks are
+// plain data without virtual calls, which also lets TriangleMesh use them
+// in place from its cache file. Unused lanes of the last block of a leaf
+// repeat its last primitive, which finds the same hit again and so does
+// not need masking.
+
+enum { kPrimitiveLanes = 4 };
+
+//////////////////////////////////////////////////////////////////////////
+// Ray prepared for the watertight triangle test of Woop et al. 2013,
+// "Watertight Ray/Triangle Intersection". Vertices are translated to
+// the ray origin and sheared so the ray points along the z axis, the
+// hit is then tested in 2D. Edge functions of an edge shared by two
+// triangles are then computed from the same values and cannot
+// disagree, so no ray passes between adjacent triangles.
+
+struct ShearedRay
+{
+    void Setup(const Ray &aRay)
+    {
+        // Largest direction component becomes z, x and y are swapped
+        // for negative z to keep the winding of triangles
+        const Vec3f absDir(std::abs(aRay.dir.x), std::abs(aRay.dir.y), std::abs(aRay.dir.z));
+
+        int kz = 0;
+        if(absDir.y > absDir.Get(kz)) kz = 1;
+        if(absDir.z > absDir.Get(kz)) kz = 2;
+
+        int kx = kz == 2 ? 0 : kz + 1;
+        int ky = kx == 2 ? 0 : kx + 1;
+
+        if(aRay.dir.Get(kz) < 0.f)
+            std::swap(kx, ky);
+
+        mAxis[0]  = kx;
+        mAxis[1]  = ky;
+        mAxis[2]  = kz;
+#if defined(GEOMETRY_SSE)
+        float shear[4];
+        _mm_storeu_ps(shear, _mm_div_ps(
+            _mm_setr_ps(aRay.dir.Get(kx), aRay.dir.Get(ky), 1.f, 0.f),
+            _mm_set1_ps(aRay.dir.Get(kz))));
+        mShear[0] = shear[0];
+        mShear[1] = shear[1];
+        mShear[2] = shear[2];
+#else
+        mShear[0] = aRay.dir.Get(kx) / aRay.dir.Get(kz);
+        mShear[1] = aRay.dir.Get(ky) / aRay.dir.Get(kz);
+        mShear[2] = 1.f / aRay.dir.Get(kz);
+#endif
+        mOrg      = aRay.org;
+        mTMin     = aRay.tmin;
+    }
+
+    Vec3f mOrg;
+    float mTMin;
+    int   mAxis[3];  // Permutation of axes, ray points along mAxis[2]
+    float mShear[3]; // Shear of x and y, scale of z
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Four triangles with precomputed normals
+
+struct Triangle4
+{
+    float mVertex[3][3][kPrimitiveLanes]; // [vertex][axis][lane]
+    float mNormal[3][kPrimitiveLanes];    // Unit normal, as Cross(p1 - p0, p2 - p0)
+    int   mMatID[kPrimitiveLanes];
+
+    void Set(
+        int         aLane,
+        const Vec3f &aP0,
+        const Vec3f &aP1,
+        const Vec3f &aP2,
+        int         aMatID)
+    {
+        const Vec3f normal = Normalize(Cross(aP1 - aP0, aP2 - aP0));
+
+        for(int i=0; i<3; i++)
+        {
+            mVertex[0][i][aLane] = aP0.Get(i);
+            mVertex[1][i][aLane] = aP1.Get(i);
+            mVertex[2][i][aLane] = aP2.Get(i);
+            mNormal[i][aLane]    = normal.Get(i);
+        }
+        mMatID[aLane] = aMatID;
+    }
+
+    // Copies lane aFrom to all following lanes
+    void FillFrom(int aFrom)
+    {
+        for(int lane=aFrom+1; lane<kPrimitiveLanes; lane++)
+        {
+            for(int v=0; v<3; v++)
+                for(int i=0; i<3; i++)
+                    mVertex[v][i][lane] = mVertex[v][i][aFrom];
+            for(int i=0; i<3; i++)
+                mNormal[i][lane] = mNormal[i][aFrom];
+            mMatID[lane] = mMatID[aFrom];
+        }
+    }
+
+    // Finds the closest of the four hits in (tmin, aoResult.dist),
+    // updates aoResult and returns true when there is one
+    bool Intersect(
+        const ShearedRay &aRay,
+        Isect            &aoResult) const
+    {
+        const int kx = aRay.mAxis[0];
+        const int ky = aRay.mAxis[1];
+        const int kz = aRay.mAxis[2];
+
+        float dist[kPrimitiveLanes];
+        int hits;
+
+#if defined(GEOMETRY_SSE)
+        const __m128 ox = _mm_set1_ps(aRay.mOrg.Get(kx));
+        const __m128 oy = _mm_set1_ps(aRay.mOrg.Get(ky));
+        const __m128 oz = _mm_set1_ps(aRay.mOrg.Get(kz));
+        const __m128 sx = _mm_set1_ps(aRay.mShear[0]);
+        const __m128 sy = _mm_set1_ps(aRay.mShear[1]);
+        const __m128 sz = _mm_set1_ps(aRay.mShear[2]);
+
+        // Vertices relative to ray origin, sheared
+        __m128 px[3], py[3], pz[3];
+        for(int v=0; v<3; v++)
+        {
+            const __m128 rz = _mm_sub_ps(_mm_loadu_ps(mVertex[v][kz]), oz);
+            px[v] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(mVertex[v][kx]), ox), _mm_mul_ps(sx, rz));
+            py[v] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(mVertex[v][ky]), oy), _mm_mul_ps(sy, rz));
+            pz[v] = _mm_mul_ps(sz, rz);
+        }
+
+        // Edge functions
+        __m128 u = _mm_sub_ps(_mm_mul_ps(px[2], py[1]), _mm_mul_ps(py[2], px[1]));
+        __m128 v = _mm_sub_ps(_mm_mul_ps(px[0], py[2]), _mm_mul_ps(py[0], px[2]));
+        __m128 w = _mm_sub_ps(_mm_mul_ps(px[1], py[0]), _mm_mul_ps(py[1], px[0]));
+
+        const __m128 zero = _mm_setzero_ps();
+        const int onEdge = _mm_movemask_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero),
+            _mm_or_ps(_mm_cmpeq_ps(v, zero), _mm_cmpeq_ps(w, zero))));
+
+        if(onEdge)
+        {
+            float ua[4], va[4], wa[4], x[3][4], y[3][4];
+            _mm_storeu_ps(ua, u);
+            _mm_storeu_ps(va, v);
+            _mm_storeu_ps(wa, w);
+            for(int k=0; k<3; k++)
+            {
+                _mm_storeu_ps(x[k], px[k]);
+                _mm_storeu_ps(y[k], py[k]);
+            }
+            for(int j=0; j<kPrimitiveLanes; j++)
+            {
+                if(onEdge & (1 << j))
+                    EdgesDouble(x[0][j], y[0][j], x[1][j], y[1][j],
+                        x[2][j], y[2][j], ua[j], va[j], wa[j]);
+            }
+            u = _mm_loadu_ps(ua);
+            v = _mm_loadu_ps(va);
+            w = _mm_loadu_ps(wa);
+        }
+
+        // Inside when all edge functions have the same sign
+        const __m128 anyNeg = _mm_or_ps(_mm_cmplt_ps(u, zero),
+            _mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmplt_ps(w, zero)));
+        const __m128 anyPos = _mm_or_ps(_mm_cmpgt_ps(u, zero),
+            _mm_or_ps(_mm_cmpgt_ps(v, zero), _mm_cmpgt_ps(w, zero)));
+
+        const __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+        const __m128 inside = _mm_andnot_ps(_mm_and_ps(anyNeg, anyPos),
+            _mm_cmpneq_ps(det, zero));
+
+        // Most blocks are missed by the ray, skip the division for those
+        if(_mm_movemask_ps(inside) == 0)
+            return false;
+
+        const __m128 t = _mm_div_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(u, pz[0]), _mm_mul_ps(v, pz[1])), _mm_mul_ps(w, pz[2])), det);
+
+        const __m128 hit = _mm_and_ps(inside,
+            _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(aRay.mTMin)),
+                _mm_cmplt_ps(t, _mm_set1_ps(aoResult.dist))));
+
+        hits = _mm_movemask_ps(hit);
+        if(hits == 0)
+            return false;
+
+        _mm_storeu_ps(dist, t);
+#else
+        hits = 0;
+
+        for(int j=0; j<kPrimitiveLanes; j++)
+        {
+            float px[3], py[3], pz[3];
+            for(int k=0; k<3; k++)
+            {
+                const float rz = mVertex[k][kz][j] - aRay.mOrg.Get(kz);
+                px[k] = (mVertex[k][kx][j] - aRay.mOrg.Get(kx)) - aRay.mShear[0] * rz;
+                py[k] = (mVertex[k][ky][j] - aRay.mOrg.Get(ky)) - aRay.mShear[1] * rz;
+                pz[k] = aRay.mShear[2] * rz;
+            }
+
+            float u = px[2] * py[1] - py[2] * px[1];
+            float v = px[0] * py[2] - py[0] * px[2];
+            float w = px[1] * py[0] - py[1] * px[0];
+
+            if(u == 0.f || v == 0.f || w == 0.f)
+                EdgesDouble(px[0], py[0], px[1], py[1], px[2], py[2], u, v, w);
+
+            if((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+                continue;
+
+            const float det = u + v + w;
+            if(det == 0.f)
+                continue;
+
+            dist[j] = (u * pz[0] + v * pz[1] + w * pz[2]) / det;
+
+            if(dist[j] > aRay.mTMin && dist[j] < aoResult.dist)
+                hits |= 1 << j;
+        }
+
+        if(hits == 0)
+            return false;
+#endif
+
+        int best = -1;
+        for(int j=0; j<kPrimitiveLanes; j++)
+        {
+            if((hits & (1 << j)) && (best < 0 || dist[j] < dist[best]))
+                best = j;
+        }
+
+        aoResult.dist   = dist[best];
+        aoResult.matID  = mMatID[best];
+        aoResult.normal = Vec3f(mNormal[0][best], mNormal[1][best], mNormal[2][best]);
+        return true;
+    }
+
+private:
+
+    // Edge functions in double precision, for rays exactly through an edge
+    // or vertex in single precision, where the sign has to be exact
+    static void EdgesDouble(
+        float aAx, float aAy,
+        float aBx, float aBy,
+        float aCx, float aCy,
+        float &oU, float &oV, float &oW)
+    {
+        oU = float(double(aCx) * double(aBy) - double(aCy) * double(aBx));
+        oV = float(double(aAx) * double(aCy) - double(aAy) * double(aCx));
+        oW = float(double(aBx) * double(aAy) - double(aBy) * double(aAx));
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Four spheres. The quadratic is solved with the discriminant formulation
+// of Haines et al., "Precision Improvements for Ray/Sphere Intersection"
+// (Ray Tracing Gems, 2019), which keeps single precision accurate where
+// b^2 - 4ac loses all digits to cancellation.
+
+struct Sphere4
+{
+    float mCenter[3][kPrimitiveLanes];
+    float mRadiusSqr[kPrimitiveLanes];
+    int   mMatID[kPrimitiveLanes];
+
+    void Set(
+        int         aLane,
+        const Vec3f &aCenter,
+        float       aRadius,
+        int         aMatID)
+    {
+        for(int i=0; i<3; i++)
+            mCenter[i][aLane] = aCenter.Get(i);
+        mRadiusSqr[aLane] = aRadius * aRadius;
+        mMatID[aLane]     = aMatID;
+    }
+
+    // Copies lane aFrom to all following lanes
+    void FillFrom(int aFrom)
+    {
+        for(int lane=aFrom+1; lane<kPrimitiveLanes; lane++)
+        {
+            for(int i=0; i<3; i++)
+                mCenter[i][lane] = mCenter[i][aFrom];
+            mRadiusSqr[lane] = mRadiusSqr[aFrom];
+            mMatID[lane]     = mMatID[aFrom];
+        }
+    }
+
+    // Finds the closest of the four hits in (tmin, aoResult.dist),
+    // updates aoResult and returns true when there is one
+    bool Intersect(
+        const Ray &aRay,
+        Isect     &aoResult) const
+    {
+        const float a    = Dot(aRay.dir, aRay.dir);
+        const float invA = 1.f / a;
+
+        float dist[kPrimitiveLanes];
+        int hits;
+
+#if defined(GEOMETRY_SSE)
+        // f = origin relative to center
+        __m128 f[3], d[3];
+        for(int i=0; i<3; i++)
+        {
+            f[i] = _mm_sub_ps(_mm_set1_ps(aRay.org.Get(i)), _mm_loadu_ps(mCenter[i]));
+            d[i] = _mm_set1_ps(aRay.dir.Get(i));
+        }
+
+        // Half of b, and c
+        const __m128 b = Dot4(f, d);
+        const __m128 c = _mm_sub_ps(Dot4(f, f), _mm_loadu_ps(mRadiusSqr));
+
+        // b^2 - ac computed as a * (r^2 - |f - (b / a) d|^2)
+        const __m128 bOverA = _mm_mul_ps(b, _mm_set1_ps(invA));
+        __m128 l[3];
+        for(int i=0; i<3; i++)
+            l[i] = _mm_sub_ps(f[i], _mm_mul_ps(bOverA, d[i]));
+        const __m128 disc = _mm_mul_ps(_mm_set1_ps(a),
+            _mm_sub_ps(_mm_loadu_ps(mRadiusSqr), Dot4(l, l)));
+
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 valid = _mm_cmpge_ps(disc, zero);
+
+        if(_mm_movemask_ps(valid) == 0)
+            return false;
+
+        // q = -(b + sign(b) sqrt(disc)), roots are c / q and q / a
+        const __m128 signMask = _mm_set1_ps(-0.f);
+        const __m128 root = _mm_or_ps(_mm_sqrt_ps(_mm_max_ps(disc, zero)),
+            _mm_and_ps(b, signMask));
+        const __m128 q  = _mm_xor_ps(_mm_add_ps(b, root), signMask);
+        const __m128 r0 = _mm_div_ps(c, q);
+        const __m128 r1 = _mm_mul_ps(q, _mm_set1_ps(invA));
+        const __m128 t0 = _mm_min_ps(r0, r1);
+        const __m128 t1 = _mm_max_ps(r0, r1);
+
+        // Nearer root when in range, the farther one otherwise
+        const __m128 tmin = _mm_set1_ps(aRay.tmin);
+        const __m128 tmax = _mm_set1_ps(aoResult.dist);
+        const __m128 hit0 = _mm_and_ps(_mm_cmpgt_ps(t0, tmin), _mm_cmplt_ps(t0, tmax));
+        const __m128 hit1 = _mm_and_ps(_mm_cmpgt_ps(t1, tmin), _mm_cmplt_ps(t1, tmax));
+        const __m128 t    = _mm_or_ps(_mm_and_ps(hit0, t0), _mm_andnot_ps(hit0, t1));
+
+        hits = _mm_movemask_ps(_mm_and_ps(valid, _mm_or_ps(hit0, hit1)));
+        if(hits == 0)
+            return false;
+
+        _mm_storeu_ps(dist, t);
+#else
+        hits = 0;
+
+        for(int j=0; j<kPrimitiveLanes; j++)
+        {
+            const Vec3f f = aRay.org - Vec3f(mCenter[0][j], mCenter[1][j], mCenter[2][j]);
+            const float b = Dot(f, aRay.dir);
+            const float c = Dot(f, f) - mRadiusSqr[j];
+            const Vec3f l = f - aRay.dir * (b * invA);
+            const float disc = a * (mRadiusSqr[j] - Dot(l, l));
+
+            if(disc < 0.f)
+                continue;
+
+            const float root = b < 0.f ? -std::sqrt(disc) : std::sqrt(disc);
+            const float q    = -(b + root);
+            const float r0   = c / q;
+            const float r1   = q * invA;
+            const float t0   = std::min(r0, r1);
+            const float t1   = std::max(r0, r1);
+
+            if(t0 > aRay.tmin && t0 < aoResult.dist)
+                dist[j] = t0;
+            else if(t1 > aRay.tmin && t1 < aoResult.dist)
+                dist[j] = t1;
+            else
+                continue;
+
+            hits |= 1 << j;
+        }
+
+        if(hits == 0)
+            return false;
+#endif
+
+        int best = -1;
+        for(int j=0; j<kPrimitiveLanes; j++)
+        {
+            if((hits & (1 << j)) && (best < 0 || dist[j] < dist[best]))
+                best = j;
+        }
+
+        const Vec3f center(mCenter[0][best], mCenter[1][best], mCenter[2][best]);
+
+        aoResult.dist   = dist[best];
+        aoResult.matID  = mMatID[best];
+        aoResult.normal = Normalize(aRay.org - center + Vec3f(dist[best]) * aRay.dir);
+        return true;
+    }
+
+private:
+
+#if defined(GEOMETRY_SSE)
+    static __m128 Dot4(
+        const __m128 *aA,
+        const __m128 *aB)
+    {
+        return _mm_add_ps(_mm_add_ps(_mm_mul_ps(aA[0], aB[0]),
+            _mm_mul_ps(aA[1], aB[1])), _mm_mul_ps(aA[2], aB[2]));
+    }
+#endif
+};
+
+#endif //__PRIMITIVES_HXX__
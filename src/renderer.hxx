@@ -27,46 +27,328 @@
 
 #include <vector>
 #include <cmath>
+#include <iostream>
 #include "scene.hxx"
 #include "framebuffer.hxx"
+#include "stats.hxx"
+#include "rng.hxx"
+#include "sampler.hxx"
+#include "adaptive.hxx"
 
 class AbstractRenderer
 {
 public:
 
-    AbstractRenderer(const Scene& aScene) : mScene(aScene)
+    AbstractRenderer(
+        const Scene& aScene,
+        int aSeed = 1234
+    ) :
+        mScene(aScene), mRng(aSeed), mRngSampler(mRng), mSobolSampler(uint(aSeed))
     {
         mMinPathLength = 0;
         mMaxPathLength = 2;
+        mWavefront = false;
+        mDetailedStats = false;
         mIterations = 0;
+        mFramebufferIterations = 0;
         mFramebuffer.Setup(aScene.mCamera.mResolution);
+        mTargetFramebuffer = &mFramebuffer;
+        mTargetIterations  = NULL;
+        mSharedFramebuffer = false;
+        mAtomicCameraColors = false;
+        mSampler = &mRngSampler;
+        mAdaptive = NULL;
     }
 
     virtual ~AbstractRenderer(){}
 
     virtual void RunIteration(int aIteration) = 0;
 
+    //////////////////////////////////////////////////////////////////////////
+    // Cooperative rendering, all renderers (one per thread) work together
+    // on each iteration. The main renderer owns the data shared within
+    // an iteration, the others get it via ShareIterationData. Every
+    // iteration is then run as:
+    //
+    //   BeginIteration  on all renderers, serially
+    //   RunLightBatch   for all light batches, in parallel
+    //   EndLightPass    on the main renderer, outside of parallel region
+    //   RunCameraTile   over all screen tiles, in parallel
+    //   EndIteration    on all renderers
+    //
+    // Light batches and tiles are handed out by the Scheduler. Renderers
+    // that do not override this cannot cooperate.
+
+    virtual bool SupportsCooperative() const { return false; }
+
+    virtual void ShareIterationData(AbstractRenderer &aMain) {}
+
+    virtual void BeginIteration(int aIteration) {}
+
+    virtual int  GetLightBatchCount() const { return 0; }
+
+    virtual void RunLightBatch(int aBatch) {}
+
+    virtual void EndLightPass() {}
+
+    virtual int  GetCameraPathCount() const { return 0; }
+
+    // Camera paths [aBegin, aEnd), path index is the pixel index
+    virtual void RunCameraPaths(int aBegin, int aEnd) {}
+
+    // Camera paths of pixels in [aTileMin, aTileMax)
+    virtual void RunCameraTile(const Vec2i &aTileMin, const Vec2i &aTileMax)
+    {
+        const int resX = int(mScene.mCamera.mResolution.x);
+
+        for(int y = aTileMin.y; y < aTileMax.y; y++)
+            RunCameraPaths(y * resX + aTileMin.x, y * resX + aTileMax.x);
+    }
+
+    virtual void EndIteration() { CountIteration(); }
+
+    // Switches the random number generator to counter-based mode, see Rng
+    void UseCounterRng(uint aKey)
+    {
+        mRng.SetCounterMode(aKey);
+    }
+
+    // Paths take their numbers from the scrambled Sobol sequence instead
+    // of the Rng, see SobolSampler. Renderers that should produce the
+    // same numbers need the same seed.
+    void UseSobolSampler(uint aSeed)
+    {
+        mSobolSampler.SetSeed(aSeed);
+        mSampler = &mSobolSampler;
+    }
+
+    // Renderers can all accumulate into the framebuffer of the main
+    // renderer instead of keeping one each, which saves a full float
+    // image per thread. Cooperating renderers add camera paths without
+    // synchronization, as the tiles are exclusive, light tracing splats
+    // to the camera are added atomically. Independent renderers
+    // (aIndependent) add everything atomically, and also count their
+    // iterations into the main one, as that many images were added.
+    void ShareFramebuffer(
+        AbstractRenderer &aMain,
+        const bool       aIndependent = false)
+    {
+        mTargetFramebuffer       = aMain.mTargetFramebuffer;
+        mSharedFramebuffer       = true;
+        aMain.mSharedFramebuffer = true;
+        mAtomicCameraColors       = aIndependent;
+        aMain.mAtomicCameraColors = aIndependent;
+
+        if(aIndependent)
+        {
+            mTargetIterations       = &aMain.mFramebufferIterations;
+            aMain.mTargetIterations = &aMain.mFramebufferIterations;
+        }
+
+        mFramebuffer.Release();
+    }
+
+    // Cooperating renderers can skip camera paths of converged pixels,
+    // see AdaptiveSampling. The main renderer keeps the statistics.
+    void UseAdaptiveSampling(
+        const float      aTargetError,
+        AbstractRenderer &aMain)
+    {
+        if(&aMain == this)
+            mOwnAdaptive.Setup(mScene.mCamera.mResolution, aTargetError);
+
+        mAdaptive = &aMain.mOwnAdaptive;
+    }
+
+    // Main renderer only, after each iteration. Returns the number of
+    // pixels that still need camera paths
+    int UpdateAdaptiveSampling()
+    {
+        return mOwnAdaptive.Update();
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Checkpointing, see checkpoint.hxx. Renderers store all they need to
+    // continue where they left off: the iteration count, accumulated
+    // framebuffer and random number generator here, the rest in derived
+    // classes. Samplers other than Rng are stateless.
+    virtual void SaveState(std::ostream &aoStream) const
+    {
+        aoStream.write((const char*)&mIterations, sizeof(mIterations));
+        aoStream.write((const char*)&mFramebufferIterations, sizeof(mFramebufferIterations));
+        mFramebuffer.SaveRaw(aoStream);
+        mRng.StoreState(aoStream);
+        mOwnAdaptive.SaveState(aoStream);
+    }
+
+    virtual bool LoadState(std::istream &aoStream)
+    {
+        aoStream.read((char*)&mIterations, sizeof(mIterations));
+        aoStream.read((char*)&mFramebufferIterations, sizeof(mFramebufferIterations));
+        return !aoStream.fail() && mFramebuffer.LoadRaw(aoStream) &&
+            mRng.LoadState(aoStream) && mOwnAdaptive.LoadState(aoStream);
+    }
+
+    //! Whether the framebuffer is this renderer's own, not a shared one
+    bool OwnsFramebuffer() const { return mTargetFramebuffer == &mFramebuffer; }
+
     void GetFramebuffer(Framebuffer& oFramebuffer)
     {
         oFramebuffer = mFramebuffer;
 
-        if(mIterations > 0)
-            oFramebuffer.Scale(1.f / mIterations);
+        if(mFramebufferIterations > 0)
+            oFramebuffer.Scale(1.f / mFramebufferIterations);
     }
 
-    //! Whether this renderer was used at all
-    bool WasUsed() const { return mIterations > 0; }
+    //! Accumulated framebuffer, not yet divided by GetFramebufferIterations()
+    const Framebuffer& GetAccumulation() const { return mFramebuffer; }
+
+    //! Iterations accumulated in the own framebuffer, including those
+    //! of independent renderers sharing it
+    int GetFramebufferIterations() const
+    {
+        int iterations;
+#pragma omp atomic read
+        iterations = mFramebufferIterations;
+        return iterations;
+    }
+
+    //! Whether the own framebuffer holds any iteration
+    bool WasUsed() const { return mFramebufferIterations > 0; }
+
+    const RenderStats& GetStats() const { return mStats; }
 
 public:
 
     uint         mMaxPathLength;
     uint         mMinPathLength;
+    bool         mWavefront; // Trace paths in waves, see BinByKey
+    bool         mDetailedStats; // Also time connections and merging
 
 protected:
 
+    // Counts a finished iteration, see ShareFramebuffer
+    void CountIteration()
+    {
+        mIterations++;
+
+        if(mTargetIterations)
+        {
+#pragma omp atomic
+            (*mTargetIterations)++;
+        }
+        else if(OwnsFramebuffer())
+            mFramebufferIterations++;
+    }
+
+    // Adds contribution of a camera path of pixel aPixelIndex, only one
+    // thread renders the pixel, unless independent renderers share it
+    void AddColor(const int aPixelIndex, const Vec2f &aSample, const Vec3f &aColor)
+    {
+        if(mAdaptive)
+            mTargetFramebuffer->AddColor(aSample, mAdaptive->AddSample(aPixelIndex, aColor));
+        else if(mAtomicCameraColors)
+            mTargetFramebuffer->AddColorAtomic(aSample, aColor);
+        else
+            mTargetFramebuffer->AddColor(aSample, aColor);
+    }
+
+    // Whether the pixel needs a camera path this iteration. When it does
+    // not (adaptive sampling), adds its mean instead and returns false.
+    bool NeedsCameraPath(const int aPixelIndex)
+    {
+        if(!mAdaptive || mAdaptive->NeedsSample(aPixelIndex))
+            return true;
+
+        const int resX = int(mScene.mCamera.mResolution.x);
+        const Vec2f center(aPixelIndex % resX + 0.5f, aPixelIndex / resX + 0.5f);
+
+        mTargetFramebuffer->AddColor(center, mAdaptive->GetMean(aPixelIndex));
+        return false;
+    }
+
+    // Adds light path contribution, any thread can hit the pixel
+    void SplatColor(const Vec2f &aSample, const Vec3f &aColor)
+    {
+        if(mSharedFramebuffer)
+            mTargetFramebuffer->AddColorAtomic(aSample, aColor);
+        else
+            mTargetFramebuffer->AddColor(aSample, aColor);
+    }
+
+    // Keeps just the pixels that need a camera path, see NeedsCameraPath
+    void RemoveConvergedPixels(std::vector<int> &aoPixels)
+    {
+        if(!mAdaptive)
+            return;
+
+        size_t count = 0;
+        for(size_t i=0; i<aoPixels.size(); i++)
+        {
+            if(NeedsCameraPath(aoPixels[i]))
+                aoPixels[count++] = aoPixels[i];
+        }
+
+        aoPixels.resize(count);
+    }
+
+    // Pixel indices of pixels in [aTileMin, aTileMax), row by row
+    void GetTilePixels(
+        const Vec2i      &aTileMin,
+        const Vec2i      &aTileMax,
+        std::vector<int> &oPixels) const
+    {
+        const int resX = int(mScene.mCamera.mResolution.x);
+
+        oPixels.clear();
+        for(int y = aTileMin.y; y < aTileMax.y; y++)
+            for(int x = aTileMin.x; x < aTileMax.x; x++)
+                oPixels.push_back(y * resX + x);
+    }
+
+    // Wavefront path tracing: instead of tracing paths one by one, all
+    // paths of a wave are extended by one segment at a time. Paths are first
+    // intersected together, binned by the material of their hit (key 0 is
+    // reserved for misses), shaded bin by bin, and terminated paths are
+    // compacted away. This outputs indices of aKeys ordered by the keys
+    // in [0, aNumKeys), keeping the order of indices with the same key.
+    static void BinByKey(
+        const std::vector<int> &aKeys,
+        const int              aNumKeys,
+        std::vector<int>       &oBinned,
+        std::vector<int>       &aoBinStarts)
+    {
+        aoBinStarts.assign(aNumKeys + 1, 0);
+
+        for(size_t i=0; i<aKeys.size(); i++)
+            aoBinStarts[aKeys[i] + 1]++;
+
+        for(int k=0; k<aNumKeys; k++)
+            aoBinStarts[k + 1] += aoBinStarts[k];
+
+        oBinned.resize(aKeys.size());
+
+        for(size_t i=0; i<aKeys.size(); i++)
+            oBinned[aoBinStarts[aKeys[i]]++] = int(i);
+    }
+
     int          mIterations;
+    int          mFramebufferIterations; // iterations added to mFramebuffer
     Framebuffer  mFramebuffer;
+    Framebuffer  *mTargetFramebuffer; // mFramebuffer, or the shared one
+    int          *mTargetIterations;  // mFramebufferIterations of the shared one, independent only
+    bool         mSharedFramebuffer;  // mTargetFramebuffer is written by all threads
+    bool         mAtomicCameraColors; // camera paths are added atomically too
+    RenderStats  mStats;
     const Scene& mScene;
+
+    Rng              mRng;
+    RngSampler       mRngSampler;
+    SobolSampler     mSobolSampler;
+    AbstractSampler  *mSampler; // Numbers of all paths, one of the above
+
+    AdaptiveSampling mOwnAdaptive;
+    AdaptiveSampling *mAdaptive; // Own, or main renderer's, NULL when not adaptive
 };
 
 #endif //__RENDERER_HXX__
@@ -27,166 +27,203 @@
 
 #include <vector>
 #include <cmath>
-#include "renderer.hxx"
+#include <iostream>
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Philox4x32-10 counter-based generator (Salmon et al., Parallel Random
+// Numbers: As Easy as 1, 2, 3). Encrypts a 128-bit counter with a 64-bit
+// key, giving 4 independent random words per counter value.
+class Philox4x32
+{
+public:
+
+    static void Generate(
+        const uint aCounter[4],
+        const uint aKey[2],
+        uint       oResult[4])
+    {
+        uint c0 = aCounter[0], c1 = aCounter[1], c2 = aCounter[2], c3 = aCounter[3];
+        uint k0 = aKey[0], k1 = aKey[1];
 
-#if defined(_MSC_VER)
-#   if (_MSC_VER < 1600)
-#       define LEGACY_RNG
-#   endif
-#endif
+        for(int round=0; round<10; round++)
+        {
+            const uint64 p0 = uint64(0xD2511F53u) * c0;
+            const uint64 p1 = uint64(0xCD9E8D57u) * c2;
+
+            const uint n0 = uint(p1 >> 32) ^ c1 ^ k0;
+            const uint n2 = uint(p0 >> 32) ^ c3 ^ k1;
+            c1 = uint(p1);
+            c3 = uint(p0);
+            c0 = n0;
+            c2 = n2;
+
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
 
-#if !defined(LEGACY_RNG)
+        oResult[0] = c0;
+        oResult[1] = c1;
+        oResult[2] = c2;
+        oResult[3] = c3;
+    }
+};
 
-#include <random>
+//////////////////////////////////////////////////////////////////////////
+// Random number generator of the renderers. It has two modes:
+//
+// Sequential (default), a PCG32 generator (O'Neill, www.pcg-random.org)
+// with 16 bytes of state, seeded per renderer.
+//
+// Counter-based (SetCounterMode), numbers are Philox of (dimension, path,
+// iteration, stream) keyed by the seed, where stream tells camera and
+// light paths apart and dimension counts numbers drawn since SetPath.
+// Any path can be regenerated without the others, so the image does not
+// depend on which thread traced which path.
 class Rng
 {
 public:
-    Rng(int aSeed = 1234):
-        mRng(aSeed)
-    {}
 
-    int GetInt()
+    enum Stream
     {
-        return mDistInt(mRng);
-    }
+        kCameraStream = 0,
+        kLightStream  = 1
+    };
 
-    uint GetUint()
+    Rng(int aSeed = 1234)
     {
-        return mDistUint(mRng);
+        // Seed also selects the PCG stream
+        mState     = 0;
+        mIncrement = (uint64(uint(aSeed)) << 1) | 1u;
+        NextPcg();
+        mState += uint64(uint(aSeed)) + 0x853c49e6748fea9bULL;
+        NextPcg();
+
+        mCounterMode = false;
+        mKey[0] = uint(aSeed);
+        mKey[1] = 0x5bd1e995u;
+        SetPath(kCameraStream, 0, 0);
     }
 
-    float GetFloat()
+    // Switches to counter-based mode, renderers that should produce
+    // the same numbers need the same key
+    void SetCounterMode(uint aKey)
     {
-        return mDistFloat(mRng);
+        mCounterMode = true;
+        mKey[0] = aKey;
     }
 
-    Vec2f GetVec2f()
-    {
-        float a = GetFloat();
-        float b = GetFloat();
-
-        return Vec2f(a, b);
-    }
+    bool IsCounterMode() const { return mCounterMode; }
 
-    Vec3f GetVec3f()
+    // Counter-based mode only: numbers of given path and iteration, from
+    // aDimension on. Paths suspended in between (wavefront) are continued
+    // by passing the GetDimension() they stopped at.
+    void SetPath(
+        Stream aStream,
+        uint   aPath,
+        uint   aIteration,
+        uint   aDimension = 0)
     {
-        float a = GetFloat();
-        float b = GetFloat();
-        float c = GetFloat();
-
-        return Vec3f(a, b, c);
+        mCounter[1] = aPath;
+        mCounter[2] = aIteration;
+        mCounter[3] = uint(aStream);
+        mDimension  = aDimension;
+        mBlock      = ~0u;
     }
 
-private:
+    uint GetDimension() const { return mDimension; }
 
-    std::mt19937_64 mRng;
-    std::uniform_int_distribution<int>    mDistInt;
-    std::uniform_int_distribution<uint>   mDistUint;
-    std::uniform_real_distribution<float> mDistFloat;
-};
-
-#else
-
-template<unsigned int rounds>
-class TeaImplTemplate
-{
-public:
-    void Reset(
-        uint aSeed0,
-        uint aSeed1)
+    int GetInt()
     {
-        mState0 = aSeed0;
-        mState1 = aSeed1;
+        return int(GetUint() >> 1);
     }
 
-    uint GetImpl(void)
+    uint GetUint()
     {
-        unsigned int sum=0;
-        const unsigned int delta=0x9e3779b9U;
+        if(!mCounterMode)
+            return NextPcg();
+
+        // Four numbers come from one counter value
+        const uint block = mDimension >> 2;
 
-        for (unsigned int i=0; i<rounds; i++)
+        if(block != mBlock)
         {
-            sum+=delta;
-            mState0+=((mState1<<4)+0xa341316cU) ^ (mState1+sum) ^ ((mState1>>5)+0xc8013ea4U);
-            mState1+=((mState0<<4)+0xad90777dU) ^ (mState0+sum) ^ ((mState0>>5)+0x7e95761eU);
+            mCounter[0] = block;
+            Philox4x32::Generate(mCounter, mKey, mValues);
+            mBlock = block;
         }
 
-        return mState0;
-    }
-
-private:
-
-    uint mState0, mState1;
-};
-
-typedef TeaImplTemplate<6>  TeaImpl;
-
-template<typename RandomImpl>
-class RandomBase
-{
-public:
-
-    RandomBase(int aSeed = 1234)
-    {
-        mImpl.Reset(uint(aSeed), 5678);
-    }
-
-    uint  GetUint()
-    {
-        return getImpl();
+        return mValues[mDimension++ & 3];
     }
 
+    // Uniform float in [0, 1), made of the 24 high bits
     float GetFloat()
     {
-        return (float(GetUint()) + 1.f) * (1.0f / 4294967297.0f);
+        return float(GetUint() >> 8) * (1.f / 16777216.f);
     }
 
-    Vec2f GetVec2f   (void)
+    Vec2f GetVec2f()
     {
-        // cannot do return Vec2f(getF32(), getF32()) because the order is not ensured
         float a = GetFloat();
         float b = GetFloat();
+
         return Vec2f(a, b);
     }
 
-    Vec3f GetVec3f   (void)
+    Vec3f GetVec3f()
     {
         float a = GetFloat();
         float b = GetFloat();
         float c = GetFloat();
+
         return Vec3f(a, b, c);
     }
 
     //////////////////////////////////////////////////////////////////////////
-    void StoreState(
-        uint *oState1,
-        uint *oState2)
+    // Checkpointing, only the sequential state is stored. Counter-based
+    // numbers depend just on the key and what SetPath gets.
+    void StoreState(std::ostream &aoStream) const
     {
-        mImpl.StoreState(oState1, oState2);
+        const uint64 state[2] = { mState, mIncrement };
+        aoStream.write((const char*)state, sizeof(state));
     }
 
-    void LoadState(
-        uint aState1,
-        uint aState2,
-        uint aDimension)
+    bool LoadState(std::istream &aoStream)
     {
-        mImpl.LoadState(aState1, aState2, aDimension);
-    }
+        uint64 state[2];
+        aoStream.read((char*)state, sizeof(state));
 
-protected:
+        if(aoStream.fail())
+            return false;
 
-    uint getImpl(void)
-    {
-        return mImpl.GetImpl();
+        mState     = state[0];
+        mIncrement = state[1];
+        return true;
     }
 
 private:
 
-    RandomImpl mImpl;
-};
+    // PCG-XSH-RR, 64-bit state, 32-bit output
+    uint NextPcg()
+    {
+        const uint64 oldState = mState;
+        mState = oldState * 6364136223846793005ULL + mIncrement;
 
-typedef RandomBase<TeaImpl> Rng;
+        const uint xorShifted = uint(((oldState >> 18u) ^ oldState) >> 27u);
+        const uint rotation   = uint(oldState >> 59u);
 
-#endif
+        return (xorShifted >> rotation) | (xorShifted << ((32u - rotation) & 31u));
+    }
+
+    uint64 mState;
+    uint64 mIncrement;
+
+    bool   mCounterMode;
+    uint   mKey[2];
+    uint   mCounter[4]; // Block of dimension, path, iteration, stream
+    uint   mDimension;  // Next number of the path
+    uint   mBlock;      // Block of mDimension whose numbers are in mValues
+    uint   mValues[4];
+};
 
 #endif //__RNG_HXX__
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+
+#ifndef __SAMPLER_HXX__
+#define __SAMPLER_HXX__
+
+#include "math.hxx"
+#include "rng.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Samplers give renderers the numbers of one path at a time. A path is
+// started with StartPath, the numbers are then requested one dimension
+// at a time, either 1D or 2D, in the same order for every sample of the
+// path. Samplers can therefore distribute each dimension well over the
+// samples (iterations) of the path, which random numbers do not.
+class AbstractSampler
+{
+public:
+
+    virtual ~AbstractSampler() {}
+
+    // Numbers of given path and sample, from aDimension on. Paths
+    // suspended in between (wavefront) are continued by passing the
+    // GetDimension() they stopped at.
+    virtual void StartPath(
+        Rng::Stream aStream,
+        uint        aPath,
+        uint        aSample,
+        uint        aDimension = 0) = 0;
+
+    virtual uint GetDimension() const = 0;
+
+    // Uniform numbers in [0, 1)
+    virtual float Get1D() = 0;
+
+    virtual Vec2f Get2D() = 0;
+
+    // Two dimensions that belong together (e.g., direction), and one
+    // independent of them (e.g., BSDF component)
+    Vec3f Get3D()
+    {
+        const Vec2f a = Get2D();
+        const float b = Get1D();
+
+        return Vec3f(a.x, a.y, b);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Random numbers, straight from Rng. Paths are only set up when the Rng
+// is counter-based, sequential numbers do not depend on the path.
+class RngSampler : public AbstractSampler
+{
+public:
+
+    RngSampler(Rng &aRng) : mRng(aRng) {}
+
+    virtual void StartPath(
+        Rng::Stream aStream,
+        uint        aPath,
+        uint        aSample,
+        uint        aDimension = 0)
+    {
+        mRng.SetPath(aStream, aPath, aSample, aDimension);
+    }
+
+    virtual uint GetDimension() const { return mRng.GetDimension(); }
+
+    virtual float Get1D() { return mRng.GetFloat(); }
+
+    virtual Vec2f Get2D() { return mRng.GetVec2f(); }
+
+private:
+
+    Rng &mRng;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Scrambled Sobol sequence, after Burley, Practical Hash-based Owen
+// Scrambling (JCGT 2020). Each dimension, 1D or 2D, uses the first two
+// Sobol dimensions, which are well stratified over any power of two
+// samples. The sample index is shuffled and the points are Owen scrambled
+// with seeds hashed from path and dimension, so the dimensions and
+// the paths (pixels) are decorrelated from each other. Needs no tables
+// and no state, so like counter-based Rng any path can be regenerated
+// on its own.
+class SobolSampler : public AbstractSampler
+{
+public:
+
+    SobolSampler(uint aSeed = 1234) : mSeed(aSeed)
+    {
+        StartPath(Rng::kCameraStream, 0, 0);
+    }
+
+    void SetSeed(uint aSeed) { mSeed = aSeed; }
+
+    virtual void StartPath(
+        Rng::Stream aStream,
+        uint        aPath,
+        uint        aSample,
+        uint        aDimension = 0)
+    {
+        mPathSeed  = Hash(Hash(mSeed ^ uint(aStream)) ^ aPath);
+        mSample    = aSample;
+        mDimension = aDimension;
+    }
+
+    virtual uint GetDimension() const { return mDimension; }
+
+    virtual float Get1D()
+    {
+        const uint seed  = NextSeed();
+        const uint index = NestedUniformScramble(mSample, seed);
+
+        return ToFloat(NestedUniformScramble(ReverseBits(index), Hash(seed)));
+    }
+
+    virtual Vec2f Get2D()
+    {
+        const uint seed  = NextSeed();
+        const uint index = NestedUniformScramble(mSample, seed);
+
+        const uint x = NestedUniformScramble(ReverseBits(index), Hash(seed));
+        const uint y = NestedUniformScramble(SobolDim1(index), Hash(seed ^ 0x9E3779B9u));
+
+        return Vec2f(ToFloat(x), ToFloat(y));
+    }
+
+private:
+
+    uint NextSeed()
+    {
+        return Hash(mPathSeed + mDimension++);
+    }
+
+    // Second Sobol dimension, the first is just ReverseBits(aIndex)
+    static uint SobolDim1(uint aIndex)
+    {
+        uint result    = 0;
+        uint direction = 0x80000000u;
+
+        for(; aIndex; aIndex >>= 1)
+        {
+            if(aIndex & 1)
+                result ^= direction;
+            direction ^= direction >> 1;
+        }
+
+        return result;
+    }
+
+    // Random permutation of the bits' binary tree, i.e., Owen scrambling
+    static uint NestedUniformScramble(uint aX, const uint aSeed)
+    {
+        aX = ReverseBits(aX);
+
+        // Laine-Karras style hash, only propagates bits upward
+        aX += aSeed;
+        aX ^= aX * 0x6c50b47cu;
+        aX ^= aX * 0xb82f1e52u;
+        aX ^= aX * 0xc7afe638u;
+        aX ^= aX * 0x8d22f6e6u;
+
+        return ReverseBits(aX);
+    }
+
+    static uint ReverseBits(uint aX)
+    {
+        aX = ((aX >> 1) & 0x55555555u) | ((aX & 0x55555555u) << 1);
+        aX = ((aX >> 2) & 0x33333333u) | ((aX & 0x33333333u) << 2);
+        aX = ((aX >> 4) & 0x0F0F0F0Fu) | ((aX & 0x0F0F0F0Fu) << 4);
+        aX = ((aX >> 8) & 0x00FF00FFu) | ((aX & 0x00FF00FFu) << 8);
+
+        return (aX >> 16) | (aX << 16);
+    }
+
+    // Integer hash with good avalanche (lowbias32)
+    static uint Hash(uint aX)
+    {
+        aX ^= aX >> 16;
+        aX *= 0x7feb352du;
+        aX ^= aX >> 15;
+        aX *= 0x846ca68bu;
+        aX ^= aX >> 16;
+
+        return aX;
+    }
+
+    // Same as Rng::GetFloat, the 24 high bits
+    static float ToFloat(const uint aX)
+    {
+        return float(aX >> 8) * (1.f / 16777216.f);
+    }
+
+private:
+
+    uint mSeed;
+    uint mPathSeed;  // Hash of seed, stream and path
+    uint mSample;    // Sample index within the path, i.e., iteration
+    uint mDimension; // Dimensions requested since StartPath
+};
+
+#endif //__SAMPLER_HXX__
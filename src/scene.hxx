@@ -26,10 +26,14 @@
 #define __SCENE_HXX__
 
 #include <vector>
-#include <map>
+#include <string>
 #include <cmath>
 #include "math.hxx"
 #include "geometry.hxx"
+#include "bvh.hxx"
+#include "mesh.hxx"
+#include "meshloader.hxx"
+#include "spheres.hxx"
 #include "camera.hxx"
 #include "materials.hxx"
 #include "lights.hxx"
@@ -39,7 +43,8 @@ class Scene
 public:
     Scene() :
         mGeometry(NULL),
-        mBackground(NULL)
+        mBackground(NULL),
+        mBackgroundID(-1)
     {}
 
     ~Scene()
@@ -57,33 +62,71 @@ public:
         bool hit = mGeometry->Intersect(aRay, oResult);
 
         if(hit)
-        {
-            oResult.lightID = -1;
-            std::map<int, int>::const_iterator it =
-                mMaterial2Light.find(oResult.matID);
-
-            if(it != mMaterial2Light.end())
-                oResult.lightID = it->second;
-        }
+            SetLightID(oResult);
 
         return hit;
     }
 
+    // Intersect for aCount rays, oHits[i] tells whether ray i hit
+    void IntersectN(
+        const Ray *aRays,
+        Isect     *aoResults,
+        char      *oHits,
+        int       aCount) const
+    {
+        for(int i=0; i<aCount; i++)
+            oHits[i] = 0;
+
+        mGeometry->IntersectN(aRays, aoResults, oHits, aCount);
+
+        for(int i=0; i<aCount; i++)
+        {
+            if(oHits[i])
+                SetLightID(aoResults[i]);
+        }
+    }
+
     bool Occluded(
         const Vec3f &aPoint,
         const Vec3f &aDir,
         float aTMax) const
     {
         Ray ray;
-        ray.org  = aPoint + aDir * EPS_RAY;
-        ray.dir  = aDir;
-        ray.tmin = 0;
         Isect isect;
-        isect.dist = aTMax - 2*EPS_RAY;
+        SetupShadowRay(aPoint, aDir, aTMax, ray, isect);
 
         return mGeometry->IntersectP(ray, isect);
     }
 
+    // Occluded for aCount rays set up by SetupShadowRay,
+    // oOccluded[i] tells whether ray i is occluded
+    void OccludedN(
+        const Ray *aRays,
+        Isect     *aoIsects,
+        char      *oOccluded,
+        int       aCount) const
+    {
+        for(int i=0; i<aCount; i++)
+            oOccluded[i] = 0;
+
+        mGeometry->OccludedN(aRays, aoIsects, oOccluded, aCount);
+    }
+
+    // Ray and isect testing visibility between aPoint and the point
+    // in distance aTMax along aDir
+    static void SetupShadowRay(
+        const Vec3f &aPoint,
+        const Vec3f &aDir,
+        float       aTMax,
+        Ray         &oRay,
+        Isect       &oIsect)
+    {
+        oRay.org  = aPoint + aDir * EPS_RAY;
+        oRay.dir  = aDir;
+        oRay.tmin = 0;
+        oIsect.dist = aTMax - 2*EPS_RAY;
+    }
+
     const Material& GetMaterial(const int aMaterialIdx) const
     {
         return mMaterials[aMaterialIdx];
@@ -97,10 +140,22 @@ public:
 
     const AbstractLight* GetLightPtr(int aLightIdx) const
     {
-        aLightIdx = std::min<int>(aLightIdx, mLights.size()-1);
         return mLights[aLightIdx];
     }
 
+    // Index of light picked by random number in [0, 1), proportionally
+    // to its power, see BuildLightTable
+    int PickLight(float aRandom) const
+    {
+        return mLightTable.Sample(aRandom);
+    }
+
+    // Probability of PickLight returning the light
+    float GetLightPickProb(int aLightIdx) const
+    {
+        return mLightTable.GetPdf(aLightIdx);
+    }
+
     int GetLightCount() const
     {
         return (int)mLights.size();
@@ -111,6 +166,11 @@ public:
         return mBackground;
     }
 
+    int GetBackgroundID() const
+    {
+        return mBackgroundID;
+    }
+
     //////////////////////////////////////////////////////////////////////////
     // Loads a Cornell Box scene
     enum BoxMask
@@ -129,11 +189,15 @@ public:
         kDefault           = (kLightCeiling | kBothSmallSpheres),
     };
 
-    void LoadCornellBox(
-        const Vec2i &aResolution,
-        uint aBoxMask = kDefault)
+    // With aMeshFile, the mesh is placed where the large sphere would
+    // be, in place of all spheres. Returns false when it cannot be loaded.
+    bool LoadCornellBox(
+        const Vec2i       &aResolution,
+        uint              aBoxMask = kDefault,
+        const std::string &aMeshFile = std::string())
     {
-        mSceneName = GetSceneName(aBoxMask, &mSceneAcronym);
+        const bool mesh = !aMeshFile.empty();
+        mSceneName = GetSceneName(aBoxMask, &mSceneAcronym, mesh);
 
         if((aBoxMask & kBothLargeSpheres) == kBothLargeSpheres)
         {
@@ -204,6 +268,10 @@ public:
         mat.mDiffuseReflectance = Vec3f(0.156863f, 0.172549f, 0.803922f);
         mMaterials.push_back(mat);
 
+        // Sampling probabilities are per material, not per hit
+        for(size_t i=0; i<mMaterials.size(); i++)
+            mMaterials[i].Precompute();
+
         delete mGeometry;
 
         //////////////////////////////////////////////////////////////////////////
@@ -222,55 +290,80 @@ public:
         GeometryList *geometryList = new GeometryList;
         mGeometry = geometryList;
 
+        TriangleList triangles;
+        SphereSet    *spheres = new SphereSet;
+
         if((aBoxMask & kGlossyFloor) != 0)
         {
             // Floor
-            geometryList->mGeometry.push_back(new Triangle(cb[0], cb[4], cb[5], 2));
-            geometryList->mGeometry.push_back(new Triangle(cb[5], cb[1], cb[0], 2));
+            triangles.Add(cb[0], cb[4], cb[5], 2);
+            triangles.Add(cb[5], cb[1], cb[0], 2);
             // Back wall
-            geometryList->mGeometry.push_back(new Triangle(cb[0], cb[1], cb[2], 8));
-            geometryList->mGeometry.push_back(new Triangle(cb[2], cb[3], cb[0], 8));
+            triangles.Add(cb[0], cb[1], cb[2], 8);
+            triangles.Add(cb[2], cb[3], cb[0], 8);
         }
         else
         {
             // Floor
-            geometryList->mGeometry.push_back(new Triangle(cb[0], cb[4], cb[5], 5));
-            geometryList->mGeometry.push_back(new Triangle(cb[5], cb[1], cb[0], 5));
+            triangles.Add(cb[0], cb[4], cb[5], 5);
+            triangles.Add(cb[5], cb[1], cb[0], 5);
             // Back wall
-            geometryList->mGeometry.push_back(new Triangle(cb[0], cb[1], cb[2], 5));
-            geometryList->mGeometry.push_back(new Triangle(cb[2], cb[3], cb[0], 5));
+            triangles.Add(cb[0], cb[1], cb[2], 5);
+            triangles.Add(cb[2], cb[3], cb[0], 5);
         }
 
 
         // Ceiling
         if(light_ceiling && !light_box)
         {
-            geometryList->mGeometry.push_back(new Triangle(cb[2], cb[6], cb[7], 0));
-            geometryList->mGeometry.push_back(new Triangle(cb[7], cb[3], cb[2], 1));
+            triangles.Add(cb[2], cb[6], cb[7], 0);
+            triangles.Add(cb[7], cb[3], cb[2], 1);
         }
         else
         {
-            geometryList->mGeometry.push_back(new Triangle(cb[2], cb[6], cb[7], 5));
-            geometryList->mGeometry.push_back(new Triangle(cb[7], cb[3], cb[2], 5));
+            triangles.Add(cb[2], cb[6], cb[7], 5);
+            triangles.Add(cb[7], cb[3], cb[2], 5);
         }
 
         // Left wall
-        geometryList->mGeometry.push_back(new Triangle(cb[3], cb[7], cb[4], 3));
-        geometryList->mGeometry.push_back(new Triangle(cb[4], cb[0], cb[3], 3));
+        triangles.Add(cb[3], cb[7], cb[4], 3);
+        triangles.Add(cb[4], cb[0], cb[3], 3);
 
         // Right wall
-        geometryList->mGeometry.push_back(new Triangle(cb[1], cb[5], cb[6], 4));
-        geometryList->mGeometry.push_back(new Triangle(cb[6], cb[2], cb[1], 4));
+        triangles.Add(cb[1], cb[5], cb[6], 4);
+        triangles.Add(cb[6], cb[2], cb[1], 4);
 
         // Ball - central
         float largeRadius = 0.8f;
         Vec3f center = (cb[0] + cb[1] + cb[4] + cb[5]) * (1.f / 4.f) + Vec3f(0, 0, largeRadius);
 
+        if(mesh)
+        {
+            // Material of the large ball, if any, diffuse white otherwise
+            int matID = 5;
+            if((aBoxMask & kLargeMirrorSphere) != 0) matID = 6;
+            if((aBoxMask & kLargeGlassSphere)  != 0) matID = 7;
+
+            TriangleMesh *triangleMesh = MeshLoader::Load(aMeshFile,
+                center - Vec3f(largeRadius), center + Vec3f(largeRadius), matID);
+
+            if(!triangleMesh)
+            {
+                delete spheres;
+                delete geometryList;
+                mGeometry = NULL;
+                return false;
+            }
+
+            geometryList->mGeometry.push_back(triangleMesh);
+            aBoxMask &= ~(kBothLargeSpheres | kBothSmallSpheres);
+        }
+
         if((aBoxMask & kLargeMirrorSphere) != 0)
-            geometryList->mGeometry.push_back(new Sphere(center, largeRadius, 6));
+            spheres->Add(center, largeRadius, 6);
 
         if((aBoxMask & kLargeGlassSphere) != 0)
-            geometryList->mGeometry.push_back(new Sphere(center, largeRadius, 7));
+            spheres->Add(center, largeRadius, 7);
 
         // Balls - left and right
         float smallRadius = 0.5f;
@@ -281,10 +374,10 @@ public:
         Vec3f rightBallCenter = rightWallCenter - Vec3f(2.f * xlen / 7.f, 0, 0);
 
         if((aBoxMask & kSmallMirrorSphere) != 0)
-            geometryList->mGeometry.push_back(new Sphere(leftBallCenter,  smallRadius, 6));
+            spheres->Add(leftBallCenter,  smallRadius, 6);
 
         if((aBoxMask & kSmallGlassSphere) != 0)
-            geometryList->mGeometry.push_back(new Sphere(rightBallCenter, smallRadius, 7));
+            spheres->Add(rightBallCenter, smallRadius, 7);
 
         //////////////////////////////////////////////////////////////////////////
         // Light box at the ceiling
@@ -302,34 +395,36 @@ public:
         if(light_box)
         {
             // Back wall
-            geometryList->mGeometry.push_back(new Triangle(lb[0], lb[2], lb[1], 5));
-            geometryList->mGeometry.push_back(new Triangle(lb[2], lb[0], lb[3], 5));
+            triangles.Add(lb[0], lb[2], lb[1], 5);
+            triangles.Add(lb[2], lb[0], lb[3], 5);
             // Left wall
-            geometryList->mGeometry.push_back(new Triangle(lb[3], lb[4], lb[7], 5));
-            geometryList->mGeometry.push_back(new Triangle(lb[4], lb[3], lb[0], 5));
+            triangles.Add(lb[3], lb[4], lb[7], 5);
+            triangles.Add(lb[4], lb[3], lb[0], 5);
             // Right wall
-            geometryList->mGeometry.push_back(new Triangle(lb[1], lb[6], lb[5], 5));
-            geometryList->mGeometry.push_back(new Triangle(lb[6], lb[1], lb[2], 5));
+            triangles.Add(lb[1], lb[6], lb[5], 5);
+            triangles.Add(lb[6], lb[1], lb[2], 5);
             // Front wall
-            geometryList->mGeometry.push_back(new Triangle(lb[4], lb[5], lb[6], 5));
-            geometryList->mGeometry.push_back(new Triangle(lb[6], lb[7], lb[4], 5));
+            triangles.Add(lb[4], lb[5], lb[6], 5);
+            triangles.Add(lb[6], lb[7], lb[4], 5);
 
             if(light_ceiling)
             {
                 // Floor
-                geometryList->mGeometry.push_back(new Triangle(lb[0], lb[5], lb[4], 0));
-                geometryList->mGeometry.push_back(new Triangle(lb[5], lb[0], lb[1], 1));
+                triangles.Add(lb[0], lb[5], lb[4], 0);
+                triangles.Add(lb[5], lb[0], lb[1], 1);
             }
             else
             {
                 // Floor
-                geometryList->mGeometry.push_back(new Triangle(lb[0], lb[5], lb[4], 5));
-                geometryList->mGeometry.push_back(new Triangle(lb[5], lb[0], lb[1], 5));
+                triangles.Add(lb[0], lb[5], lb[4], 5);
+                triangles.Add(lb[5], lb[0], lb[1], 5);
             }
         }
 
         //////////////////////////////////////////////////////////////////////////
         // Lights
+        mMaterial2Light.assign(mMaterials.size(), -1);
+
         if(light_ceiling && !light_box)
         {
             // Without light box, whole ceiling is light
@@ -337,12 +432,12 @@ public:
             AreaLight *l = new AreaLight(cb[2], cb[6], cb[7]);
             l->mIntensity = Vec3f(0.95492965f);
             mLights[0] = l;
-            mMaterial2Light.insert(std::make_pair(0, 0));
+            mMaterial2Light[0] = 0;
 
             l = new AreaLight(cb[7], cb[3], cb[2]);
             l->mIntensity = Vec3f(0.95492965f);
             mLights[1] = l;
-            mMaterial2Light.insert(std::make_pair(1, 1));
+            mMaterial2Light[1] = 1;
         }
         else if(light_ceiling && light_box)
         {
@@ -352,13 +447,13 @@ public:
             //l->mIntensity = Vec3f(0.95492965f);
             l->mIntensity = Vec3f(25.03329895614464f);
             mLights[0] = l;
-            mMaterial2Light.insert(std::make_pair(0, 0));
+            mMaterial2Light[0] = 0;
 
             l = new AreaLight(lb[5], lb[0], lb[1]);
             //l->mIntensity = Vec3f(0.95492965f);
             l->mIntensity = Vec3f(25.03329895614464f);
             mLights[1] = l;
-            mMaterial2Light.insert(std::make_pair(1, 1));
+            mMaterial2Light[1] = 1;
         }
 
         if(light_sun)
@@ -382,6 +477,25 @@ public:
             mLights.push_back(l);
             mBackground = l;
         }
+
+        //////////////////////////////////////////////////////////////////////////
+        // Acceleration structure, takes over all geometry from the list.
+        // Triangles and spheres form one object each, with BVHs of their own.
+        TriangleMesh *boxMesh = new TriangleMesh;
+        boxMesh->Setup(triangles.mVertices, triangles.mTriangles, triangles.mMatIDs);
+        geometryList->mGeometry.push_back(boxMesh);
+
+        if(spheres->Empty())
+            delete spheres;
+        else
+        {
+            spheres->Build();
+            geometryList->mGeometry.push_back(spheres);
+        }
+
+        mGeometry = new Bvh(*geometryList);
+        delete geometryList;
+        return true;
     }
 
     void BuildSceneSphere()
@@ -397,9 +511,27 @@ public:
         mSceneSphere.mInvSceneRadiusSqr = 1.f / Sqr(mSceneSphere.mSceneRadius);
     }
 
+    // Alias table of light powers, needs the scene sphere
+    void BuildLightTable()
+    {
+        std::vector<float> powers(mLights.size());
+        mBackgroundID = -1;
+
+        for(size_t i=0; i<mLights.size(); i++)
+        {
+            powers[i] = mLights[i]->GetPower(mSceneSphere);
+
+            if(mLights[i] == mBackground)
+                mBackgroundID = int(i);
+        }
+
+        mLightTable.Setup(powers);
+    }
+
     static std::string GetSceneName(
         uint        aBoxMask,
-        std::string *oAcronym = NULL)
+        std::string *oAcronym = NULL,
+        bool        aMesh     = false)
     {
         std::string name;
         std::string acronym;
@@ -412,7 +544,12 @@ public:
         }
 
         // Box content
-        if((aBoxMask & kBothSmallSpheres) == kBothSmallSpheres)
+        if(aMesh)
+        {
+            name    += "mesh";
+            acronym += "m";
+        }
+        else if((aBoxMask & kBothSmallSpheres) == kBothSmallSpheres)
         {
             name    += "small spheres";
             acronym += "bs";
@@ -471,15 +608,25 @@ public:
         return name;
     }
 
+private:
+
+    // Sets light ID of hit, -1 when the material is not emissive
+    void SetLightID(Isect &aoResult) const
+    {
+        aoResult.lightID = mMaterial2Light[aoResult.matID];
+    }
+
 public:
 
     AbstractGeometry      *mGeometry;
     Camera                mCamera;
     std::vector<Material> mMaterials;
     std::vector<AbstractLight*>   mLights;
-    std::map<int, int>    mMaterial2Light;
+    std::vector<int>      mMaterial2Light; // Light ID of each material, or -1
     SceneSphere           mSceneSphere;
     BackgroundLight*      mBackground;
+    int                   mBackgroundID; // Light ID of mBackground, or -1
+    AliasTable            mLightTable;   // Light pick probabilities
 
     std::string           mSceneName;
     std::string           mSceneAcronym;
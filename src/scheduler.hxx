@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __SCHEDULER_HXX__
+#define __SCHEDULER_HXX__
+
+#include <vector>
+#include <algorithm>
+#ifndef NO_OMP
+#include <omp.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include "math.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// Work-stealing task scheduler. Tasks [0, aTaskCount) are split into one
+// contiguous range per thread. Each thread takes tasks from its own range,
+// and when that is exhausted steals from the ranges of the other threads.
+// Both are done by an atomic fetch-add on the range start, so a task is
+// run exactly once no matter who takes it.
+//
+// Tasks are called as aTask(taskIndex, threadId).
+class Scheduler
+{
+    // Each range sits on its own cache line to avoid false sharing
+    enum { kCacheLineSize = 64 };
+
+    struct TaskRange
+    {
+        int  mNext; // First task not yet taken (can overshoot mEnd)
+        int  mEnd;  // One past the last task of the range
+        char mPadding[kCacheLineSize - 2 * sizeof(int)];
+    };
+
+public:
+
+    Scheduler(int aNumThreads) : mNumThreads(std::max(1, aNumThreads))
+    {
+        mRanges.resize(mNumThreads);
+    }
+
+    template<typename tTask>
+    void Run(
+        const int   aTaskCount,
+        const tTask &aTask)
+    {
+        for(int i=0; i<mNumThreads; i++)
+        {
+            mRanges[i].mNext = int((long long)aTaskCount * i / mNumThreads);
+            mRanges[i].mEnd  = int((long long)aTaskCount * (i + 1) / mNumThreads);
+        }
+
+#pragma omp parallel num_threads(mNumThreads)
+        {
+#ifndef NO_OMP
+            const int threadId = omp_get_thread_num();
+#else
+            const int threadId = 0;
+#endif
+            // Own range first, then the others. Ranges of threads the runtime
+            // did not give us are simply stolen by the rest.
+            for(int i=0; i<mNumThreads; i++)
+            {
+                TaskRange &range = mRanges[(threadId + i) % mNumThreads];
+
+                for(;;)
+                {
+                    const int task = FetchAdd(range.mNext, 1);
+                    if(task >= range.mEnd)
+                        break;
+
+                    aTask(task, threadId);
+                }
+            }
+        }
+    }
+
+    int GetNumThreads() const { return mNumThreads; }
+
+private:
+
+    static int FetchAdd(int &aoValue, const int aAdd)
+    {
+#if defined(_MSC_VER)
+        return _InterlockedExchangeAdd((volatile long*)&aoValue, aAdd);
+#else
+        return __sync_fetch_and_add(&aoValue, aAdd);
+#endif
+    }
+
+    int                    mNumThreads;
+    std::vector<TaskRange> mRanges;
+};
+
+#endif //__SCHEDULER_HXX__
@@ -38,6 +38,11 @@
 #include "vertexcm.hxx"
 #include "html_writer.hxx"
 #include "config.hxx"
+#include "scheduler.hxx"
+#include "checkpoint.hxx"
+#include "preview.hxx"
+#include "numa.hxx"
+#include "distributed.hxx"
 
 #ifndef NO_OMP
 #include <omp.h>
@@ -46,12 +51,157 @@
 #include <set>
 #include <sstream>
 
+//////////////////////////////////////////////////////////////////////////
+// Tasks of a cooperative iteration, run by the scheduler on the renderer
+// of the executing thread
+
+struct LightBatchTask
+{
+    AbstractRenderer **mRenderers;
+
+    void operator()(int aBatch, int aThreadId) const
+    {
+        mRenderers[aThreadId]->RunLightBatch(aBatch);
+    }
+};
+
+struct CameraTileTask
+{
+    AbstractRenderer **mRenderers;
+    Vec2i            mResolution;
+    Vec2i            mTileCount;
+    int              mTileSize;
+
+    void operator()(int aTile, int aThreadId) const
+    {
+        const Vec2i tileMin(
+            (aTile % mTileCount.x) * mTileSize,
+            (aTile / mTileCount.x) * mTileSize);
+        const Vec2i tileMax(
+            std::min(tileMin.x + mTileSize, mResolution.x),
+            std::min(tileMin.y + mTileSize, mResolution.y));
+
+        mRenderers[aThreadId]->RunCameraTile(tileMin, tileMax);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Runs one iteration with all renderers working together (one per thread),
+// in the order described in AbstractRenderer. Light batches and screen
+// tiles are distributed by the work-stealing scheduler.
+
+void RunCooperativeIteration(
+    AbstractRenderer **aRenderers,
+    Scheduler        &aScheduler,
+    const Vec2i      &aResolution,
+    const int        aIteration)
+{
+    // Size of square screen tiles in pixels
+    const int tileSize = 32;
+
+    const int numRenderers = aScheduler.GetNumThreads();
+
+    for(int i=0; i<numRenderers; i++)
+        aRenderers[i]->BeginIteration(aIteration);
+
+    LightBatchTask lightTask;
+    lightTask.mRenderers = aRenderers;
+    aScheduler.Run(aRenderers[0]->GetLightBatchCount(), lightTask);
+
+    aRenderers[0]->EndLightPass();
+
+    if(aRenderers[0]->GetCameraPathCount() > 0)
+    {
+        CameraTileTask cameraTask;
+        cameraTask.mRenderers  = aRenderers;
+        cameraTask.mResolution = aResolution;
+        cameraTask.mTileSize   = tileSize;
+        cameraTask.mTileCount  = Vec2i(
+            (aResolution.x + tileSize - 1) / tileSize,
+            (aResolution.y + tileSize - 1) / tileSize);
+
+        aScheduler.Run(cameraTask.mTileCount.x * cameraTask.mTileCount.y,
+            cameraTask);
+    }
+
+    for(int i=0; i<numRenderers; i++)
+        aRenderers[i]->EndIteration();
+}
+
+// Index of aIteration of this node among iterations of all nodes,
+// see distributed.hxx
+int GlobalIteration(const Config &aConfig, int aIteration)
+{
+    return aIteration * aConfig.mNodeCount + aConfig.mNodeIndex;
+}
+
+// Seed of renderer aIndex. Seeds of nodes interleave, so they never
+// repeat across nodes
+int RendererSeed(const Config &aConfig, int aIndex)
+{
+    return aConfig.mBaseSeed + aIndex * aConfig.mNodeCount + aConfig.mNodeIndex;
+}
+
+// With --numa, see numa.hxx. Every thread pins itself and creates its
+// renderer, which it alone uses in independent mode, so its framebuffer
+// (and later its light vertices and hash grid) are first touched on its
+// node. The runtime keeps its threads between parallel regions, so the
+// pinning holds for the whole render. Renderers on nodes other than the
+// one of thread 0 use a scene replica loaded by the first thread there,
+// outputs the replicas to be deleted after the renderers.
+void CreateRenderersNuma(
+    const Config        &aConfig,
+    AbstractRenderer    **oRenderers,
+    std::vector<Scene*> &oReplicas)
+{
+    const NumaTopology numa;
+    const int numThreads = aConfig.mNumThreads;
+    const int mainNode   = numa.GetThreadNode(0);
+
+    std::vector<Scene*> nodeScenes(numa.GetNodeCount(), (Scene*)NULL);
+
+    for(int i=0; i<numThreads; i++)
+        oRenderers[i] = NULL;
+
+#pragma omp parallel num_threads(numThreads)
+    {
+#ifndef NO_OMP
+        const int threadId = omp_get_thread_num();
+#else
+        const int threadId = 0;
+#endif
+        NumaTopology::PinCurrentThread(numa.GetThreadCpu(threadId));
+
+        const int node = numa.GetThreadNode(threadId);
+
+        if(node != mainNode && numa.GetFirstThread(node, numThreads) == threadId)
+            nodeScenes[node] = LoadScene(aConfig);
+
+#pragma omp barrier
+
+        // A replica that failed to load leaves the node on the main scene
+        Config threadConfig = aConfig;
+        if(nodeScenes[node])
+            threadConfig.mScene = nodeScenes[node];
+
+        oRenderers[threadId] = CreateRenderer(threadConfig,
+            RendererSeed(aConfig, threadId));
+    }
+
+    for(size_t i=0; i<nodeScenes.size(); i++)
+    {
+        if(nodeScenes[i])
+            oReplicas.push_back(nodeScenes[i]);
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////
 // The main rendering function, renders what is in aConfig
 
 float render(
     const Config &aConfig,
-    int *oUsedIterations = NULL)
+    int          *oUsedIterations = NULL,
+    RenderStats  *oStats = NULL)
 {
     // Set number of used threads
 #ifndef NO_OMP
@@ -63,31 +213,188 @@ float render(
     AbstractRendererPtr *renderers;
     renderers = new AbstractRendererPtr[aConfig.mNumThreads];
 
+    // Scenes of NUMA nodes other than the one of the main thread
+    std::vector<Scene*> replicas;
+
+    if(aConfig.mNuma)
+        CreateRenderersNuma(aConfig, renderers, replicas);
+
     for(int i=0; i<aConfig.mNumThreads; i++)
     {
-        renderers[i] = CreateRenderer(aConfig, aConfig.mBaseSeed + i);
+        // Also those of threads the runtime did not give CreateRenderersNuma
+        if(!aConfig.mNuma || !renderers[i])
+            renderers[i] = CreateRenderer(aConfig, RendererSeed(aConfig, i));
 
         renderers[i]->mMaxPathLength = aConfig.mMaxPathLength;
         renderers[i]->mMinPathLength = aConfig.mMinPathLength;
+        renderers[i]->mWavefront     = aConfig.mWavefront;
+        renderers[i]->mDetailedStats = !aConfig.mStatsName.empty();
+
+        // All renderers (and nodes) share the key, paths and global
+        // iterations are what makes random numbers differ
+        if(aConfig.mCounterRng)
+            renderers[i]->UseCounterRng(uint(aConfig.mBaseSeed));
+        if(aConfig.mSobol)
+            renderers[i]->UseSobolSampler(uint(aConfig.mBaseSeed));
+    }
+
+    // In cooperative mode all renderers use the iteration data
+    // (e.g., light vertices) of the first one
+    const bool cooperative = aConfig.mCooperative &&
+        renderers[0]->SupportsCooperative();
+
+    if(cooperative)
+    {
+        for(int i=1; i<aConfig.mNumThreads; i++)
+            renderers[i]->ShareIterationData(*renderers[0]);
+    }
+
+    if(aConfig.mSharedFramebuffer)
+    {
+        for(int i=1; i<aConfig.mNumThreads; i++)
+            renderers[i]->ShareFramebuffer(*renderers[0], !cooperative);
     }
 
-    clock_t startT = clock();
-    int iter = 0;
+    // Adaptive sampling needs exclusive pixels, i.e., cooperation
+    const bool adaptive = cooperative && aConfig.mAdaptiveError > 0;
+
+    if(adaptive)
+    {
+        for(int i=0; i<aConfig.mNumThreads; i++)
+            renderers[i]->UseAdaptiveSampling(aConfig.mAdaptiveError, *renderers[0]);
+    }
+
+    // Continue from checkpoint, iterations (and time) below are on top
+    // of those already done
+    int startIter = 0;
+
+    if(!aConfig.mResumeName.empty() &&
+        !LoadCheckpoint(aConfig, renderers, cooperative, startIter))
+    {
+        for(int i=0; i<aConfig.mNumThreads; i++)
+            delete renderers[i];
+
+        delete [] renderers;
+
+        for(size_t i=0; i<replicas.size(); i++)
+            delete replicas[i];
+
+        return -1.f;
+    }
+
+    const int endIter = startIter + aConfig.mIterations;
+
+    Scheduler scheduler(aConfig.mNumThreads);
+    const Vec2i resolution(
+        int(aConfig.mScene->mCamera.mResolution.x),
+        int(aConfig.mScene->mCamera.mResolution.y));
+
+    CheckpointWriter checkpointWriter;
+    const bool   checkpoints = !aConfig.mCheckpointName.empty();
+    const double startT = GetWallTime();
+    double checkpointT  = startT + aConfig.mCheckpointTime;
+    int iter = startIter;
+
+    // Failing to publish the preview is no reason not to render
+    PreviewWriter preview;
+    if(!aConfig.mPreviewName.empty())
+        preview.Open(aConfig, cooperative);
 
     // Rendering loop, when we have any time limit, use time-based loop,
     // otherwise go with required iterations
-    if(aConfig.mMaxTime > 0)
+    if(cooperative)
+    {
+        // Iterations run one after another, threads split each of them.
+        // Checkpoints are taken in between
+        for(iter=startIter; ; iter++)
+        {
+            if(aConfig.mMaxTime > 0)
+            {
+                if(GetWallTime() >= startT + aConfig.mMaxTime)
+                    break;
+            }
+            else if(iter >= endIter)
+                break;
+
+            RunCooperativeIteration(renderers, scheduler, resolution,
+                GlobalIteration(aConfig, iter));
+
+            // Done early once all pixels have converged
+            const bool converged = adaptive &&
+                renderers[0]->UpdateAdaptiveSampling() == 0;
+
+            for(int i=0; i<aConfig.mNumThreads; i++)
+                preview.Offer(i, *renderers[i]);
+
+            if(checkpoints && GetWallTime() >= checkpointT)
+            {
+                checkpointWriter.Write(aConfig, renderers, cooperative, iter + 1);
+                checkpointT = GetWallTime() + aConfig.mCheckpointTime;
+            }
+
+            if(converged)
+            {
+                iter++;
+                break;
+            }
+        }
+    }
+    else if(checkpoints)
+    {
+        // Independent renderers run in segments of --checkpoint-time, and
+        // all stop at the end of each for its checkpoint. Threads take the
+        // next iteration until the segment, or the render, is over
+        bool done = false;
+        while(!done)
+        {
+            const double segmentT = checkpointT;
+
+#pragma omp parallel
+            for(;;)
+            {
+#ifndef NO_OMP
+                int threadId = omp_get_thread_num();
+#else
+                int threadId = 0;
+#endif
+                int threadIter = -1;
+#pragma omp critical(IndependentIteration)
+                {
+                    const double time = GetWallTime();
+                    if(aConfig.mMaxTime > 0 ? time >= startT + aConfig.mMaxTime :
+                        iter >= endIter)
+                        done = true;
+                    else if(time < segmentT)
+                        threadIter = iter++;
+                }
+
+                if(threadIter < 0)
+                    break;
+
+                renderers[threadId]->RunIteration(GlobalIteration(aConfig, threadIter));
+                preview.Offer(threadId, *renderers[threadId]);
+            }
+
+            if(!done)
+            {
+                checkpointWriter.Write(aConfig, renderers, cooperative, iter);
+                checkpointT = GetWallTime() + aConfig.mCheckpointTime;
+            }
+        }
+    }
+    else if(aConfig.mMaxTime > 0)
     {
         // Time based loop
 #pragma omp parallel
-        while(clock() < startT + aConfig.mMaxTime*CLOCKS_PER_SEC)
+        while(GetWallTime() < startT + aConfig.mMaxTime)
         {
 #ifndef NO_OMP
             int threadId = omp_get_thread_num();
 #else
             int threadId = 0;
 #endif
-            renderers[threadId]->RunIteration(iter);
+            renderers[threadId]->RunIteration(GlobalIteration(aConfig, iter));
+            preview.Offer(threadId, *renderers[threadId]);
 
 #pragma omp atomic
             iter++; // counts number of iterations
@@ -97,31 +404,58 @@ float render(
     {
         // Iterations based loop
 #pragma omp parallel for
-        for(iter=0; iter < aConfig.mIterations; iter++)
+        for(iter=startIter; iter < endIter; iter++)
         {
 #ifndef NO_OMP
             int threadId = omp_get_thread_num();
 #else
             int threadId = 0;
 #endif
-            renderers[threadId]->RunIteration(iter);
+            renderers[threadId]->RunIteration(GlobalIteration(aConfig, iter));
+            preview.Offer(threadId, *renderers[threadId]);
         }
+
+        iter = endIter;
     }
 
-    clock_t endT = clock();
+    const double endT = GetWallTime();
+
+    // The preview ends with the final image
+    if(preview.IsOpen())
+    {
+        for(int i=0; i<aConfig.mNumThreads; i++)
+            preview.Offer(i, *renderers[i], true);
+
+        preview.Close();
+    }
+
+    // Final checkpoint, so the render can be continued for longer
+    if(checkpoints)
+        checkpointWriter.Write(aConfig, renderers, cooperative, iter);
 
     if(oUsedIterations)
-        *oUsedIterations = iter+1;
+        *oUsedIterations = iter;
+
+    if(oStats)
+    {
+        oStats->Reset();
+        for(int i=0; i<aConfig.mNumThreads; i++)
+            oStats->Add(renderers[i]->GetStats());
+
+        oStats->mIterations = iter - startIter;
+        oStats->mWallTime   = endT - startT;
+    }
 
     // Accumulate from all renderers into a common framebuffer
     int usedRenderers = 0;
 
     // With very low number of iterations and high number of threads
     // not all created renderers had to have been used.
-    // Those must not participate in accumulation.
+    // Those must not participate in accumulation, and neither do those
+    // that accumulated into a shared framebuffer.
     for(int i=0; i<aConfig.mNumThreads; i++)
     {
-        if(!renderers[i]->WasUsed())
+        if(!renderers[i]->WasUsed() || !renderers[i]->OwnsFramebuffer())
             continue;
 
         if(usedRenderers == 0)
@@ -138,8 +472,10 @@ float render(
         usedRenderers++;
     }
 
-    // Scale framebuffer by the number of used renderers
-    aConfig.mFramebuffer->Scale(1.f / usedRenderers);
+    // Scale framebuffer by the number of used renderers. Cooperating
+    // renderers all ran every iteration and hold parts of the same image
+    if(!cooperative)
+        aConfig.mFramebuffer->Scale(1.f / usedRenderers);
 
     // Clean up renderers
     for(int i=0; i<aConfig.mNumThreads; i++)
@@ -147,22 +483,52 @@ float render(
 
     delete [] renderers;
 
-    return float(endT - startT) / CLOCKS_PER_SEC;
+    for(size_t i=0; i<replicas.size(); i++)
+        delete replicas[i];
+
+    return float(endT - startT);
+}
+
+// Saves the image in the format given by extension of aName
+void SaveImage(
+    Framebuffer       &aFramebuffer,
+    const std::string &aName)
+{
+    std::string extension = aName.substr(aName.length() - 3, 3);
+
+    if(extension == "bmp")
+        aFramebuffer.SaveBMP(aName.c_str(), 2.2f /*gamma*/);
+    else if(extension == "hdr")
+        aFramebuffer.SaveHDR(aName.c_str());
+    else if(extension == "exr")
+        aFramebuffer.SaveEXR(aName.c_str());
+    else
+        printf("Used unknown extension %s\n", extension.c_str());
 }
 
 //////////////////////////////////////////////////////////////////////////
 // Generates index.html with all scene-algorithm combinations.
 
+// One scene-algorithm combination of the report
+struct ReportJob
+{
+    int         mSceneID;
+    int         mAlgorithm;
+    std::string mFilename;
+    float       mTime;
+    int         mIterations;
+};
+
 void FullReport(const Config &aConfig)
 {
     // Make a local copy of config
     Config config = aConfig;
 
     config.mFullReport = false;
-
-    // Setup framebuffer and threads
-    Framebuffer fbuffer;
-    config.mFramebuffer = &fbuffer;
+    config.mCheckpointName = "";
+    config.mResumeName     = "";
+    config.mPreviewName    = "";
+    config.mNuma           = false; // jobs share the threads
 
     // Setup html writer
     HtmlWriter html_writer("index.html");
@@ -170,8 +536,6 @@ void FullReport(const Config &aConfig)
     html_writer.mAlgorithmCount = (int)Config::kAlgorithmMax;
     html_writer.mThumbnailSize  = 128;
 
-    int numIterations;
-
     if(SizeOfArray(g_SceneConfigs) != 4)
     {
         printf("Report assumes we have only 4 scenes\n");
@@ -206,30 +570,95 @@ void FullReport(const Config &aConfig)
     std::string splitFiles[4];
     int         borderColors[4];
 
-    clock_t startTime = clock();
+    const double startTime = GetWallTime();
 
-    for(int sceneID=0; sceneID<SizeOfArray(g_SceneConfigs); sceneID++)
+    // Scenes are built once and shared by all their jobs, which only
+    // read them
+    const int sceneCount = SizeOfArray(g_SceneConfigs);
+    Scene scenes[4];
+
+    std::vector<ReportJob> jobs;
+
+    for(int sceneID=0; sceneID<sceneCount; sceneID++)
     {
-        Scene  scene;
-        scene.LoadCornellBox(config.mResolution, g_SceneConfigs[sceneID]);
-        scene.BuildSceneSphere();
-        config.mScene = &scene;
+        scenes[sceneID].LoadCornellBox(config.mResolution, g_SceneConfigs[sceneID]);
+        scenes[sceneID].BuildSceneSphere();
+        scenes[sceneID].BuildLightTable();
 
-        html_writer.AddScene(scene.mSceneName);
-        printf("Scene: %s\n", scene.mSceneName.c_str());
+        for(int algID = 0; algID < (int)Config::kAlgorithmMax; algID++)
+        {
+            ReportJob job;
+            job.mSceneID    = sceneID;
+            job.mAlgorithm  = algID;
+            job.mFilename   = DefaultFilename(g_SceneConfigs[sceneID],
+                scenes[sceneID], Config::Algorithm(algID));
+            job.mTime       = 0;
+            job.mIterations = 0;
+            jobs.push_back(job);
+        }
+    }
 
-        for(uint algID = 0; algID < (uint)Config::kAlgorithmMax; algID++)
+    // Jobs with an iteration budget run side by side, each on its share
+    // of the threads. Jobs with a time budget take all threads one after
+    // another, as they would only get fewer samples otherwise.
+    const int jobCount  = (int)jobs.size();
+    const int slotCount = config.mMaxTime > 0 ? 1 :
+        std::min(config.mNumThreads, jobCount);
+    int       nextJob   = 0;
+
+    printf("Running %d jobs, %d at a time\n", jobCount, slotCount);
+
+#ifndef NO_OMP
+    const int nested = omp_get_nested();
+    omp_set_nested(1);
+#endif
+
+#pragma omp parallel for num_threads(slotCount) schedule(static, 1)
+    for(int slot=0; slot<slotCount; slot++)
+    {
+        // Threads are split as evenly as possible among the slots
+        Config slotConfig = config;
+        slotConfig.mNumThreads = config.mNumThreads / slotCount +
+            (slot < config.mNumThreads % slotCount ? 1 : 0);
+
+        Framebuffer fbuffer;
+        slotConfig.mFramebuffer = &fbuffer;
+
+        for(;;)
         {
-            config.mAlgorithm = Config::Algorithm(algID);
-            printf("Running %s... ", config.GetName(config.mAlgorithm));
-            fflush(stdout);
-            float time = render(config, &numIterations);
-            printf("done in %.2f s\n", time);
+            int jobIdx;
+#pragma omp critical(ReportNextJob)
+            jobIdx = nextJob++;
+
+            if(jobIdx >= jobCount)
+                break;
+
+            ReportJob &job = jobs[jobIdx];
+            slotConfig.mScene     = &scenes[job.mSceneID];
+            slotConfig.mSceneID   = job.mSceneID;
+            slotConfig.mAlgorithm = Config::Algorithm(job.mAlgorithm);
+
+            job.mTime = render(slotConfig, &job.mIterations);
+            fbuffer.SaveBMP(job.mFilename.c_str(), 2.2f);
 
-            std::string filename = DefaultFilename(g_SceneConfigs[sceneID],
-                *config.mScene, config.mAlgorithm);
+#pragma omp critical(ReportPrint)
+            printf("%s: %s done in %.2f s\n", scenes[job.mSceneID].mSceneName.c_str(),
+                Config::GetName(slotConfig.mAlgorithm), job.mTime);
+        }
+    }
 
-            fbuffer.SaveBMP(filename.c_str(), 2.2f);
+#ifndef NO_OMP
+    omp_set_nested(nested);
+#endif
+
+    // Results are added in job order, whichever job finished first
+    for(int sceneID=0; sceneID<sceneCount; sceneID++)
+    {
+        html_writer.AddScene(scenes[sceneID].mSceneName);
+
+        for(int algID = 0; algID < (int)Config::kAlgorithmMax; algID++)
+        {
+            const ReportJob &job = jobs[sceneID * (int)Config::kAlgorithmMax + algID];
 
             // Add thumbnail of the method
             HtmlWriter::BorderColor bcolor = HtmlWriter::kNone;
@@ -240,14 +669,14 @@ void FullReport(const Config &aConfig)
             if(goodAlgorithms[sceneID].count(algID) > 0)
                 bcolor = HtmlWriter::kGreen;
 
-            html_writer.AddRendering(Config::GetName(config.mAlgorithm),
-                filename, time, bcolor,
-                html_writer.MakeMessage("<br/>Iterations: %d", numIterations));
+            html_writer.AddRendering(Config::GetName(Config::Algorithm(algID)),
+                job.mFilename, job.mTime, bcolor,
+                html_writer.MakeMessage("<br/>Iterations: %d", job.mIterations));
 
             if(algID >= (int)Config::kProgressivePhotonMapping)
             {
                 const int idx = algID - Config::kProgressivePhotonMapping;
-                splitFiles[idx]   = filename;
+                splitFiles[idx]   = job.mFilename;
                 borderColors[idx] = bcolor;
             }
         }
@@ -258,8 +687,168 @@ void FullReport(const Config &aConfig)
 
     html_writer.Close();
 
-    clock_t endTime = clock();
-    printf("Whole run took %.2f s\n", float(endTime - startTime) / CLOCKS_PER_SEC);
+    const double endTime = GetWallTime();
+    printf("Whole run took %.2f s\n", endTime - startTime);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmark, renders all scene-algorithm combinations with fixed seeds
+// on an increasing number of threads, and writes bench.json and bench.csv
+// with performance and error of each run.
+
+struct BenchResult
+{
+    std::string mScene;
+    std::string mAlgorithm;
+    int         mThreads;
+    RenderStats mStats;
+    double      mPeakMemoryMB;
+    float       mRmse; // -1 when there is no reference
+};
+
+void SaveBenchmark(const std::vector<BenchResult> &aResults)
+{
+    FILE *json = fopen("bench.json", "w");
+    FILE *csv  = fopen("bench.csv", "w");
+
+    if(!json || !csv)
+    {
+        printf("Could not write bench.json or bench.csv\n");
+        if(json) fclose(json);
+        if(csv)  fclose(csv);
+        return;
+    }
+
+    fprintf(csv, "scene,algorithm,threads,iterations,wall_time,time_per_iteration,"
+        "rays,shadow_rays,mrays_per_second,peak_memory_mb,rmse\n");
+    fprintf(json, "[\n");
+
+    for(size_t i=0; i<aResults.size(); i++)
+    {
+        const BenchResult &r = aResults[i];
+        const double timePerIteration = r.mStats.mWallTime / std::max(1, r.mStats.mIterations);
+
+        fprintf(csv, "%s,%s,%d,%d,%.6f,%.6f,%llu,%llu,%.4f,%.1f,%.6g\n",
+            r.mScene.c_str(), r.mAlgorithm.c_str(), r.mThreads,
+            r.mStats.mIterations, r.mStats.mWallTime, timePerIteration,
+            r.mStats.mRays, r.mStats.mShadowRays, r.mStats.GetMraysPerSecond(),
+            r.mPeakMemoryMB, r.mRmse);
+
+        fprintf(json, "  {\"scene\": \"%s\", \"algorithm\": \"%s\", \"threads\": %d, "
+            "\"iterations\": %d, \"wall_time\": %.6f, \"time_per_iteration\": %.6f, "
+            "\"rays\": %llu, \"shadow_rays\": %llu, \"mrays_per_second\": %.4f, "
+            "\"peak_memory_mb\": %.1f, \"rmse\": ",
+            r.mScene.c_str(), r.mAlgorithm.c_str(), r.mThreads,
+            r.mStats.mIterations, r.mStats.mWallTime, timePerIteration,
+            r.mStats.mRays, r.mStats.mShadowRays, r.mStats.GetMraysPerSecond(),
+            r.mPeakMemoryMB);
+
+        if(r.mRmse < 0)
+            fprintf(json, "null}");
+        else
+            fprintf(json, "%.6g}", r.mRmse);
+
+        fprintf(json, "%s\n", i + 1 < aResults.size() ? "," : "");
+    }
+
+    fprintf(json, "]\n");
+
+    fclose(json);
+    fclose(csv);
+}
+
+void Benchmark(const Config &aConfig)
+{
+    // Make a local copy of config
+    Config config = aConfig;
+
+    config.mBenchmark = false;
+    config.mMaxTime   = -1.f; // fixed amount of work
+    config.mNodeIndex = 0;
+    config.mNodeCount = 1;
+    config.mCheckpointName = "";
+    config.mResumeName     = "";
+    config.mPreviewName    = "";
+    config.mIterations = std::max(1, config.mIterations);
+
+    Framebuffer fbuffer;
+    config.mFramebuffer = &fbuffer;
+
+    // Thread counts 1, 2, 4, ... and all threads
+    std::vector<int> threadCounts;
+    for(int t = 1; t < aConfig.mNumThreads; t *= 2)
+        threadCounts.push_back(t);
+    threadCounts.push_back(aConfig.mNumThreads);
+
+    // Peak memory is measured per run where the system can reset it
+    if(!ResetPeakMemory())
+        printf("Peak memory is that of the whole process so far, not of each run\n");
+
+    std::vector<BenchResult> results;
+
+    for(int sceneID=0; sceneID<SizeOfArray(g_SceneConfigs); sceneID++)
+    {
+        Scene  scene;
+        scene.LoadCornellBox(config.mResolution, g_SceneConfigs[sceneID]);
+        scene.BuildSceneSphere();
+        scene.BuildLightTable();
+        config.mScene    = &scene;
+        config.mSceneID  = sceneID;
+        config.mMeshFile = ""; // benchmark scenes have no mesh
+
+        printf("Scene: %s\n", scene.mSceneName.c_str());
+
+        for(uint algID = 0; algID < (uint)Config::kAlgorithmMax; algID++)
+        {
+            config.mAlgorithm = Config::Algorithm(algID);
+
+            // Reference has the default name, with .pfm instead of .bmp
+            std::string refName = DefaultFilename(g_SceneConfigs[sceneID],
+                scene, config.mAlgorithm);
+            refName = aConfig.mBenchRefPrefix +
+                refName.substr(0, refName.length() - 4) + ".pfm";
+
+            Framebuffer reference;
+            const bool hasReference = reference.LoadPFM(refName.c_str());
+
+            for(size_t t=0; t<threadCounts.size(); t++)
+            {
+                config.mNumThreads = threadCounts[t];
+
+                printf("Running %s on %d thread(s)... ",
+                    config.GetName(config.mAlgorithm), config.mNumThreads);
+                fflush(stdout);
+
+                BenchResult result;
+                ResetPeakMemory();
+                render(config, NULL, &result.mStats);
+
+                result.mScene        = scene.mSceneAcronym;
+                result.mAlgorithm    = Config::GetAcronym(config.mAlgorithm);
+                result.mThreads      = config.mNumThreads;
+                result.mPeakMemoryMB = GetPeakMemoryMB();
+                result.mRmse         = hasReference ? fbuffer.Rmse(reference) : -1.f;
+
+                printf("%.2f Mrays/s, %.3f s/iteration",
+                    result.mStats.GetMraysPerSecond(),
+                    result.mStats.mWallTime / result.mStats.mIterations);
+                if(result.mRmse >= 0)
+                    printf(", RMSE %.5f", result.mRmse);
+                printf("\n");
+
+                if(!hasReference && t == 0)
+                {
+                    fbuffer.SavePFM(refName.c_str());
+                    printf("Saved reference %s\n", refName.c_str());
+                }
+
+                results.push_back(result);
+            }
+        }
+    }
+
+    SaveBenchmark(results);
+    printf("Benchmark written to bench.json and bench.csv\n");
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -267,8 +856,8 @@ void FullReport(const Config &aConfig)
 
 int main(int argc, const char *argv[])
 {
-    // Warns when not using C++11 Mersenne Twister
-    PrintRngWarning();
+    // Warns when checkpoints and previews have no C++11 background thread
+    PrintCxx11Warning();
 
     // Setups config based on command line
     Config config;
@@ -288,6 +877,22 @@ int main(int argc, const char *argv[])
         return 0;
     }
 
+    if(config.mBenchmark)
+    {
+        Benchmark(config);
+        return 0;
+    }
+
+    if(config.mMerge)
+    {
+        Framebuffer merged;
+        if(!MergeNodeImages(config, merged))
+            return 1;
+
+        SaveImage(merged, config.mOutputName);
+        return 0;
+    }
+
     // When some error has been encountered, exits
     if(config.mScene == NULL)
         return 1;
@@ -302,22 +907,52 @@ int main(int argc, const char *argv[])
         printf("Target:  %g seconds render time\n", config.mMaxTime);
     else
         printf("Target:  %d iteration(s)\n", config.mIterations);
+    if(!config.mResumeName.empty())
+        printf("Resume:  %s\n", config.mResumeName.c_str());
+    if(config.mAdaptiveError > 0)
+        printf("Target:  %g relative pixel error (adaptive)\n", config.mAdaptiveError);
 
     // Renders the image
     printf("Running: %s... ", config.GetName(config.mAlgorithm));
     fflush(stdout);
-    float time = render(config);
+    RenderStats stats;
+    int usedIterations = 0;
+    float time = render(config, &usedIterations, &stats);
+
+    if(time < 0)
+    {
+        delete config.mScene;
+        return 1;
+    }
+
     printf("done in %.2f s\n", time);
 
-    // Saves the image
-    std::string extension = config.mOutputName.substr(config.mOutputName.length() - 3, 3);
+    if(config.mAdaptiveError > 0)
+        printf("Used:    %d iteration(s)\n", usedIterations);
 
-    if(extension == "bmp")
-        fbuffer.SaveBMP(config.mOutputName.c_str(), 2.2f /*gamma*/);
-    else if(extension == "hdr")
-        fbuffer.SaveHDR(config.mOutputName.c_str());
+    // Prints statistics, and saves them when requested
+    if(config.mStatsName.empty())
+    {
+        printf("Rays:    %.2f Mrays/s\n", stats.GetMraysPerSecond());
+    }
     else
-        printf("Used unknown extension %s\n", extension.c_str());
+    {
+        stats.Print();
+        if(!stats.SaveJSON(config.mStatsName.c_str()))
+            printf("Could not write statistics to %s\n", config.mStatsName.c_str());
+    }
+
+    // Saves the image, and the node image for merging
+    SaveImage(fbuffer, config.mOutputName);
+
+    if(config.mNodeCount > 1)
+    {
+        const std::string nodeName = config.mOutputName.substr(
+            0, config.mOutputName.length() - 4) + ".node";
+
+        if(!SaveNodeImage(nodeName, config, fbuffer, usedIterations))
+            printf("Could not write node image %s\n", nodeName.c_str());
+    }
 
     // Scene cleanup
     delete config.mScene;
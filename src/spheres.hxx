@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __SPHERES_HXX__
+#define __SPHERES_HXX__
+
+#include <vector>
+#include "math.hxx"
+#include "ray.hxx"
+#include "geometry.hxx"
+#include "bvh.hxx"
+#include "primitives.hxx"
+
+//////////////////////////////////////////////////////////////////////////
+// All spheres of a scene as one object, with a BVH over them whose leaves
+// store Sphere4 blocks, tested four at a time
+
+class SphereSet : public BvhBase<SphereSet>
+{
+    friend class BvhBase<SphereSet>;
+
+public:
+
+    // Spheres are added first, then Build makes the BVH
+    void Add(
+        const Vec3f &aCenter,
+        float       aRadius,
+        int         aMatID)
+    {
+        SphereDesc sphere = { aCenter, aRadius, aMatID };
+        mSpheres.push_back(sphere);
+    }
+
+    void Build()
+    {
+        std::vector<BuildItem> items(mSpheres.size());
+        for(int i=0; i<(int)mSpheres.size(); i++)
+        {
+            items[i].mBBoxMin = mSpheres[i].mCenter - Vec3f(mSpheres[i].mRadius);
+            items[i].mBBoxMax = mSpheres[i].mCenter + Vec3f(mSpheres[i].mRadius);
+            items[i].mIndex   = i;
+        }
+
+        BuildNodes(items, kPrimitiveLanes);
+
+        // Each leaf gets its own blocks, it then indexes the first one
+        mBlocks.clear();
+
+        for(int n=0; n<(int)mNodeStorage.size(); n++)
+        {
+            Node &node = mNodeStorage[n];
+            if(node.mCount == 0)
+                continue;
+
+            const int first = (int)mBlocks.size();
+
+            for(int i=0; i<node.mCount; i++)
+            {
+                const int lane = i % kPrimitiveLanes;
+                if(lane == 0)
+                    mBlocks.push_back(Sphere4());
+
+                const SphereDesc &sphere = mSpheres[items[node.mOffset + i].mIndex];
+                mBlocks.back().Set(lane, sphere.mCenter, sphere.mRadius, sphere.mMatID);
+            }
+
+            mBlocks.back().FillFrom((node.mCount - 1) % kPrimitiveLanes);
+            node.mOffset = first;
+        }
+    }
+
+    bool Empty() const
+    {
+        return mSpheres.empty();
+    }
+
+private:
+
+    typedef BvhNoLeafRay LeafRay;
+
+    static int GetBlockCount(int aSphereCount)
+    {
+        return (aSphereCount + kPrimitiveLanes - 1) / kPrimitiveLanes;
+    }
+
+    bool IntersectLeaf(
+        const Node    &aLeaf,
+        const Ray     &aRay,
+        const LeafRay &,
+        Isect         &oResult) const
+    {
+        bool anyIntersection = false;
+
+        const int end = aLeaf.mOffset + GetBlockCount(aLeaf.mCount);
+        for(int i=aLeaf.mOffset; i<end; i++)
+        {
+            if(mBlocks[i].Intersect(aRay, oResult))
+                anyIntersection = true;
+        }
+
+        return anyIntersection;
+    }
+
+    bool IntersectLeafP(
+        const Node    &aLeaf,
+        const Ray     &aRay,
+        const LeafRay &,
+        Isect         &oResult) const
+    {
+        const int end = aLeaf.mOffset + GetBlockCount(aLeaf.mCount);
+        for(int i=aLeaf.mOffset; i<end; i++)
+        {
+            if(mBlocks[i].Intersect(aRay, oResult))
+                return true;
+        }
+
+        return false;
+    }
+
+    void IntersectLeafN(
+        const Node    &aLeaf,
+        const Ray     *aRays,
+        const LeafRay *aLeafRays,
+        Isect         *aoResults,
+        char          *aoHits,
+        int,
+        int           aMask) const
+    {
+        for(int j=0; j<kPacketSize; j++)
+        {
+            if(!(aMask & (1 << j)))
+                continue;
+
+            if(IntersectLeaf(aLeaf, aRays[j], aLeafRays[j], aoResults[j]))
+                aoHits[j] = 1;
+        }
+    }
+
+    void OccludedLeafN(
+        const Node    &aLeaf,
+        const Ray     *aRays,
+        const LeafRay *aLeafRays,
+        Isect         *aoResults,
+        char          *aoOccluded,
+        int,
+        int           aMask) const
+    {
+        for(int j=0; j<kPacketSize; j++)
+        {
+            if(!(aMask & (1 << j)))
+                continue;
+
+            if(!aoOccluded[j] && IntersectLeafP(aLeaf, aRays[j], aLeafRays[j], aoResults[j]))
+                aoOccluded[j] = 1;
+        }
+    }
+
+private:
+
+    struct SphereDesc
+    {
+        Vec3f mCenter;
+        float mRadius;
+        int   mMatID;
+    };
+
+    std::vector<SphereDesc> mSpheres; // As added, for building
+    std::vector<Sphere4>    mBlocks;
+};
+
+#endif //__SPHERES_HXX__
@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2012, Tomas Davidovic (http://www.davidovic.cz)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+ * OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * (The above is MIT License: http://en.wikipedia.org/wiki/MIT_License)
+ */
+
+#ifndef __STATS_HXX__
+#define __STATS_HXX__
+
+#include <stdio.h>
+#include <string>
+#include "math.hxx"
+
+#ifndef NO_OMP
+#include <omp.h>
+#else
+#include <chrono>
+#endif
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+// Monotonic wall-clock time in seconds, clock() measures CPU time of
+// all threads together
+
+double GetWallTime()
+{
+#ifndef NO_OMP
+    return omp_get_wtime();
+#else
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Starts a new peak for GetPeakMemoryMB, so that it measures what follows
+// (e.g., one benchmark run) on its own. Only Linux can reset the peak,
+// elsewhere it stays the peak of the whole process and false is returned
+bool ResetPeakMemory()
+{
+#if defined(__linux__)
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if(!file)
+        return false;
+
+    const bool written = fputs("5", file) >= 0;
+    return (fclose(file) == 0) && written;
+#else
+    return false;
+#endif
+}
+
+// Peak resident memory since the last successful ResetPeakMemory, or of
+// the whole process so far, in megabytes
+double GetPeakMemoryMB()
+{
+#if defined(__linux__)
+    // VmHWM is what ResetPeakMemory resets, ru_maxrss is not
+    FILE *file = fopen("/proc/self/status", "r");
+    if(file)
+    {
+        char   line[256];
+        double peakKB = -1;
+        while(fgets(line, sizeof(line), file))
+        {
+            if(sscanf(line, "VmHWM: %lf", &peakKB) == 1)
+                break;
+        }
+        fclose(file);
+
+        if(peakKB >= 0)
+            return peakKB / 1024.0;
+    }
+#endif
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return double(counters.PeakWorkingSetSize) / (1024.0 * 1024.0);
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return double(usage.ru_maxrss) / (1024.0 * 1024.0); // bytes
+#else
+    return double(usage.ru_maxrss) / 1024.0; // kilobytes
+#endif
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Rendering statistics. Every renderer keeps its own, so no
+// synchronization is needed, and render() sums them up at the end.
+// Phase times are in seconds summed over threads, the connection and
+// merging times are measured only with detailed statistics, as they
+// are taken at every camera vertex.
+
+struct RenderStats
+{
+    enum Phase
+    {
+        kLightTracing = 0,
+        kGridBuild,
+        kCameraTracing,
+        kConnections, // Part of camera tracing
+        kMerging,     // Part of camera tracing
+        kPhaseMax
+    };
+
+    RenderStats()
+    {
+        Reset();
+    }
+
+    void Reset()
+    {
+        for(int i=0; i<kPhaseMax; i++)
+            mPhaseTime[i] = 0;
+
+        mRays          = 0;
+        mShadowRays    = 0;
+        mMerges        = 0;
+        mLightVertices = 0;
+        mIterations    = 0;
+        mWallTime      = 0;
+    }
+
+    void Add(const RenderStats &aOther)
+    {
+        for(int i=0; i<kPhaseMax; i++)
+            mPhaseTime[i] += aOther.mPhaseTime[i];
+
+        mRays          += aOther.mRays;
+        mShadowRays    += aOther.mShadowRays;
+        mMerges        += aOther.mMerges;
+        mLightVertices += aOther.mLightVertices;
+    }
+
+    static const char* GetPhaseName(int aPhase)
+    {
+        static const char *names[kPhaseMax] = {
+            "light_tracing", "grid_build", "camera_tracing",
+            "connections", "merging" };
+
+        return names[aPhase];
+    }
+
+    // All rays traced per second of wall-clock time, in millions
+    double GetMraysPerSecond() const
+    {
+        if(mWallTime <= 0)
+            return 0;
+
+        return double(mRays + mShadowRays) / mWallTime * 1e-6;
+    }
+
+    void Print() const
+    {
+        printf("Time:    %.3f s wall clock, %d iteration(s)\n", mWallTime, mIterations);
+        printf("Rays:    %llu + %llu shadow (%.2f Mrays/s)\n",
+            mRays, mShadowRays, GetMraysPerSecond());
+
+        if(mLightVertices > 0 || mMerges > 0)
+        {
+            printf("Stored:  %llu light vertices, %llu merges\n",
+                mLightVertices, mMerges);
+        }
+
+        printf("Phases:  (thread-seconds)\n");
+        for(int i=0; i<kPhaseMax; i++)
+        {
+            if(mPhaseTime[i] > 0)
+                printf("  %-15s %9.3f\n", GetPhaseName(i), mPhaseTime[i]);
+        }
+    }
+
+    // Writes the statistics as a JSON object
+    bool SaveJSON(const char *aFilename) const
+    {
+        FILE *f = fopen(aFilename, "w");
+        if(!f)
+            return false;
+
+        fprintf(f, "{\n");
+        fprintf(f, "  \"wall_time\": %.6f,\n", mWallTime);
+        fprintf(f, "  \"iterations\": %d,\n", mIterations);
+        fprintf(f, "  \"rays\": %llu,\n", mRays);
+        fprintf(f, "  \"shadow_rays\": %llu,\n", mShadowRays);
+        fprintf(f, "  \"mrays_per_second\": %.4f,\n", GetMraysPerSecond());
+        fprintf(f, "  \"light_vertices\": %llu,\n", mLightVertices);
+        fprintf(f, "  \"merges\": %llu,\n", mMerges);
+        fprintf(f, "  \"phase_time\": {\n");
+        for(int i=0; i<kPhaseMax; i++)
+        {
+            fprintf(f, "    \"%s\": %.6f%s\n", GetPhaseName(i), mPhaseTime[i],
+                i + 1 < kPhaseMax ? "," : "");
+        }
+        fprintf(f, "  }\n");
+        fprintf(f, "}\n");
+
+        fclose(f);
+        return true;
+    }
+
+public:
+
+    double mPhaseTime[kPhaseMax];
+    uint64 mRays;          // Intersection rays (light, camera, and primary)
+    uint64 mShadowRays;    // Visibility tests of connections and lights
+    uint64 mMerges;        // Light vertices within merging radius
+    uint64 mLightVertices; // Light vertices stored
+    int    mIterations;    // Set by render()
+    double mWallTime;      // Set by render()
+};
+
+// Adds wall-clock time from construction to destruction to a phase
+class PhaseTimer
+{
+public:
+
+    PhaseTimer(RenderStats &aoStats, RenderStats::Phase aPhase, bool aEnabled = true) :
+        mTime(aEnabled ? &aoStats.mPhaseTime[aPhase] : NULL),
+        mStart(aEnabled ? GetWallTime() : 0)
+    {}
+
+    ~PhaseTimer()
+    {
+        if(mTime)
+            *mTime += GetWallTime() - mStart;
+    }
+
+private:
+
+    double *mTime;
+    double mStart;
+};
+
+#endif //__STATS_HXX__
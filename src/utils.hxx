@@ -27,6 +27,9 @@
 
 #include <vector>
 #include <cmath>
+#include <string>
+#include <fstream>
+#include <string.h>
 #include "math.hxx"
 
 #define EPS_COSINE 1e-6f
@@ -237,6 +240,157 @@ float UniformSpherePdfW()
 }
 
 
+//////////////////////////////////////////////////////////////////////////
+// Octahedral encoding of unit vectors into 2 x 16 bits.
+// The direction is projected onto the octahedron |x| + |y| + |z| = 1,
+// the lower half of which is folded over the upper one. This maps the
+// sphere to the square [-1, 1]^2, which is then quantized.
+
+uint EncodeOctahedral(const Vec3f &aDir)
+{
+    const float invNorm = 1.f /
+        (std::abs(aDir.x) + std::abs(aDir.y) + std::abs(aDir.z));
+
+    float u = aDir.x * invNorm;
+    float v = aDir.y * invNorm;
+
+    if(aDir.z < 0.f)
+    {
+        const float uFold = (1.f - std::abs(v)) * (u >= 0.f ? 1.f : -1.f);
+        const float vFold = (1.f - std::abs(u)) * (v >= 0.f ? 1.f : -1.f);
+        u = uFold;
+        v = vFold;
+    }
+
+    const uint uQ = uint((std::min(std::max(u, -1.f), 1.f) * 0.5f + 0.5f) * 65535.f + 0.5f);
+    const uint vQ = uint((std::min(std::max(v, -1.f), 1.f) * 0.5f + 0.5f) * 65535.f + 0.5f);
+
+    return uQ | (vQ << 16);
+}
+
+Vec3f DecodeOctahedral(const uint aCode)
+{
+    const float u = float(aCode & 0xffff) * (2.f / 65535.f) - 1.f;
+    const float v = float(aCode >> 16)    * (2.f / 65535.f) - 1.f;
+
+    Vec3f dir(u, v, 1.f - std::abs(u) - std::abs(v));
+
+    if(dir.z < 0.f)
+    {
+        dir.x = (1.f - std::abs(v)) * (u >= 0.f ? 1.f : -1.f);
+        dir.y = (1.f - std::abs(u)) * (v >= 0.f ? 1.f : -1.f);
+    }
+
+    return Normalize(dir);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// IEEE 754 half precision floats (1 sign, 5 exponent and 10 mantissa bits)
+// stored in ushort. Conversion rounds to nearest even, values too large
+// for half become infinity.
+
+ushort FloatToHalf(const float aValue)
+{
+    uint bits;
+    memcpy(&bits, &aValue, sizeof(bits));
+
+    const uint sign     = (bits >> 16) & 0x8000u;
+    const uint absBits  = bits & 0x7fffffffu;
+
+    // NaN stays NaN (keeping it quiet), infinity stays infinity
+    if(absBits >= 0x7f800000u)
+        return ushort(sign | 0x7c00u | (absBits > 0x7f800000u ? 0x200u : 0u));
+
+    // Overflow, the largest half is 65504
+    if(absBits >= 0x477ff000u)
+        return ushort(sign | 0x7c00u);
+
+    // Normalized half
+    if(absBits >= 0x38800000u)
+    {
+        const uint mantissa = absBits + 0xfffu + ((absBits >> 13) & 1u);
+        return ushort(sign | ((mantissa - 0x38000000u) >> 13));
+    }
+
+    // Denormalized half or zero
+    if(absBits < 0x33000000u)
+        return ushort(sign);
+
+    const uint exponent = absBits >> 23;
+    const uint mantissa = (absBits & 0x7fffffu) | 0x800000u;
+    const uint shift    = 126u - exponent; // 14 to 24
+
+    const uint halfMant = mantissa >> shift;
+    const uint rest     = mantissa & ((1u << shift) - 1u);
+    const uint halfway  = 1u << (shift - 1u);
+    const uint roundUp  = (rest > halfway || (rest == halfway && (halfMant & 1u))) ? 1u : 0u;
+
+    return ushort(sign | (halfMant + roundUp));
+}
+
+float HalfToFloat(const ushort aHalf)
+{
+    const uint sign     = uint(aHalf & 0x8000u) << 16;
+    const uint exponent = (aHalf >> 10) & 0x1fu;
+    uint       mantissa = aHalf & 0x3ffu;
+    uint       bits;
+
+    if(exponent == 0x1f)
+    {
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    }
+    else if(exponent != 0)
+    {
+        bits = sign | ((exponent + 112u) << 23) | (mantissa << 13);
+    }
+    else if(mantissa == 0)
+    {
+        bits = sign;
+    }
+    else
+    {
+        // Denormalized half, renormalize
+        uint e = 113u;
+        while((mantissa & 0x400u) == 0)
+        {
+            mantissa <<= 1;
+            e--;
+        }
+        bits = sign | (e << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// bfloat16, the upper 16 bits of a float (1 sign, 8 exponent and 7
+// mantissa bits) stored in ushort. Unlike half it keeps the whole range
+// of floats, at the cost of precision. Conversion rounds to nearest even.
+
+ushort FloatToBFloat16(const float aValue)
+{
+    uint bits;
+    memcpy(&bits, &aValue, sizeof(bits));
+
+    // NaN stays NaN, rounding could turn it into infinity
+    if((bits & 0x7fffffffu) > 0x7f800000u)
+        return ushort((bits >> 16) | 0x40u);
+
+    bits += 0x7fffu + ((bits >> 16) & 1u);
+    return ushort(bits >> 16);
+}
+
+float BFloat16ToFloat(const ushort aBFloat16)
+{
+    const uint bits = uint(aBFloat16) << 16;
+
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Utilities for converting PDF between Area (A) and Solid angle (W)
 // WtoA = PdfW * cosine / distance_squared
@@ -258,4 +412,134 @@ float PdfAtoW(
     return aPdfA * Sqr(aDist) / std::abs(aCosThere);
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Alias table (Walker, Vose), samples an index proportionally to given
+// weights in constant time. Each index keeps its bin with probability
+// mKeepProbs, and hands it to mAliases otherwise.
+
+class AliasTable
+{
+public:
+
+    // Weights need not be normalized, all zero weights mean uniform
+    void Setup(const std::vector<float> &aWeights)
+    {
+        const int count = (int)aWeights.size();
+
+        double total = 0;
+        for(int i=0; i<count; i++)
+            total += aWeights[i];
+
+        mPdfs.resize(count);
+        mKeepProbs.resize(count);
+        mAliases.resize(count);
+
+        if(count == 0)
+            return;
+
+        // Weights scaled so that their mean is 1, in double so that
+        // equal weights stay exactly 1
+        std::vector<double> scaled(count);
+        std::vector<int>    small, large;
+
+        for(int i=0; i<count; i++)
+        {
+            mPdfs[i]  = total > 0 ? float(aWeights[i] / total) : 1.f / count;
+            scaled[i] = total > 0 ? aWeights[i] * count / total : 1.0;
+            mAliases[i] = i;
+
+            if(scaled[i] < 1.0)
+                small.push_back(i);
+            else
+                large.push_back(i);
+        }
+
+        // Fills each small bin up with a large one
+        while(!small.empty() && !large.empty())
+        {
+            const int s = small.back(); small.pop_back();
+            const int l = large.back();
+
+            mKeepProbs[s] = float(scaled[s]);
+            mAliases[s]   = l;
+
+            scaled[l] -= 1.0 - scaled[s];
+            if(scaled[l] < 1.0)
+            {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // What remains is 1 up to rounding
+        for(size_t i=0; i<large.size(); i++)
+            mKeepProbs[large[i]] = 1.f;
+        for(size_t i=0; i<small.size(); i++)
+            mKeepProbs[small[i]] = 1.f;
+    }
+
+    // Index picked by random number in [0, 1). The integer part of the
+    // scaled number selects the bin, the fraction whether to take its alias.
+    int Sample(const float aRandom) const
+    {
+        const int   count  = (int)mAliases.size();
+        const float scaled = aRandom * count;
+        const int   bin    = std::min(int(scaled), count - 1);
+
+        return (scaled - bin) < mKeepProbs[bin] ? bin : mAliases[bin];
+    }
+
+    // Probability of Sample returning aIndex
+    float GetPdf(const int aIndex) const
+    {
+        return mPdfs[aIndex];
+    }
+
+    int GetSize() const
+    {
+        return (int)mPdfs.size();
+    }
+
+private:
+
+    std::vector<float> mPdfs;
+    std::vector<float> mKeepProbs;
+    std::vector<int>   mAliases;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Size and FNV-1a hash of file contents, both 0 when it cannot be read
+void HashFile(
+    const std::string &aFilename,
+    long long         &oSize,
+    long long         &oHash)
+{
+    oSize = 0;
+    oHash = 0;
+
+    std::ifstream file(aFilename.c_str(), std::ios::binary);
+    if(!file)
+        return;
+
+    unsigned long long hash = 14695981039346656037ull;
+    long long size = 0;
+    char buffer[1 << 16];
+
+    while(file)
+    {
+        file.read(buffer, sizeof(buffer));
+        const std::streamsize count = file.gcount();
+
+        for(std::streamsize i=0; i<count; i++)
+        {
+            hash ^= (unsigned char)buffer[i];
+            hash *= 1099511628211ull;
+        }
+        size += count;
+    }
+
+    oSize = size;
+    oHash = (long long)hash;
+}
+
 #endif //__UTILS_HXX__
@@ -28,6 +28,7 @@
 #include <vector>
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 #include "renderer.hxx"
 #include "bsdf.hxx"
 #include "rng.hxx"
@@ -58,8 +59,129 @@
 // where ## is the equation number. 
 //
 
+// Algorithms implemented by VertexCM
+enum VertexCMAlgorithm
+{
+    // light vertices contribute to camera,
+    // No MIS weights (dVCM, dVM, dVC all ignored)
+    kLightTrace = 0,
+
+    // Camera and light vertices merged on first non-specular surface from camera.
+    // Cannot handle mixed specular + non-specular materials.
+    // No MIS weights (dVCM, dVM, dVC all ignored)
+    kPpm,
+
+    // Camera and light vertices merged on along full path.
+    // dVCM and dVM used for MIS
+    kBpm,
+
+    // Standard bidirectional path tracing
+    // dVCM and dVC used for MIS
+    kBpt,
+
+    // Vertex connection and mering
+    // dVCM, dVM, and dVC used for MIS
+    kVcm
+};
+
+// Whether PPM can render aScene, i.e., no material mixes specular and
+// non-specular BSDFs. Prints a warning when it cannot.
+bool SupportsPpm(const Scene &aScene)
+{
+    for(int i = 0; i < aScene.GetMaterialCount(); ++i)
+    {
+        const Material &mat = aScene.GetMaterial(i);
+
+        const bool hasNonSpecular =
+            (mat.mDiffuseReflectance.Max() > 0) ||
+            (mat.mPhongReflectance.Max() > 0);
+
+        const bool hasSpecular =
+            (mat.mMirrorReflectance.Max() > 0) ||
+            (mat.mIOR > 0);
+
+        if(hasNonSpecular && hasSpecular)
+        {
+            printf(
+                "*WARNING* Our PPM implementation cannot handle materials mixing\n"
+                "Specular and NonSpecular BSDFs. The extension would be\n"
+                "fairly straightforward. In SampleScattering for camera sub-paths\n"
+                "limit the considered events to Specular only.\n"
+                "Merging will use non-specular components, scattering will be specular.\n"
+                "If there is no specular component, the ray will terminate.\n\n");
+
+            printf("We are now switching from *PPM* to *BPM*, which can handle the scene\n\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Light vertex values are stored either as floats, or with compact
+// vertices (--compact-vertices) in 16 bits, as bfloat16 (FloatToBFloat16).
+// That keeps the range MIS quantities and throughputs need, with about
+// 3 significant digits. Both convert to and from float implicitly.
+
+template<bool tCompact>
+class VertexFloat
+{
+public:
+    VertexFloat() {}
+    VertexFloat(const float aValue) : mValue(aValue) {}
+
+    operator float() const { return mValue; }
+
+private:
+    float mValue;
+};
+
+template<>
+class VertexFloat<true>
+{
+public:
+    VertexFloat() {}
+    VertexFloat(const float aValue) : mBits(FloatToBFloat16(aValue)) {}
+
+    operator float() const { return BFloat16ToFloat(mBits); }
+
+private:
+    ushort mBits;
+};
+
+template<bool tCompact>
+class VertexColor
+{
+public:
+    VertexColor() {}
+    VertexColor(const Vec3f &aValue) : mX(aValue.x), mY(aValue.y), mZ(aValue.z) {}
+
+    operator Vec3f() const { return Vec3f(mX, mY, mZ); }
+
+private:
+    VertexFloat<tCompact> mX, mY, mZ;
+};
+
+// The algorithm, and the power of the MIS heuristic, are template parameters,
+// so every algorithm is compiled without the branches and MIS quantities
+// it does not use. So is the storage of light vertices.
+template<int tAlgorithm, int tMisPower = 1, bool tCompactVertices = false>
 class VertexCM : public AbstractRenderer
 {
+    enum
+    {
+        kUseVM          = tAlgorithm == kPpm || tAlgorithm == kBpm || tAlgorithm == kVcm,
+        kUseVC          = tAlgorithm == kBpt || tAlgorithm == kVcm,
+        kLightTraceOnly = tAlgorithm == kLightTrace,
+        kUsePpm         = tAlgorithm == kPpm,
+
+        // Which MIS quantities have to be tracked
+        kUseDVCM        = kUseVC || (kUseVM && !kUsePpm),
+        kUseDVC         = kUseVC,
+        kUseDVM         = kUseVM && !kUsePpm
+    };
+
     // The sole point of this structure is to make carrying around the ray baggage easier.
     struct SubPathState
     {
@@ -73,36 +195,181 @@ class VertexCM : public AbstractRenderer
         float dVCM; // MIS quantity used for vertex connection and merging
         float dVC;  // MIS quantity used for vertex connection
         float dVM;  // MIS quantity used for vertex merging
+
+        uint  mDimension; // Where its samples continue, see AbstractSampler
     };
 
-    // Path vertex, used for merging and connection
-    template<bool tFromLight>
-    struct PathVertex
+    // Light vertex, used for merging and connection. Its position lives in
+    // a separate array (see LightVertexArray), so that the range search
+    // touches only positions. The rest is read once a vertex is used;
+    // connections rebuild the light BSDF from normal, direction and material.
+    // With tCompactVertices, the floats take 16 bits each, making the
+    // vertex 28 bytes instead of 40.
+    struct LightVertex
     {
-        Vec3f mHitpoint;   // Position of the vertex
-        Vec3f mThroughput; // Path throughput (including emission)
-        uint  mPathLength; // Number of segments between source and vertex
+        typedef VertexFloat<tCompactVertices> Float;
+        typedef VertexColor<tCompactVertices> Color;
+
+        uint   mNormal;           // Octahedral encoded shading normal
+        uint   mDirFix;           // Octahedral encoded incoming direction (world)
+        Color  mThroughput;       // Path throughput (including emission)
+        Float  mContinuationProb; // Russian roulette probability of light BSDF
+        ushort mMaterialID;       // Id of scene material
+        ushort mPathLength;       // Number of segments between source and vertex
+
+        Float dVCM; // MIS quantity used for vertex connection and merging
+        Float dVC;  // MIS quantity used for vertex connection
+        Float dVM;  // MIS quantity used for vertex merging
+    };
 
-        // Stores all required local information, including incoming direction.
-        BSDF<tFromLight> mBsdf;
+    // Positions and the remaining data of stored light vertices
+    struct LightVertexArray
+    {
+        std::vector<Vec3f>       mPositions;
+        std::vector<LightVertex> mVertices;
 
-        float dVCM; // MIS quantity used for vertex connection and merging
-        float dVC;  // MIS quantity used for vertex connection
-        float dVM;  // MIS quantity used for vertex merging
+        int Size() const { return (int)mPositions.size(); }
 
-        // Used by HashGrid
-        const Vec3f& GetPosition() const
+        void Clear()
         {
-            return mHitpoint;
+            mPositions.clear();
+            mVertices.clear();
         }
-    };
 
-    typedef PathVertex<false> CameraVertex;
-    typedef PathVertex<true>  LightVertex;
+        void Reserve(int aSize)
+        {
+            mPositions.reserve(aSize);
+            mVertices.reserve(aSize);
+        }
+
+        void Resize(int aSize)
+        {
+            mPositions.resize(aSize);
+            mVertices.resize(aSize);
+        }
+
+        void Swap(LightVertexArray &aOther)
+        {
+            mPositions.swap(aOther.mPositions);
+            mVertices.swap(aOther.mVertices);
+        }
+
+        void Add(const Vec3f &aPosition, const LightVertex &aVertex)
+        {
+            mPositions.push_back(aPosition);
+            mVertices.push_back(aVertex);
+        }
+    };
 
     typedef BSDF<false>       CameraBSDF;
     typedef BSDF<true>        LightBSDF;
 
+    // Number of light paths in one batch of the cooperative light pass
+    enum { kLightBatchSize = 1024 };
+
+    // Maximal number of paths traced together in wavefront mode
+    enum { kWavefrontSize = 4096 };
+
+    // Paths traced together in wavefront mode. States are indexed by path
+    // within wave, rays and hits by position of the path in mActive.
+    struct Wavefront
+    {
+        std::vector<SubPathState> mStates;
+        std::vector<Vec2f>        mScreenSamples; // Camera paths only
+        std::vector<Vec3f>        mColors;        // Camera paths only
+        std::vector<Ray>          mRays;
+        std::vector<Isect>        mIsects;
+        std::vector<char>         mHits;
+
+        std::vector<int>          mPaths;      // Camera paths only, all to trace
+        std::vector<int>          mActive;     // Paths not yet terminated
+        std::vector<int>          mNextActive;
+        std::vector<int>          mBinned;     // mActive positions binned by material
+        std::vector<int>          mKeys;       // Bin of each active path
+        std::vector<int>          mBinStarts;
+
+        LightVertexArray          mVertices;    // Stored in shading order
+        std::vector<int>          mVertexPaths; // Path of each of mVertices
+
+        void Resize(int aPathCount)
+        {
+            mStates.resize(aPathCount);
+            mRays.resize(aPathCount);
+            mIsects.resize(aPathCount);
+            mHits.resize(aPathCount);
+            mScreenSamples.resize(aPathCount);
+            mColors.resize(aPathCount);
+            mActive.resize(aPathCount);
+        }
+    };
+
+    // Vertex connections of one camera vertex, with their shadow rays
+    struct Connections
+    {
+        std::vector<Vec3f> mContribs; // Contribution when not occluded
+        std::vector<Ray>   mRays;
+        std::vector<Isect> mIsects;
+        std::vector<char>  mOccluded;
+
+        void Clear()
+        {
+            mContribs.clear();
+            mRays.clear();
+            mIsects.clear();
+        }
+
+        void Add(
+            const Vec3f &aContrib,
+            const Ray   &aShadowRay,
+            const Isect &aShadowIsect)
+        {
+            mContribs.push_back(aContrib);
+            mRays.push_back(aShadowRay);
+            mIsects.push_back(aShadowIsect);
+        }
+    };
+
+    // Light sub-paths of one iteration. In cooperative rendering all
+    // renderers trace into, and read from, the main renderer's ones.
+    struct LightPaths
+    {
+        LightVertexArray mLightVertices; //!< Stored light vertices
+
+        // For light path belonging to pixel index [x] it stores
+        // where it's light vertices end (begin is at [x-1])
+        std::vector<int> mPathEnds;
+        HashGrid         mHashGrid;
+
+        // Vertices of each light batch, gathered into mLightVertices
+        std::vector<LightVertexArray> mBatchVertices;
+
+        // When vertices are sorted for merging, this maps the index of a
+        // vertex in path order (as in mPathEnds) to its stored position.
+        // Empty when vertices are stored in path order.
+        std::vector<int> mStoredIndex;
+        std::vector<int> mSortOrder;       // Path order index of sorted vertices
+        LightVertexArray mSortedVertices;  // Scratch space for sorting
+
+        std::vector<int> mBatchOffsets;    // First vertex of each light batch
+        int              mMaxVertexCount;  // Most vertices of any iteration so far
+
+        LightPaths() : mMaxVertexCount(0) {}
+
+        // Reserves vertex storage from the largest iteration so far, with
+        // some slack, so vertices are appended without reallocating
+        void ReserveVertices(int aPathCount)
+        {
+            const int size = std::max(aPathCount, mMaxVertexCount + mMaxVertexCount / 8);
+            mLightVertices.Reserve(size);
+            mSortedVertices.Reserve(size);
+        }
+
+        void UpdateMaxVertexCount()
+        {
+            mMaxVertexCount = std::max(mMaxVertexCount, mLightVertices.Size());
+        }
+    };
+
     // Range query used for PPM, BPT, and VCM. When HashGrid finds a vertex
     // within range -- Process() is called and vertex
     // merging is performed. BSDF of the camera vertex is used.
@@ -114,28 +381,35 @@ class VertexCM : public AbstractRenderer
             const VertexCM     &aVertexCM,
             const Vec3f        &aCameraPosition,
             const CameraBSDF   &aCameraBsdf,
-            const SubPathState &aCameraState
+            const SubPathState &aCameraState,
+            const std::vector<LightVertex> &aLightVertices
         ) : 
             mVertexCM(aVertexCM),
             mCameraPosition(aCameraPosition),
             mCameraBsdf(aCameraBsdf),
             mCameraState(aCameraState),
-            mContrib(0)
+            mLightVertices(aLightVertices),
+            mContrib(0),
+            mMergeCount(0)
         {}
 
         const Vec3f& GetPosition() const { return mCameraPosition; }
 
         const Vec3f& GetContrib() const { return mContrib; }
 
-        void Process(const LightVertex& aLightVertex)
+        int GetMergeCount() const { return mMergeCount; }
+
+        void Process(const int aLightVertexIndex)
         {
+            const LightVertex &lightVertex = mLightVertices[aLightVertexIndex];
+
             // Reject if full path length below/above min/max path length
-            if((aLightVertex.mPathLength + mCameraState.mPathLength > mVertexCM.mMaxPathLength) ||
-               (aLightVertex.mPathLength + mCameraState.mPathLength < mVertexCM.mMinPathLength))
+            if((lightVertex.mPathLength + mCameraState.mPathLength > mVertexCM.mMaxPathLength) ||
+               (lightVertex.mPathLength + mCameraState.mPathLength < mVertexCM.mMinPathLength))
                  return;
 
             // Retrieve light incoming direction in world coordinates
-            const Vec3f lightDirection = aLightVertex.mBsdf.WorldDirFix();
+            const Vec3f lightDirection = DecodeOctahedral(lightVertex.mDirFix);
 
             float cosCamera, cameraBsdfDirPdfW, cameraBsdfRevPdfW;
             const Vec3f cameraBsdfFactor = mCameraBsdf.Evaluate(
@@ -150,22 +424,23 @@ class VertexCM : public AbstractRenderer
             // Even though this is pdf from camera BSDF, the continuation probability
             // must come from light BSDF, because that would govern it if light path
             // actually continued
-            cameraBsdfRevPdfW *= aLightVertex.mBsdf.ContinuationProb();
+            cameraBsdfRevPdfW *= lightVertex.mContinuationProb;
 
             // Partial light sub-path MIS weight [tech. rep. (38)]
-            const float wLight = aLightVertex.dVCM * mVertexCM.mMisVcWeightFactor +
-                aLightVertex.dVM * mVertexCM.Mis(cameraBsdfDirPdfW);
+            const float wLight = lightVertex.dVCM * mVertexCM.mMisVcWeightFactor +
+                lightVertex.dVM * mVertexCM.Mis(cameraBsdfDirPdfW);
 
             // Partial eye sub-path MIS weight [tech. rep. (39)]
             const float wCamera = mCameraState.dVCM * mVertexCM.mMisVcWeightFactor +
                 mCameraState.dVM * mVertexCM.Mis(cameraBsdfRevPdfW);
 
             // Full path MIS weight [tech. rep. (37)]. No MIS for PPM
-            const float misWeight = mVertexCM.mPpm ?
+            const float misWeight = kUsePpm ?
                 1.f :
                 1.f / (wLight + 1.f + wCamera);
 
-            mContrib += misWeight * cameraBsdfFactor * aLightVertex.mThroughput;
+            mContrib += misWeight * cameraBsdfFactor * lightVertex.mThroughput;
+            mMergeCount++;
         }
 
     private:
@@ -174,114 +449,207 @@ class VertexCM : public AbstractRenderer
         const Vec3f        &mCameraPosition;
         const CameraBSDF   &mCameraBsdf;
         const SubPathState &mCameraState;
+        const std::vector<LightVertex> &mLightVertices;
         Vec3f              mContrib;
-    };
-
-public:
-
-    enum AlgorithmType
-    {
-        // light vertices contribute to camera,
-        // No MIS weights (dVCM, dVM, dVC all ignored)
-        kLightTrace = 0,
-
-        // Camera and light vertices merged on first non-specular surface from camera.
-        // Cannot handle mixed specular + non-specular materials.
-        // No MIS weights (dVCM, dVM, dVC all ignored)
-        kPpm,
-
-        // Camera and light vertices merged on along full path.
-        // dVCM and dVM used for MIS
-        kBpm,
-
-        // Standard bidirectional path tracing
-        // dVCM and dVC used for MIS
-        kBpt,
-
-        // Vertex connection and mering
-        // dVCM, dVM, and dVC used for MIS
-        kVcm
+        int                mMergeCount;
     };
 
 public:
 
     VertexCM(
         const Scene&  aScene,
-        AlgorithmType aAlgorithm,
         const float   aRadiusFactor,
         const float   aRadiusAlpha,
-        int           aSeed = 1234
+        int           aSeed = 1234,
+        int           aGridCellCount = 0,
+        bool          aMortonOrder = false,
+        int           aConnectionCount = 0
     ) :
-        AbstractRenderer(aScene),
-        mRng(aSeed),
-        mLightTraceOnly(false),
-        mUseVC(false),
-        mUseVM(false),
-        mPpm(false)
+        AbstractRenderer(aScene, aSeed),
+        mGridCellCount(aGridCellCount),
+        mMortonOrder(aMortonOrder),
+        mConnectionCount(kUseVC ? aConnectionCount : 0),
+        mLastVertexCount(0),
+        mLightPaths(&mOwnLightPaths),
+        mCurrentIteration(0)
     {
-        switch(aAlgorithm)
+        mBaseRadius  = aRadiusFactor * mScene.mSceneSphere.mSceneRadius;
+        mRadiusAlpha = aRadiusAlpha;
+    }
+
+    virtual void RunIteration(int aIteration)
+    {
+        SetupIteration(aIteration);
+
+        const int pathCount = int(mLightSubPathCount);
+        LightPaths &lightPaths = *mLightPaths;
+
+        // Remove all light vertices, storage is kept between iterations
+        lightPaths.ReserveVertices(pathCount);
+        lightPaths.mLightVertices.Clear();
+
+        //////////////////////////////////////////////////////////////////////////
+        // Generate light paths
+        //////////////////////////////////////////////////////////////////////////
+        TraceLightPaths(0, pathCount, lightPaths.mLightVertices,
+            &lightPaths.mPathEnds[0]);
+        lightPaths.UpdateMaxVertexCount();
+
+        //////////////////////////////////////////////////////////////////////////
+        // Build hash grid
+        //////////////////////////////////////////////////////////////////////////
+        BuildHashGrid();
+
+        //////////////////////////////////////////////////////////////////////////
+        // Generate camera paths
+        //////////////////////////////////////////////////////////////////////////
+        TraceCameraPaths(0, pathCount);
+
+        CountIteration();
+    }
+
+    //////////////////////////////////////////////////////////////////////////
+    // Cooperative rendering interface, see AbstractRenderer
+    //////////////////////////////////////////////////////////////////////////
+
+    virtual bool SupportsCooperative() const { return true; }
+
+    virtual void ShareIterationData(AbstractRenderer &aMain)
+    {
+        VertexCM &main = static_cast<VertexCM&>(aMain);
+        mLightPaths = &main.mOwnLightPaths;
+    }
+
+    virtual void BeginIteration(int aIteration)
+    {
+        SetupIteration(aIteration);
+
+        // Only the owner of the light paths prepares them
+        if(mLightPaths != &mOwnLightPaths)
+            return;
+
+        const int batchCount = GetLightBatchCount();
+        mOwnLightPaths.mBatchVertices.resize(batchCount);
+        mOwnLightPaths.ReserveVertices(int(mLightSubPathCount));
+    }
+
+    virtual int GetLightBatchCount() const
+    {
+        const int pathCount = int(mLightSubPathCount);
+        return (pathCount + kLightBatchSize - 1) / kLightBatchSize;
+    }
+
+    virtual void RunLightBatch(int aBatch)
+    {
+        const int pathCount = int(mLightSubPathCount);
+        const int pathBegin = aBatch * kLightBatchSize;
+        const int pathEnd   = std::min(pathBegin + kLightBatchSize, pathCount);
+
+        // Path ends are relative to the batch until EndLightPass
+        LightVertexArray &batchVertices = mLightPaths->mBatchVertices[aBatch];
+        batchVertices.Clear();
+
+        TraceLightPaths(pathBegin, pathEnd, batchVertices,
+            &mLightPaths->mPathEnds[0]);
+    }
+
+    virtual void EndLightPass()
+    {
+        LightPaths &lightPaths = mOwnLightPaths;
+        const int pathCount  = int(mLightSubPathCount);
+        const int batchCount = int(lightPaths.mBatchVertices.size());
+
+        // Gather batches in batch order, so the result does not depend on
+        // which thread traced which batch
+        std::vector<int> &batchOffsets = lightPaths.mBatchOffsets;
+        batchOffsets.assign(batchCount + 1, 0);
+        for(int i=0; i<batchCount; i++)
+            batchOffsets[i+1] = batchOffsets[i] + lightPaths.mBatchVertices[i].Size();
+
+        lightPaths.mLightVertices.Resize(batchOffsets[batchCount]);
+        lightPaths.UpdateMaxVertexCount();
+
+#pragma omp parallel for schedule(dynamic)
+        for(int i=0; i<batchCount; i++)
         {
-        case kLightTrace:
-            mLightTraceOnly = true;
-            break;
-        case kPpm:
-            mPpm   = true;
-            mUseVM = true;
-            break;
-        case kBpm:
-            mUseVM = true;
-            break;
-        case kBpt:
-            mUseVC = true;
-            break;
-        case kVcm:
-            mUseVC = true;
-            mUseVM = true;
-            break;
-        default:
-            printf("Unknown algorithm requested\n");
-            break;
+            const LightVertexArray &batchVertices = lightPaths.mBatchVertices[i];
+            const int offset = batchOffsets[i];
+
+            std::copy(batchVertices.mPositions.begin(), batchVertices.mPositions.end(),
+                lightPaths.mLightVertices.mPositions.begin() + offset);
+            std::copy(batchVertices.mVertices.begin(), batchVertices.mVertices.end(),
+                lightPaths.mLightVertices.mVertices.begin() + offset);
+
+            const int pathBegin = i * kLightBatchSize;
+            const int pathEnd   = std::min(pathBegin + kLightBatchSize, pathCount);
+            for(int pathIdx = pathBegin; pathIdx < pathEnd; pathIdx++)
+                lightPaths.mPathEnds[pathIdx] += offset;
         }
 
-        if(mPpm)
+        // Called outside of parallel region, so the grid is built in parallel
+        BuildHashGrid();
+    }
+
+    virtual int GetCameraPathCount() const
+    {
+        return kLightTraceOnly ? 0 : int(mScreenPixelCount);
+    }
+
+    virtual void RunCameraPaths(int aBegin, int aEnd)
+    {
+        TraceCameraPaths(aBegin, aEnd);
+    }
+
+    virtual void RunCameraTile(const Vec2i &aTileMin, const Vec2i &aTileMax)
+    {
+        if(!mWavefront)
         {
-            // We will check the scene to make sure it does not contain mixed
-            // specular and non-specular materials
-            for(int i = 0; i < mScene.GetMaterialCount(); ++i)
-            {
-                const Material &mat = mScene.GetMaterial(i);
+            AbstractRenderer::RunCameraTile(aTileMin, aTileMax);
+            return;
+        }
 
-                const bool hasNonSpecular =
-                    (mat.mDiffuseReflectance.Max() > 0) ||
-                    (mat.mPhongReflectance.Max() > 0);
+        // Whole tile is one wave
+        if(kLightTraceOnly)
+            return;
 
-                const bool hasSpecular =
-                    (mat.mMirrorReflectance.Max() > 0) ||
-                    (mat.mIOR > 0);
+        PhaseTimer timer(mStats, RenderStats::kCameraTracing);
 
-                if(hasNonSpecular && hasSpecular)
-                {
-                    printf(
-                        "*WARNING* Our PPM implementation cannot handle materials mixing\n"
-                        "Specular and NonSpecular BSDFs. The extension would be\n"
-                        "fairly straightforward. In SampleScattering for camera sub-paths\n"
-                        "limit the considered events to Specular only.\n"
-                        "Merging will use non-specular components, scattering will be specular.\n"
-                        "If there is no specular component, the ray will terminate.\n\n");
+        GetTilePixels(aTileMin, aTileMax, mWave.mPaths);
+        TraceCameraPathsWavefront();
+    }
 
-                    printf("We are now switching from *PPM* to *BPM*, which can handle the scene\n\n");
+    //////////////////////////////////////////////////////////////////////////
+    // Checkpointing, see AbstractRenderer
+    //////////////////////////////////////////////////////////////////////////
 
-                    mPpm = false;
-                    break;
-                }
-            }
-        }
+    virtual void SaveState(std::ostream &aoStream) const
+    {
+        AbstractRenderer::SaveState(aoStream);
 
-        mBaseRadius  = aRadiusFactor * mScene.mSceneSphere.mSceneRadius;
-        mRadiusAlpha = aRadiusAlpha;
+        // Radius schedule, continues from the stored iteration count
+        aoStream.write((const char*)&mBaseRadius,  sizeof(mBaseRadius));
+        aoStream.write((const char*)&mRadiusAlpha, sizeof(mRadiusAlpha));
+
+        // Vertex count of the last iteration, for MIS of --connections
+        const int vertexCount = mLightPaths->mLightVertices.Size();
+        aoStream.write((const char*)&vertexCount, sizeof(vertexCount));
     }
 
-    virtual void RunIteration(int aIteration)
+    virtual bool LoadState(std::istream &aoStream)
+    {
+        if(!AbstractRenderer::LoadState(aoStream))
+            return false;
+
+        aoStream.read((char*)&mBaseRadius,  sizeof(mBaseRadius));
+        aoStream.read((char*)&mRadiusAlpha, sizeof(mRadiusAlpha));
+        aoStream.read((char*)&mLastVertexCount, sizeof(mLastVertexCount));
+        return !aoStream.fail();
+    }
+
+private:
+
+    // Sets up radius and MIS constants of the given iteration
+    void SetupIteration(int aIteration)
     {
         // While we have the same number of pixels (camera paths)
         // and light paths, we do keep them separate for clarity reasons
@@ -291,269 +659,633 @@ public:
         mScreenPixelCount = float(resX * resY);
         mLightSubPathCount   = float(resX * resY);
 
+        mCurrentIteration = aIteration;
+
         // Setup our radius, 1st iteration has aIteration == 0, thus offset
         float radius = mBaseRadius;
         radius /= std::pow(float(aIteration + 1), 0.5f * (1 - mRadiusAlpha));
         // Purely for numeric stability
         radius = std::max(radius, 1e-7f);
         const float radiusSqr = Sqr(radius);
+        mRadius = radius;
 
         // Factor used to normalise vertex merging contribution.
         // We divide the summed up energy by disk radius and number of light paths
         mVmNormalization = 1.f / (radiusSqr * PI_F * mLightSubPathCount);
 
-        // MIS weight constant [tech. rep. (20)], with n_VC = 1 and n_VM = mLightPathCount
-        const float etaVCM = (PI_F * radiusSqr) * mLightSubPathCount;
-        mMisVmWeightFactor = mUseVM ? Mis(etaVCM)       : 0.f;
-        mMisVcWeightFactor = mUseVC ? Mis(1.f / etaVCM) : 0.f;
+        // Number of samples of connections to light vertices per camera
+        // vertex, n_VC. Picking mConnectionCount vertices from all stored
+        // ones samples each connection technique mConnectionCount / (stored
+        // vertices per light path) times. The vertex count of the previous
+        // iteration is used, so the weights do not depend on the current
+        // light paths (first iteration assumes one vertex per path). After
+        // resuming, the vertices are gone, but their count is in the state.
+        // Light tracing, direct illumination and hitting lights keep their
+        // sample counts. As the MIS quantities are relative to connections,
+        // their terms for these get mMisBoundaryFactor, and their weights
+        // multiply the rest by n_VC.
+        float vcCount = 1.f;
+        if(mConnectionCount > 0)
+        {
+            if(mLightPaths->mLightVertices.Size() > 0)
+                mLastVertexCount = mLightPaths->mLightVertices.Size();
 
-        // Clear path ends, nothing ends anywhere
-        mPathEnds.resize(pathCount);
-        memset(&mPathEnds[0], 0, mPathEnds.size() * sizeof(int));
+            vcCount = float(mConnectionCount);
+            if(mLastVertexCount > 0)
+                vcCount *= mLightSubPathCount / float(mLastVertexCount);
+        }
+        mMisVcCountFactor = Mis(vcCount);
+        mMisBoundaryFactor = Mis(1.f / vcCount);
 
-        // Remove all light vertices and reserve space for some
-        mLightVertices.reserve(pathCount);
-        mLightVertices.clear();
+        // MIS weight constant [tech. rep. (20)], with n_VC = vcCount and n_VM = mLightPathCount
+        const float etaVCM = (PI_F * radiusSqr) * mLightSubPathCount / vcCount;
+        mMisVmWeightFactor = kUseVM ? Mis(etaVCM)       : 0.f;
+        mMisVcWeightFactor = kUseVC ? Mis(1.f / etaVCM) : 0.f;
 
-        //////////////////////////////////////////////////////////////////////////
-        // Generate light paths
-        //////////////////////////////////////////////////////////////////////////
-        for(int pathIdx = 0; pathIdx < pathCount; pathIdx++)
+        // Every traced light path stores its end, so old ends need no clearing
+        if(mLightPaths == &mOwnLightPaths)
+            mOwnLightPaths.mPathEnds.resize(pathCount);
+    }
+
+    // Traces light paths [aPathBegin, aPathEnd), appends their vertices
+    // to oLightVertices, and for each path stores the vertex count of
+    // oLightVertices after it to oPathEnds[pathIdx]
+    void TraceLightPaths(
+        const int                aPathBegin,
+        const int                aPathEnd,
+        LightVertexArray         &oLightVertices,
+        int                      *oPathEnds)
+    {
+        PhaseTimer timer(mStats, RenderStats::kLightTracing);
+        const int vertexCount = oLightVertices.Size();
+
+        if(mWavefront)
+            TraceLightPathsWavefront(aPathBegin, aPathEnd, oLightVertices, oPathEnds);
+        else
+            TraceLightPathsDepthFirst(aPathBegin, aPathEnd, oLightVertices, oPathEnds);
+
+        mStats.mLightVertices += oLightVertices.Size() - vertexCount;
+    }
+
+    // Traces light paths one by one, see TraceLightPaths
+    void TraceLightPathsDepthFirst(
+        const int                aPathBegin,
+        const int                aPathEnd,
+        LightVertexArray         &oLightVertices,
+        int                      *oPathEnds)
+    {
+
+        for(int pathIdx = aPathBegin; pathIdx < aPathEnd; pathIdx++)
         {
             SubPathState lightState;
-            GenerateLightSample(lightState);
+            GenerateLightSample(pathIdx, lightState);
 
             //////////////////////////////////////////////////////////////////////////
             // Trace light path
-            for(;; ++lightState.mPathLength)
+            for(;;)
             {
-                // Offset ray origin instead of setting tmin due to numeric
-                // issues in ray-sphere intersection. The isect.dist has to be
-                // extended by this EPS_RAY after hit point is determined
-                Ray ray(lightState.mOrigin + lightState.mDirection * EPS_RAY,
-                    lightState.mDirection, 0);
+                const Ray ray = GetNextRay(lightState);
                 Isect isect(1e36f);
 
+                mStats.mRays++;
                 if(!mScene.Intersect(ray, isect))
                     break;
 
-                const Vec3f hitPoint = ray.org + ray.dir * isect.dist;
-                isect.dist += EPS_RAY;
-
-                LightBSDF bsdf(ray, isect, mScene);
-                if(!bsdf.IsValid())
+                if(!ShadeLightHit(lightState, ray, isect, oLightVertices))
                     break;
+            }
 
-                // Update the MIS quantities before storing them at the vertex.
-                // These updates follow the initialization in GenerateLightSample() or
-                // SampleScattering(), and together implement equations [tech. rep. (31)-(33)]
-                // or [tech. rep. (34)-(36)], respectively.
-                {
-                    // Infinite lights use MIS handled via solid angle integration,
-                    // so do not divide by the distance for such lights [tech. rep. Section 5.1]
-                    if(lightState.mPathLength > 1 || lightState.mIsFiniteLight == 1)
-                        lightState.dVCM *= Mis(Sqr(isect.dist));
-
-                    lightState.dVCM /= Mis(std::abs(bsdf.CosThetaFix()));
-                    lightState.dVC  /= Mis(std::abs(bsdf.CosThetaFix()));
-                    lightState.dVM  /= Mis(std::abs(bsdf.CosThetaFix()));
-                }
+            oPathEnds[pathIdx] = oLightVertices.Size();
+        }
+    }
 
-                // Store vertex, unless BSDF is purely specular, which prevents
-                // vertex connections and merging
-                if(!bsdf.IsDelta() && (mUseVC || mUseVM))
-                {
-                    LightVertex lightVertex;
-                    lightVertex.mHitpoint   = hitPoint;
-                    lightVertex.mThroughput = lightState.mThroughput;
-                    lightVertex.mPathLength = lightState.mPathLength;
-                    lightVertex.mBsdf       = bsdf;
+    // Same as TraceLightPaths, but paths are traced in waves of
+    // kWavefrontSize: all active paths are intersected, binned by the hit
+    // material, and shaded together. Vertices are grouped back by path.
+    void TraceLightPathsWavefront(
+        const int                aPathBegin,
+        const int                aPathEnd,
+        LightVertexArray         &oLightVertices,
+        int                      *oPathEnds)
+    {
+        Wavefront &wave = mWave;
 
-                    lightVertex.dVCM = lightState.dVCM;
-                    lightVertex.dVC  = lightState.dVC;
-                    lightVertex.dVM  = lightState.dVM;
+        for(int waveBegin = aPathBegin; waveBegin < aPathEnd; waveBegin += kWavefrontSize)
+        {
+            const int pathCount = std::min(int(kWavefrontSize), aPathEnd - waveBegin);
 
-                    mLightVertices.push_back(lightVertex);
-                }
+            wave.Resize(pathCount);
+            wave.mVertices.Clear();
+            wave.mVertexPaths.clear();
+
+            for(int i=0; i<pathCount; i++)
+            {
+                GenerateLightSample(waveBegin + i, wave.mStates[i]);
+                wave.mActive[i] = i;
+            }
 
-                // Connect to camera, unless BSDF is purely specular
-                if(!bsdf.IsDelta() && (mUseVC || mLightTraceOnly))
+            while(!wave.mActive.empty())
+            {
+                IntersectWave(wave);
+
+                wave.mNextActive.clear();
+                for(size_t k=0; k<wave.mBinned.size(); k++)
                 {
-                    if(lightState.mPathLength + 1 >= mMinPathLength)
-                        ConnectToCamera(lightState, hitPoint, bsdf);
+                    const int j = wave.mBinned[k];
+                    const int i = wave.mActive[j];
+                    if(!wave.mHits[j])
+                        continue;
+
+                    const int vertexCount = wave.mVertices.Size();
+
+                    SubPathState &state = wave.mStates[i];
+                    mSampler->StartPath(Rng::kLightStream, waveBegin + i,
+                        mCurrentIteration, state.mDimension);
+
+                    const bool active = ShadeLightHit(state,
+                        wave.mRays[j], wave.mIsects[j], wave.mVertices);
+                    state.mDimension = mSampler->GetDimension();
+
+                    if(wave.mVertices.Size() > vertexCount)
+                        wave.mVertexPaths.push_back(i);
+
+                    if(active)
+                        wave.mNextActive.push_back(i);
                 }
 
-                // Terminate if the path would become too long after scattering
-                if(lightState.mPathLength + 2 > mMaxPathLength)
-                    break;
+                wave.mActive.swap(wave.mNextActive);
+            }
 
-                // Continue random walk
-                if(!SampleScattering(bsdf, hitPoint, lightState))
-                    break;
+            // Group vertices by path, each path's vertices are already in
+            // increasing path length order
+            std::vector<int> &pathStarts = wave.mKeys;
+            pathStarts.assign(pathCount + 1, 0);
+
+            for(size_t v=0; v<wave.mVertexPaths.size(); v++)
+                pathStarts[wave.mVertexPaths[v] + 1]++;
+
+            for(int i=0; i<pathCount; i++)
+                pathStarts[i + 1] += pathStarts[i];
+
+            const int base = oLightVertices.Size();
+            oLightVertices.Resize(base + wave.mVertices.Size());
+
+            for(int i=0; i<pathCount; i++)
+                oPathEnds[waveBegin + i] = base + pathStarts[i + 1];
+
+            for(size_t v=0; v<wave.mVertexPaths.size(); v++)
+            {
+                const int target = base + pathStarts[wave.mVertexPaths[v]]++;
+                oLightVertices.mPositions[target] = wave.mVertices.mPositions[v];
+                oLightVertices.mVertices[target]  = wave.mVertices.mVertices[v];
             }
+        }
+    }
 
-            mPathEnds[pathIdx] = (int)mLightVertices.size();
+    // Processes a hit of light sub-path: updates MIS quantities, stores the
+    // vertex, connects it to camera, and samples the next direction.
+    // Returns false when the path terminates.
+    bool ShadeLightHit(
+        SubPathState     &aoLightState,
+        const Ray        &aRay,
+        Isect            &aoIsect,
+        LightVertexArray &oLightVertices)
+    {
+        const Vec3f hitPoint = aRay.org + aRay.dir * aoIsect.dist;
+        aoIsect.dist += EPS_RAY;
+
+        LightBSDF bsdf(aRay, aoIsect, mScene);
+        if(!bsdf.IsValid())
+            return false;
+
+        // Update the MIS quantities before storing them at the vertex.
+        // These updates follow the initialization in GenerateLightSample() or
+        // SampleScattering(), and together implement equations [tech. rep. (31)-(33)]
+        // or [tech. rep. (34)-(36)], respectively.
+        {
+            // Infinite lights use MIS handled via solid angle integration,
+            // so do not divide by the distance for such lights [tech. rep. Section 5.1]
+            if(kUseDVCM && (aoLightState.mPathLength > 1 || aoLightState.mIsFiniteLight == 1))
+                aoLightState.dVCM *= Mis(Sqr(aoIsect.dist));
+
+            if(kUseDVCM) aoLightState.dVCM /= Mis(std::abs(bsdf.CosThetaFix()));
+            if(kUseDVC)  aoLightState.dVC  /= Mis(std::abs(bsdf.CosThetaFix()));
+            if(kUseDVM)  aoLightState.dVM  /= Mis(std::abs(bsdf.CosThetaFix()));
         }
 
-        //////////////////////////////////////////////////////////////////////////
-        // Build hash grid
-        //////////////////////////////////////////////////////////////////////////
+        // Store vertex, unless BSDF is purely specular, which prevents
+        // vertex connections and merging
+        if(!bsdf.IsDelta() && (kUseVC || kUseVM))
+        {
+            LightVertex lightVertex;
+            lightVertex.mThroughput       = aoLightState.mThroughput;
+            lightVertex.mContinuationProb = bsdf.ContinuationProb();
+            lightVertex.mNormal           = EncodeOctahedral(bsdf.WorldNormal());
+            lightVertex.mDirFix           = EncodeOctahedral(bsdf.WorldDirFix());
+            lightVertex.mMaterialID       = ushort(bsdf.MaterialID());
+            lightVertex.mPathLength       = ushort(aoLightState.mPathLength);
+
+            lightVertex.dVCM = aoLightState.dVCM;
+            lightVertex.dVC  = aoLightState.dVC;
+            lightVertex.dVM  = aoLightState.dVM;
+
+            oLightVertices.Add(hitPoint, lightVertex);
+        }
 
-        // Only build grid when merging (VCM, BPM, and PPM)
-        if(mUseVM)
+        // Connect to camera, unless BSDF is purely specular
+        if(!bsdf.IsDelta() && (kUseVC || kLightTraceOnly))
         {
-            // The number of cells is somewhat arbitrary, but seems to work ok
-            mHashGrid.Reserve(pathCount);
-            mHashGrid.Build(mLightVertices, radius);
+            if(aoLightState.mPathLength + 1 >= mMinPathLength)
+                ConnectToCamera(aoLightState, hitPoint, bsdf);
         }
 
-        //////////////////////////////////////////////////////////////////////////
-        // Generate camera paths
-        //////////////////////////////////////////////////////////////////////////
+        // Terminate if the path would become too long after scattering
+        if(aoLightState.mPathLength + 2 > mMaxPathLength)
+            return false;
+
+        // Continue random walk
+        if(!SampleScattering(bsdf, hitPoint, aoLightState))
+            return false;
 
+        aoLightState.mPathLength++;
+        return true;
+    }
+
+    // Only build grid when merging (VCM, BPM, and PPM)
+    void BuildHashGrid()
+    {
+        LightPaths &lightPaths = *mLightPaths;
+        lightPaths.mStoredIndex.clear();
+
+        if(!kUseVM)
+            return;
+
+        PhaseTimer timer(mStats, RenderStats::kGridBuild);
+
+        // The default number of cells is somewhat arbitrary, but seems to work ok
+        lightPaths.mHashGrid.Reserve(
+            mGridCellCount > 0 ? mGridCellCount : int(mLightSubPathCount));
+
+        if(!mMortonOrder)
+        {
+            lightPaths.mHashGrid.Build(lightPaths.mLightVertices.mPositions, mRadius);
+            return;
+        }
+
+        // Sort vertices by cell, so that merging reads them in order
+        lightPaths.mHashGrid.BuildSorted(lightPaths.mLightVertices.mPositions,
+            mRadius, lightPaths.mSortOrder);
+
+        const LightVertexArray &vertices = lightPaths.mLightVertices;
+        LightVertexArray       &sorted   = lightPaths.mSortedVertices;
+        const int numVertices = vertices.Size();
+
+        sorted.Resize(numVertices);
+        lightPaths.mStoredIndex.resize(numVertices);
+
+#pragma omp parallel for
+        for(int i=0; i<numVertices; i++)
+        {
+            const int pathOrderIdx = lightPaths.mSortOrder[i];
+            sorted.mPositions[i] = vertices.mPositions[pathOrderIdx];
+            sorted.mVertices[i]  = vertices.mVertices[pathOrderIdx];
+            lightPaths.mStoredIndex[pathOrderIdx] = i;
+        }
+
+        lightPaths.mLightVertices.Swap(sorted);
+    }
+
+    // Traces camera paths [aPathBegin, aPathEnd) and accumulates their
+    // contributions to the framebuffer
+    void TraceCameraPaths(
+        const int aPathBegin,
+        const int aPathEnd)
+    {
         // Unless rendering with traditional light tracing
-        for(int pathIdx = 0; (pathIdx < pathCount) && (!mLightTraceOnly); ++pathIdx)
+        if(kLightTraceOnly)
+            return;
+
+        PhaseTimer timer(mStats, RenderStats::kCameraTracing);
+
+        if(mWavefront)
         {
+            std::vector<int> &paths = mWave.mPaths;
+            paths.resize(aPathEnd - aPathBegin);
+
+            for(int pathIdx = aPathBegin; pathIdx < aPathEnd; ++pathIdx)
+                paths[pathIdx - aPathBegin] = pathIdx;
+
+            TraceCameraPathsWavefront();
+            return;
+        }
+
+        for(int pathIdx = aPathBegin; pathIdx < aPathEnd; ++pathIdx)
+        {
+            if(!NeedsCameraPath(pathIdx))
+                continue;
+
             SubPathState cameraState;
             const Vec2f screenSample = GenerateCameraSample(pathIdx, cameraState);
             Vec3f color(0);
 
             //////////////////////////////////////////////////////////////////////
             // Trace camera path
-            for(;; ++cameraState.mPathLength)
+            for(;;)
             {
-                // Offset ray origin instead of setting tmin due to numeric
-                // issues in ray-sphere intersection. The isect.dist has to be
-                // extended by this EPS_RAY after hit point is determined
-                Ray ray(cameraState.mOrigin + cameraState.mDirection * EPS_RAY,
-                    cameraState.mDirection, 0);
-
+                const Ray ray = GetNextRay(cameraState);
                 Isect isect(1e36f);
 
-                // Get radiance from environment
+                mStats.mRays++;
                 if(!mScene.Intersect(ray, isect))
                 {
-                    if(mScene.GetBackground() != NULL)
-                    {
-                        if(cameraState.mPathLength >= mMinPathLength)
-                        {
-                            color += cameraState.mThroughput *
-                                GetLightRadiance(mScene.GetBackground(), cameraState,
-                                Vec3f(0), ray.dir);
-                        }
-                    }
-
+                    ShadeCameraMiss(cameraState, ray, color);
                     break;
                 }
 
-                const Vec3f hitPoint = ray.org + ray.dir * isect.dist;
-                isect.dist += EPS_RAY;
-
-                CameraBSDF bsdf(ray, isect, mScene);
-                if(!bsdf.IsValid())
+                if(!ShadeCameraHit(pathIdx, cameraState, ray, isect, color))
                     break;
+            }
 
-                // Update the MIS quantities, following the initialization in
-                // GenerateLightSample() or SampleScattering(). Implement equations
-                // [tech. rep. (31)-(33)] or [tech. rep. (34)-(36)], respectively.
-                {
-                    cameraState.dVCM *= Mis(Sqr(isect.dist));
-                    cameraState.dVCM /= Mis(std::abs(bsdf.CosThetaFix()));
-                    cameraState.dVC  /= Mis(std::abs(bsdf.CosThetaFix()));
-                    cameraState.dVM  /= Mis(std::abs(bsdf.CosThetaFix()));
-                }
+            AddColor(pathIdx, screenSample, color);
+        }
+    }
+
+    // Wavefront version of TraceCameraPaths, traces camera paths with
+    // indices in mWave.mPaths, in waves of kWavefrontSize
+    void TraceCameraPathsWavefront()
+    {
+        Wavefront &wave = mWave;
+        RemoveConvergedPixels(wave.mPaths);
+        const int totalCount = (int)wave.mPaths.size();
+
+        for(int waveBegin = 0; waveBegin < totalCount; waveBegin += kWavefrontSize)
+        {
+            const int pathCount = std::min(int(kWavefrontSize), totalCount - waveBegin);
+            const int *paths    = &wave.mPaths[waveBegin];
+
+            wave.Resize(pathCount);
+
+            for(int i=0; i<pathCount; i++)
+            {
+                wave.mScreenSamples[i] = GenerateCameraSample(paths[i], wave.mStates[i]);
+                wave.mColors[i]        = Vec3f(0);
+                wave.mActive[i]        = i;
+            }
+
+            while(!wave.mActive.empty())
+            {
+                IntersectWave(wave);
 
-                // Light source has been hit; terminate afterwards, since
-                // our light sources do not have reflective properties
-                if(isect.lightID >= 0)
+                wave.mNextActive.clear();
+                for(size_t k=0; k<wave.mBinned.size(); k++)
                 {
-                    const AbstractLight *light = mScene.GetLightPtr(isect.lightID);
-                
-                    if(cameraState.mPathLength >= mMinPathLength)
+                    const int j = wave.mBinned[k];
+                    const int i = wave.mActive[j];
+
+                    if(!wave.mHits[j])
                     {
-                        color += cameraState.mThroughput *
-                            GetLightRadiance(light, cameraState, hitPoint, ray.dir);
+                        ShadeCameraMiss(wave.mStates[i], wave.mRays[j], wave.mColors[i]);
+                        continue;
                     }
-                    
-                    break;
+
+                    SubPathState &state = wave.mStates[i];
+                    mSampler->StartPath(Rng::kCameraStream, paths[i],
+                        mCurrentIteration, state.mDimension);
+
+                    const bool active = ShadeCameraHit(paths[i], state,
+                        wave.mRays[j], wave.mIsects[j], wave.mColors[i]);
+                    state.mDimension = mSampler->GetDimension();
+
+                    if(active)
+                        wave.mNextActive.push_back(i);
                 }
 
-                // Terminate if eye sub-path is too long for connections or merging
-                if(cameraState.mPathLength >= mMaxPathLength)
-                    break;
+                wave.mActive.swap(wave.mNextActive);
+            }
+
+            for(int i=0; i<pathCount; i++)
+                AddColor(paths[i], wave.mScreenSamples[i], wave.mColors[i]);
+        }
+    }
+
+    // Adds radiance from environment for camera sub-path that left the scene
+    void ShadeCameraMiss(
+        const SubPathState &aCameraState,
+        const Ray          &aRay,
+        Vec3f              &aoColor) const
+    {
+        if(mScene.GetBackground() != NULL)
+        {
+            if(aCameraState.mPathLength >= mMinPathLength)
+            {
+                aoColor += aCameraState.mThroughput *
+                    GetLightRadiance(mScene.GetBackgroundID(), aCameraState,
+                    Vec3f(0), aRay.dir);
+            }
+        }
+    }
+
+    // Processes a hit of camera sub-path aPathIdx: adds emission, performs
+    // vertex connection and merging, and samples the next direction.
+    // Returns false when the path terminates.
+    bool ShadeCameraHit(
+        const int    aPathIdx,
+        SubPathState &aoCameraState,
+        const Ray    &aRay,
+        Isect        &aoIsect,
+        Vec3f        &aoColor)
+    {
+        const Vec3f hitPoint = aRay.org + aRay.dir * aoIsect.dist;
+        aoIsect.dist += EPS_RAY;
+
+        CameraBSDF bsdf(aRay, aoIsect, mScene);
+        if(!bsdf.IsValid())
+            return false;
+
+        // Update the MIS quantities, following the initialization in
+        // GenerateLightSample() or SampleScattering(). Implement equations
+        // [tech. rep. (31)-(33)] or [tech. rep. (34)-(36)], respectively.
+        {
+            if(kUseDVCM) aoCameraState.dVCM *= Mis(Sqr(aoIsect.dist));
+            if(kUseDVCM) aoCameraState.dVCM /= Mis(std::abs(bsdf.CosThetaFix()));
+            if(kUseDVC)  aoCameraState.dVC  /= Mis(std::abs(bsdf.CosThetaFix()));
+            if(kUseDVM)  aoCameraState.dVM  /= Mis(std::abs(bsdf.CosThetaFix()));
+        }
+
+        // Light source has been hit; terminate afterwards, since
+        // our light sources do not have reflective properties
+        if(aoIsect.lightID >= 0)
+        {
+            if(aoCameraState.mPathLength >= mMinPathLength)
+            {
+                aoColor += aoCameraState.mThroughput *
+                    GetLightRadiance(aoIsect.lightID, aoCameraState, hitPoint, aRay.dir);
+            }
+            
+            return false;
+        }
+
+        // Terminate if eye sub-path is too long for connections or merging
+        if(aoCameraState.mPathLength >= mMaxPathLength)
+            return false;
 
-                ////////////////////////////////////////////////////////////////
-                // Vertex connection: Connect to a light source
-                if(!bsdf.IsDelta() && mUseVC)
+        if(!bsdf.IsDelta() && kUseVC)
+        {
+            PhaseTimer timer(mStats, RenderStats::kConnections, mDetailedStats);
+
+            // Shadow rays of all connections are traced together below
+            mConnections.Clear();
+
+            ////////////////////////////////////////////////////////////////
+            // Vertex connection: Connect to a light source
+            if(aoCameraState.mPathLength + 1>= mMinPathLength)
+            {
+                Ray   shadowRay;
+                Isect shadowIsect;
+                const Vec3f contrib = DirectIllumination(aoCameraState, hitPoint,
+                    bsdf, shadowRay, shadowIsect);
+
+                if(!contrib.IsZero())
+                    mConnections.Add(aoCameraState.mThroughput * contrib,
+                        shadowRay, shadowIsect);
+            }
+
+            ////////////////////////////////////////////////////////////////
+            // Vertex connection: Connect to light vertices
+
+            // For VC, each light sub-path is assigned to a particular eye
+            // sub-path, as in traditional BPT. With mConnectionCount, the
+            // vertex connects instead to that many vertices picked from
+            // those of all light paths, see SetupIteration for the MIS.
+            const LightVertexArray &lightVertices = mLightPaths->mLightVertices;
+
+            if(mConnectionCount > 0)
+            {
+                const int vertexCount = lightVertices.Size();
+
+                // Each pick stands for all stored vertices, divided by the
+                // number of picks and of light paths they come from
+                const float pickScale = float(vertexCount) /
+                    (mLightSubPathCount * float(mConnectionCount));
+
+                for(int i = 0; i < mConnectionCount && vertexCount > 0; i++)
                 {
-                    if(cameraState.mPathLength + 1>= mMinPathLength)
-                    {
-                        color += cameraState.mThroughput *
-                            DirectIllumination(cameraState, hitPoint, bsdf);
-                    }
+                    const int idx = std::min(int(mSampler->Get1D() * vertexCount),
+                        vertexCount - 1);
+                    const uint pathLength = lightVertices.mVertices[idx].mPathLength +
+                        1 + aoCameraState.mPathLength;
+
+                    if(pathLength < mMinPathLength || pathLength > mMaxPathLength)
+                        continue;
+
+                    AddVertexConnection(idx, pickScale, bsdf, hitPoint, aoCameraState);
                 }
+            }
+            else
+            {
+                const std::vector<int> &pathEnds    = mLightPaths->mPathEnds;
+                const std::vector<int> &storedIndex = mLightPaths->mStoredIndex;
+                const Vec2i range(
+                    (aPathIdx == 0) ? 0 : pathEnds[aPathIdx-1],
+                    pathEnds[aPathIdx]);
 
-                ////////////////////////////////////////////////////////////////
-                // Vertex connection: Connect to light vertices
-                if(!bsdf.IsDelta() && mUseVC)
+                for(int i = range.x; i < range.y; i++)
                 {
-                    // For VC, each light sub-path is assigned to a particular eye
-                    // sub-path, as in traditional BPT. It is also possible to
-                    // connect to vertices from any light path, but MIS should
-                    // be revisited.
-                    const Vec2i range(
-                        (pathIdx == 0) ? 0 : mPathEnds[pathIdx-1],
-                        mPathEnds[pathIdx]);
-
-                    for(int i = range.x; i < range.y; i++)
-                    {
-                        const LightVertex &lightVertex = mLightVertices[i];
+                    const int idx = storedIndex.empty() ? i : storedIndex[i];
+                    const LightVertex &lightVertex = lightVertices.mVertices[idx];
 
-                        if(lightVertex.mPathLength + 1 +
-                           cameraState.mPathLength < mMinPathLength)
-                            continue;
+                    if(lightVertex.mPathLength + 1 +
+                       aoCameraState.mPathLength < mMinPathLength)
+                        continue;
 
-                        // Light vertices are stored in increasing path length
-                        // order; once we go above the max path length, we can
-                        // skip the rest
-                        if(lightVertex.mPathLength + 1 +
-                           cameraState.mPathLength > mMaxPathLength)
-                            break;
+                    // Light vertices are stored in increasing path length
+                    // order; once we go above the max path length, we can
+                    // skip the rest
+                    if(lightVertex.mPathLength + 1 +
+                       aoCameraState.mPathLength > mMaxPathLength)
+                        break;
 
-                        color += cameraState.mThroughput * lightVertex.mThroughput *
-                            ConnectVertices(lightVertex, bsdf, hitPoint, cameraState);
-                    }
+                    AddVertexConnection(idx, 1.f, bsdf, hitPoint, aoCameraState);
                 }
+            }
 
-                ////////////////////////////////////////////////////////////////
-                // Vertex merging: Merge with light vertices
-                if(!bsdf.IsDelta() && mUseVM)
-                {
-                    RangeQuery query(*this, hitPoint, bsdf, cameraState);
-                    mHashGrid.Process(mLightVertices, query);
-                    color += cameraState.mThroughput * mVmNormalization * query.GetContrib();
+            // Add unoccluded connections, in the order they were made
+            if(!mConnections.mRays.empty())
+            {
+                const int count = (int)mConnections.mRays.size();
+                mConnections.mOccluded.resize(count);
+                mScene.OccludedN(&mConnections.mRays[0], &mConnections.mIsects[0],
+                    &mConnections.mOccluded[0], count);
+                mStats.mShadowRays += count;
 
-                    // PPM merges only at the first non-specular surface from camera
-                    if(mPpm) break;
+                for(int i=0; i<count; i++)
+                {
+                    if(!mConnections.mOccluded[i])
+                        aoColor += mConnections.mContribs[i];
                 }
-
-                if(!SampleScattering(bsdf, hitPoint, cameraState))
-                    break;
             }
+        }
+
+        ////////////////////////////////////////////////////////////////
+        // Vertex merging: Merge with light vertices
+        if(!bsdf.IsDelta() && kUseVM)
+        {
+            PhaseTimer timer(mStats, RenderStats::kMerging, mDetailedStats);
+
+            const LightVertexArray &lightVertices = mLightPaths->mLightVertices;
+            RangeQuery query(*this, hitPoint, bsdf, aoCameraState, lightVertices.mVertices);
+            mLightPaths->mHashGrid.Process(query);
+            aoColor += aoCameraState.mThroughput * mVmNormalization * query.GetContrib();
+            mStats.mMerges += query.GetMergeCount();
 
-            mFramebuffer.AddColor(screenSample, color);
+            // PPM merges only at the first non-specular surface from camera
+            if(kUsePpm) return false;
         }
 
-        mIterations++;
+        if(!SampleScattering(bsdf, hitPoint, aoCameraState))
+            return false;
+
+        aoCameraState.mPathLength++;
+        return true;
     }
 
-private:
+    // Offset ray origin instead of setting tmin due to numeric issues in
+    // ray-sphere intersection. The isect.dist has to be extended by this
+    // EPS_RAY after hit point is determined
+    static Ray GetNextRay(const SubPathState &aState)
+    {
+        return Ray(aState.mOrigin + aState.mDirection * EPS_RAY,
+            aState.mDirection, 0);
+    }
 
-    // Mis power, we use balance heuristic
+    // Intersects all active paths of the wave together, and bins them by
+    // the hit material into mBinned (paths that missed the scene come first)
+    void IntersectWave(Wavefront &aoWave)
+    {
+        const int activeCount = (int)aoWave.mActive.size();
+        aoWave.mKeys.resize(activeCount);
+
+        for(int j=0; j<activeCount; j++)
+        {
+            aoWave.mRays[j]   = GetNextRay(aoWave.mStates[aoWave.mActive[j]]);
+            aoWave.mIsects[j] = Isect(1e36f);
+        }
+
+        mScene.IntersectN(&aoWave.mRays[0], &aoWave.mIsects[0],
+            &aoWave.mHits[0], activeCount);
+        mStats.mRays += activeCount;
+
+        for(int j=0; j<activeCount; j++)
+            aoWave.mKeys[j] = aoWave.mHits[j] ? aoWave.mIsects[j].matID + 1 : 0;
+
+        BinByKey(aoWave.mKeys, mScene.GetMaterialCount() + 1,
+            aoWave.mBinned, aoWave.mBinStarts);
+    }
+
+    // Mis power, balance heuristic for tMisPower 1, power heuristic otherwise
     float Mis(float aPdf) const
     {
-        //return std::pow(aPdf, /*power*/);
-        return aPdf;
+        return tMisPower == 1 ? aPdf : std::pow(aPdf, float(tMisPower));
     }
 
     //////////////////////////////////////////////////////////////////////////
@@ -574,7 +1306,8 @@ private:
         const int y = aPixelIndex / resY;
 
         // Jitter pixel position
-        const Vec2f sample = Vec2f(float(x), float(y)) + mRng.GetVec2f();
+        mSampler->StartPath(Rng::kCameraStream, aPixelIndex, mCurrentIteration);
+        const Vec2f sample = Vec2f(float(x), float(y)) + mSampler->Get2D();
 
         // Generate ray
         const Ray primaryRay = camera.GenerateRay(sample);
@@ -599,14 +1332,17 @@ private:
 
         // Eye sub-path MIS quantities. Implements [tech. rep. (31)-(33)] partially.
         // The evaluation is completed after tracing the camera ray in the eye sub-path loop.
-        oCameraState.dVCM = Mis(mLightSubPathCount / cameraPdfW);
+        oCameraState.dVCM = kUseDVCM ?
+            Mis(mLightSubPathCount / cameraPdfW) * mMisBoundaryFactor : 0.f;
         oCameraState.dVC  = 0;
         oCameraState.dVM  = 0;
 
+        oCameraState.mDimension = mSampler->GetDimension();
+
         return sample;
     }
 
-    // Returns the radiance of a light source when hit by a random ray,
+    // Returns the radiance of light aLightID when hit by a random ray,
     // multiplied by MIS weight. Can be used for both Background and Area lights.
     //
     // For Background lights:
@@ -616,17 +1352,16 @@ private:
     // For Area lights:
     //    Has to be called AFTER updating the MIS quantities.
     Vec3f GetLightRadiance(
-        const AbstractLight *aLight,
+        const int           aLightID,
         const SubPathState  &aCameraState,
         const Vec3f         &aHitpoint,
         const Vec3f         &aRayDirection) const
     {
-        // We sample lights uniformly
-        const int   lightCount    = mScene.GetLightCount();
-        const float lightPickProb = 1.f / lightCount;
+        const AbstractLight *light = mScene.GetLightPtr(aLightID);
+        const float lightPickProb  = mScene.GetLightPickProb(aLightID);
 
         float directPdfA, emissionPdfW;
-        const Vec3f radiance = aLight->GetRadiance(mScene.mSceneSphere,
+        const Vec3f radiance = light->GetRadiance(mScene.mSceneSphere,
             aRayDirection, aHitpoint, &directPdfA, &emissionPdfW);
 
         if(radiance.IsZero())
@@ -639,16 +1374,18 @@ private:
         // When using only vertex merging, we want purely specular paths
         // to give radiance (cannot get it otherwise). Rest is handled
         // by merging and we should return 0.
-        if(mUseVM && !mUseVC)
+        if(kUseVM && !kUseVC)
             return aCameraState.mSpecularPath ? radiance : Vec3f(0);
 
         directPdfA   *= lightPickProb;
         emissionPdfW *= lightPickProb;
 
         // Partial eye sub-path MIS weight [tech. rep. (43)].
-        // If the last hit was specular, then dVCM == 0.
+        // If the last hit was specular, then dVCM == 0. Direct illumination
+        // (dVCM) has the sample count of this technique, the rest (dVC)
+        // is relative to connections.
         const float wCamera = Mis(directPdfA) * aCameraState.dVCM +
-            Mis(emissionPdfW) * aCameraState.dVC;
+            mMisVcCountFactor * Mis(emissionPdfW) * aCameraState.dVC;
 
         // Partial light sub-path weight is 0 [tech. rep. (42)].
 
@@ -659,19 +1396,19 @@ private:
     }
 
     // Connects camera vertex to randomly chosen light point.
-    // Returns emitted radiance multiplied by path MIS weight.
+    // Returns emitted radiance multiplied by path MIS weight, valid only
+    // when the returned oShadowRay is not occluded.
     // Has to be called AFTER updating the MIS quantities.
     Vec3f DirectIllumination(
         const SubPathState &aCameraState,
         const Vec3f        &aHitpoint,
-        const CameraBSDF   &aBsdf)
+        const CameraBSDF   &aBsdf,
+        Ray                &oShadowRay,
+        Isect              &oShadowIsect)
     {
-        // We sample lights uniformly
-        const int   lightCount    = mScene.GetLightCount();
-        const float lightPickProb = 1.f / lightCount;
-
-        const int   lightID       = int(mRng.GetFloat() * lightCount);
-        const Vec2f rndPosSamples = mRng.GetVec2f();
+        const int   lightID       = mScene.PickLight(mSampler->Get1D());
+        const float lightPickProb = mScene.GetLightPickProb(lightID);
+        const Vec2f rndPosSamples = mSampler->Get2D();
 
         const AbstractLight *light = mScene.GetLightPtr(lightID);
 
@@ -722,9 +1459,11 @@ private:
         //    ratio = (emissionPdfW * cosToLight) / (directPdfW * cosAtLight)
         //
         // Also note that both emissionPdfW and directPdfW should be
-        // multiplied by lightPickProb, so it cancels out.
-        const float wCamera = Mis(emissionPdfW * cosToLight / (directPdfW * cosAtLight)) * (
-            mMisVmWeightFactor + aCameraState.dVCM + aCameraState.dVC * Mis(bsdfRevPdfW));
+        // multiplied by lightPickProb, so it cancels out. The sum is
+        // relative to connections, hence mMisVcCountFactor.
+        const float wCamera = Mis(emissionPdfW * cosToLight / (directPdfW * cosAtLight)) *
+            mMisVcCountFactor * (mMisVmWeightFactor + aCameraState.dVCM +
+            aCameraState.dVC * Mis(bsdfRevPdfW));
 
         // Full path MIS weight [tech. rep. (37)]
         const float misWeight = 1.f / (wLight + 1.f + wCamera);
@@ -732,23 +1471,52 @@ private:
         const Vec3f contrib =
             (misWeight * cosToLight / (lightPickProb * directPdfW)) * (radiance * bsdfFactor);
 
-        if(contrib.IsZero() || mScene.Occluded(aHitpoint, directionToLight, distance))
+        if(contrib.IsZero())
             return Vec3f(0);
 
+        mScene.SetupShadowRay(aHitpoint, directionToLight, distance,
+            oShadowRay, oShadowIsect);
         return contrib;
     }
 
+    // Connects camera vertex to stored light vertex aIdx, and adds the
+    // connection, scaled by aScale, to mConnections unless it is zero
+    void AddVertexConnection(
+        const int          aIdx,
+        const float        aScale,
+        const CameraBSDF   &aCameraBsdf,
+        const Vec3f        &aCameraHitpoint,
+        const SubPathState &aCameraState)
+    {
+        const LightVertexArray &lightVertices = mLightPaths->mLightVertices;
+        const LightVertex &lightVertex = lightVertices.mVertices[aIdx];
+
+        Ray   shadowRay;
+        Isect shadowIsect;
+        const Vec3f contrib = ConnectVertices(lightVertex,
+            lightVertices.mPositions[aIdx], aCameraBsdf, aCameraHitpoint,
+            aCameraState, shadowRay, shadowIsect);
+
+        if(!contrib.IsZero())
+            mConnections.Add(aCameraState.mThroughput *
+                lightVertex.mThroughput * (aScale * contrib), shadowRay, shadowIsect);
+    }
+
     // Connects an eye and a light vertex. Result multiplied by MIS weight, but
-    // not multiplied by vertex throughputs. Has to be called AFTER updating MIS
+    // not multiplied by vertex throughputs, and valid only when the returned
+    // oShadowRay is not occluded. Has to be called AFTER updating MIS
     // constants. 'direction' is FROM eye TO light vertex.
     Vec3f ConnectVertices(
         const LightVertex  &aLightVertex,
+        const Vec3f        &aLightHitpoint,
         const CameraBSDF   &aCameraBsdf,
         const Vec3f        &aCameraHitpoint,
-        const SubPathState &aCameraState) const
+        const SubPathState &aCameraState,
+        Ray                &oShadowRay,
+        Isect              &oShadowIsect) const
     {
         // Get the connection
-        Vec3f direction   = aLightVertex.mHitpoint - aCameraHitpoint;
+        Vec3f direction   = aLightHitpoint - aCameraHitpoint;
         const float dist2 = direction.LenSqr();
         float  distance   = std::sqrt(dist2);
         direction        /= distance;
@@ -767,9 +1535,13 @@ private:
         cameraBsdfDirPdfW *= cameraCont;
         cameraBsdfRevPdfW *= cameraCont;
 
-        // Evaluate BSDF at light vertex
+        // Rebuild and evaluate BSDF at light vertex
+        LightBSDF lightBsdf;
+        lightBsdf.Setup(DecodeOctahedral(aLightVertex.mNormal),
+            DecodeOctahedral(aLightVertex.mDirFix), aLightVertex.mMaterialID, mScene);
+
         float cosLight, lightBsdfDirPdfW, lightBsdfRevPdfW;
-        const Vec3f lightBsdfFactor = aLightVertex.mBsdf.Evaluate(
+        const Vec3f lightBsdfFactor = lightBsdf.Evaluate(
             mScene, -direction, cosLight, &lightBsdfDirPdfW,
             &lightBsdfRevPdfW);
 
@@ -777,7 +1549,7 @@ private:
             return Vec3f(0);
 
         // Light continuation probability (for Russian roulette)
-        const float lightCont = aLightVertex.mBsdf.ContinuationProb();
+        const float lightCont = aLightVertex.mContinuationProb;
         lightBsdfDirPdfW *= lightCont;
         lightBsdfRevPdfW *= lightCont;
 
@@ -803,9 +1575,11 @@ private:
 
         const Vec3f contrib = (misWeight * geometryTerm) * cameraBsdfFactor * lightBsdfFactor;
 
-        if(contrib.IsZero() || mScene.Occluded(aCameraHitpoint, direction, distance))
+        if(contrib.IsZero())
             return Vec3f(0);
 
+        mScene.SetupShadowRay(aCameraHitpoint, direction, distance,
+            oShadowRay, oShadowIsect);
         return contrib;
     }
 
@@ -813,16 +1587,17 @@ private:
     // Light tracing methods
     //////////////////////////////////////////////////////////////////////////
 
-    // Samples light emission
-    void GenerateLightSample(SubPathState &oLightState)
+    // Samples emission of light sub-path aPathIndex
+    void GenerateLightSample(
+        const int    aPathIndex,
+        SubPathState &oLightState)
     {
-        // We sample lights uniformly
-        const int   lightCount    = mScene.GetLightCount();
-        const float lightPickProb = 1.f / lightCount;
+        mSampler->StartPath(Rng::kLightStream, aPathIndex, mCurrentIteration);
 
-        const int   lightID       = int(mRng.GetFloat() * lightCount);
-        const Vec2f rndDirSamples = mRng.GetVec2f();
-        const Vec2f rndPosSamples = mRng.GetVec2f();
+        const int   lightID       = mScene.PickLight(mSampler->Get1D());
+        const float lightPickProb = mScene.GetLightPickProb(lightID);
+        const Vec2f rndDirSamples = mSampler->Get2D();
+        const Vec2f rndPosSamples = mSampler->Get2D();
 
         const AbstractLight *light = mScene.GetLightPtr(lightID);
 
@@ -837,24 +1612,26 @@ private:
         oLightState.mThroughput    /= emissionPdfW;
         oLightState.mPathLength    = 1;
         oLightState.mIsFiniteLight = light->IsFinite() ? 1 : 0;
+        oLightState.mDimension     = mSampler->GetDimension();
 
         // Light sub-path MIS quantities. Implements [tech. rep. (31)-(33)] partially.
         // The evaluation is completed after tracing the emission ray in the light sub-path loop.
         // Delta lights are handled as well [tech. rep. (48)-(50)].
         {
-            oLightState.dVCM = Mis(directPdfA / emissionPdfW);
+            oLightState.dVCM = kUseDVCM ?
+                Mis(directPdfA / emissionPdfW) * mMisBoundaryFactor : 0.f;
 
-            if(!light->IsDelta())
+            if(kUseDVC && !light->IsDelta())
             {
                 const float usedCosLight = light->IsFinite() ? cosLight : 1.f;
-                oLightState.dVC = Mis(usedCosLight / emissionPdfW);
+                oLightState.dVC = Mis(usedCosLight / emissionPdfW) * mMisBoundaryFactor;
             }
             else
             {
                 oLightState.dVC = 0.f;
             }
 
-            oLightState.dVM = oLightState.dVC * mMisVcWeightFactor;
+            oLightState.dVM = kUseDVM ? oLightState.dVC * mMisVcWeightFactor : 0.f;
         }
     }
 
@@ -907,13 +1684,14 @@ private:
         // Partial light sub-path weight [tech. rep. (46)]. Note the division by
         // mLightPathCount, which is the number of samples this technique uses.
         // This division also appears a few lines below in the framebuffer accumulation.
-        const float wLight = Mis(cameraPdfA / mLightSubPathCount) * (
+        // The sum is relative to connections, hence mMisVcCountFactor.
+        const float wLight = Mis(cameraPdfA / mLightSubPathCount) * mMisVcCountFactor * (
             mMisVmWeightFactor + aLightState.dVCM + aLightState.dVC * Mis(bsdfRevPdfW));
 
         // Partial eye sub-path weight is 0 [tech. rep. (47)]
 
         // Full path MIS weight [tech. rep. (37)]. No MIS for traditional light tracing.
-        const float misWeight = mLightTraceOnly ? 1.f : (1.f / (wLight + 1.f));
+        const float misWeight = kLightTraceOnly ? 1.f : (1.f / (wLight + 1.f));
 
         const float surfaceToImageFactor = 1.f / imageToSurfaceFactor;
 
@@ -926,10 +1704,11 @@ private:
 
         if(!contrib.IsZero())
         {
+            mStats.mShadowRays++;
             if(mScene.Occluded(aHitpoint, directionToCamera, distance))
                 return;
 
-            mFramebuffer.AddColor(imagePos, contrib);
+            SplatColor(imagePos, contrib);
         }
     }
 
@@ -942,7 +1721,7 @@ private:
         SubPathState             &aoState)
     {
         // x,y for direction, z for component. No rescaling happens
-        Vec3f rndTriplet  = mRng.GetVec3f();
+        Vec3f rndTriplet  = mSampler->Get3D();
         float bsdfDirPdfW, cosThetaOut;
         uint  sampledEvent;
 
@@ -962,7 +1741,7 @@ private:
 
         // Russian roulette
         const float contProb = aBsdf.ContinuationProb();
-        if(mRng.GetFloat() > contProb)
+        if(mSampler->Get1D() > contProb)
             return false;
 
         bsdfDirPdfW *= contProb;
@@ -979,23 +1758,26 @@ private:
             //aoState.dVC *= Mis(cosThetaOut / bsdfDirPdfW) * Mis(bsdfRevPdfW);
             //aoState.dVM *= Mis(cosThetaOut / bsdfDirPdfW) * Mis(bsdfRevPdfW);
             assert(bsdfDirPdfW == bsdfRevPdfW);
-            aoState.dVC *= Mis(cosThetaOut);
-            aoState.dVM *= Mis(cosThetaOut);
+            if(kUseDVC) aoState.dVC *= Mis(cosThetaOut);
+            if(kUseDVM) aoState.dVM *= Mis(cosThetaOut);
 
             aoState.mSpecularPath &= 1;
         }
         else
         {
             // Implements [tech. rep. (34)-(36)] (partially, as noted above)
-            aoState.dVC = Mis(cosThetaOut / bsdfDirPdfW) * (
-                aoState.dVC * Mis(bsdfRevPdfW) +
-                aoState.dVCM + mMisVmWeightFactor);
+            if(kUseDVC)
+                aoState.dVC = Mis(cosThetaOut / bsdfDirPdfW) * (
+                    aoState.dVC * Mis(bsdfRevPdfW) +
+                    aoState.dVCM + mMisVmWeightFactor);
 
-            aoState.dVM = Mis(cosThetaOut / bsdfDirPdfW) * (
-                aoState.dVM * Mis(bsdfRevPdfW) +
-                aoState.dVCM * mMisVcWeightFactor + 1.f);
+            if(kUseDVM)
+                aoState.dVM = Mis(cosThetaOut / bsdfDirPdfW) * (
+                    aoState.dVM * Mis(bsdfRevPdfW) +
+                    aoState.dVCM * mMisVcWeightFactor + 1.f);
 
-            aoState.dVCM = Mis(1.f / bsdfDirPdfW);
+            if(kUseDVCM)
+                aoState.dVCM = Mis(1.f / bsdfDirPdfW);
 
             aoState.mSpecularPath &= 0;
         }
@@ -1008,27 +1790,29 @@ private:
 
 private:
 
-    bool  mUseVM;             // Vertex merging (of some form) is used
-    bool  mUseVC;             // Vertex connection (BPT) is used
-    bool  mLightTraceOnly;    // Do only light tracing
-    bool  mPpm;               // Do PPM, same terminates camera after first merge
-
     float mRadiusAlpha;       // Radius reduction rate parameter
     float mBaseRadius;        // Initial merging radius
     float mMisVmWeightFactor; // Weight of vertex merging (used in VC)
     float mMisVcWeightFactor; // Weight of vertex connection (used in VM)
+    float mMisVcCountFactor;  // Mis(n_VC), samples of connections to light vertices
+    float mMisBoundaryFactor; // Mis(1 / n_VC), light tracing and direct illumination
     float mScreenPixelCount;  // Number of pixels
     float mLightSubPathCount; // Number of light sub-paths
     float mVmNormalization;   // 1 / (Pi * radius^2 * light_path_count)
+    float mRadius;            // Merging radius of the current iteration
+
+    int   mGridCellCount;     // Number of hash grid cells, 0 means one per pixel
+    bool  mMortonOrder;       // Sort light vertices by cell for merging
+    int   mConnectionCount;   // Light vertices picked per camera vertex, 0 ~ own path
+    int   mLastVertexCount;   // Light vertices of the previous iteration, for n_VC
 
-    std::vector<LightVertex> mLightVertices; //!< Stored light vertices
+    Wavefront        mWave;
+    Connections      mConnections;
 
-    // For light path belonging to pixel index [x] it stores
-    // where it's light vertices end (begin is at [x-1])
-    std::vector<int> mPathEnds;
-    HashGrid         mHashGrid;
+    LightPaths       mOwnLightPaths;
+    LightPaths       *mLightPaths; // Own, or main renderer's when cooperating
 
-    Rng              mRng;
+    int              mCurrentIteration;
 };
 
 #endif //__VERTEXCM_HXX__